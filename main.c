@@ -1,28 +1,69 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <wchar.h>
 #include <wctype.h>
 #include <string.h>
+#include <strings.h>
 #include <locale.h>
 #include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <sys/stat.h>
+#include <math.h>
 #include <xkbcommon/xkbcommon.h>
 #include <X11/Xlib.h>
 #include <X11/XKBlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
 
 /* ========== CONSTANTS AND DEFINITIONS ========== */
 #define MAX_WORD_LEN 256
-#define MAX_DICT_SIZE 100000
-#define INPUT_DEVICE "/dev/input/event3"  // Укажи своё устройство
+#define INPUT_DIR "/dev/input"      // клавиатуры ищутся здесь (eventN) и подключаются на ходу
+#define MAX_INPUT_DEVICES 16
 #define UINPUT_DEVICE "/dev/uinput"
-#define DICT_FILE_ENG "english_dict.txt"
-#define DICT_FILE_RUS "russian_dict.txt"
+#define UINPUT_VENDOR 0x1234        // по id своя виртуальная клавиатура отличается от настоящих
+#define UINPUT_PRODUCT 0xfedc
+#define UINPUT_READY_TIMEOUT_MS 1000    // столько ждём, пока udev обработает виртуальную клавиатуру
+#define UDEV_DATA_DIR "/run/udev/data"  // база udev: c<major>:<minor> пишется по окончании обработки
+#define KEY_BITS_SIZE (KEY_MAX / 8 + 1)
+#define KEY_BIT(bits, code) (((bits)[(code) / 8] >> ((code) % 8)) & 1)
+#define SET_KEY_BIT(bits, code) ((bits)[(code) / 8] |= (unsigned char)(1u << ((code) % 8)))
+#define DEFAULT_LAYOUTS "us,ru"         // если раскладки не удалось узнать у X11/GNOME и нет --layouts
+#define MAX_LAYOUTS 4                   // больше групп XKB не бывает
+#define DICT_FILE_PATTERN "%s_dict.txt" // словарь раскладки по её имени, например ua_dict.txt
+#define DICT_INDEX_SUFFIX ".idx"        // скомпилированный словарь рядом с текстовым
+#define DICT_INDEX_MAGIC 0x58444c4fu    // "OLDX"
+#define DICT_INDEX_VERSION 3           // 2: вес слова в старшем байте слота индекса, 3: флаги
+#define DICT_INDEX_RANKED 1u           // флаг индекса: веса из частот, а не средние
+#define NGRAM_FILE "layout.ngram"       // модель n-грамм, собирается режимом --train-ngram
+#define NGRAM_MAGIC 0x4d474e4fu         // "ONGM"
+#define NGRAM_VERSION 2
 
 #define ESC_KEY_CODE 1
 #define SPACE_KEY_CODE 57
@@ -31,81 +72,1134 @@
 #define LEFTARROW_KEY_CODE 105
 #define LEFTALT_KEY_CODE 56
 #define LEFTMETA_KEY_CODE 125 // Super
+#define LEFTCTRL_KEY_CODE 29
+#define RIGHTALT_KEY_CODE 100 // AltGr в раскладках с третьим уровнем
+#define PAUSE_KEY_CODE 119    // Pause/Break: конвертация выделения, с Shift — буфера обмена
+#define SELECTION_RESTORE_MS 500 // через столько после вставки по Pause CLIPBOARD возвращается пользователю
 
-// Минимальные задержки для Wayland
+// Задержки для Wayland по умолчанию (настройки switch_delay, delete_delay)
+// и прежняя пауза после каждой клавиши (для сравнения в --bench-inject)
 #define LAYOUT_SWITCH_DELAY 100000  // 100 мс
 #define KEY_PRESS_DELAY 10000       // 10 мс
 #define DELETE_WORD_DELAY 30000     // 30 мс
+#define INJECT_BATCH_MAX 1024       // событий в одном пакете uinput
+// Запись в uinput не переполняется, события теряются у читателя: буфер клиента evdev
+// (X, libinput) — около 128 событий, при переполнении он видит SYN_DROPPED. Поэтому
+// пакет уходит порциями с паузой, за которую читатель успевает их забрать
+#define INJECT_CHUNK_EVENTS 64
+#define INJECT_CHUNK_PAUSE_US 1000
+#define CAPTURE_RING_SIZE 4096      // событий между потоком захвата и анализом
+#define JOB_RING_SIZE 512           // заданий между анализом и потоком инжекции
+#define RECENT_WORDS 4              // слов перед текущим, которые исправляются задним числом
+#define RECENT_WORD_LEN 32          // более длинные слова историю прерывают
+#define RECENT_SHORT_LEN 2          // словарные слова не длиннее этого тоже пересматриваются ("j" -> "о")
 
-// Структура словаря
+// Уровни журнала. LOG_MAX_LEVEL отсекает сообщения при компиляции
+// (-DLOG_MAX_LEVEL=LOG_INFO убирает вывод на каждое нажатие), log_level — при запуске (--log-level)
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3     // на каждое слово
+#define LOG_TRACE 4     // на каждое нажатие
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_TRACE
+#endif
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= LOG_MAX_LEVEL && (level) <= atomic_load_explicit(&log_level, memory_order_relaxed)) \
+            wprintf(__VA_ARGS__); \
+    } while (0)
+
+#define DICT_RELOAD_SETTLE_MS 200    // пауза после последнего изменения словаря перед пересборкой
+#define LEARN_FILE_NAME "learned_words.log"
+#define LEARN_CAPACITY 4096         // слотов таблицы обучения, заполняется не больше чем наполовину
+#define LEARN_WORD_MAX 64           // байт UTF-8 вместе с завершающим нулём
+#define LEARN_REPEAT_MIN 3          // столько раз набранное и не исправленное слово больше не трогаем
+#define LEARN_SEEN_SLOTS 1024       // дальше таблица пополняется только отменами исправлений
+#define LEARN_SKETCH_ROWS 4         // счётчики слов, набранных реже LEARN_REPEAT_MIN раз
+#define LEARN_SKETCH_WIDTH 16384
+#define LEARN_SKETCH_DECAY 8192     // через столько наборов счётчики делятся пополам
+#define LEARN_FLUSH_MS 1000         // записи журнала копятся до fsync
+#define LEARN_COMPACT_LINES 4096    // длиннее журнал сжимается
+#define STATS_SOCKET_NAME "layout_switcher.sock"  // в $XDG_RUNTIME_DIR; без него сокета нет
+#define CONTROL_CLIENTS 4           // одновременных соединений сокета управления
+#define WINDOW_CACHE_SIZE 16        // окон, для которых помнятся раскладка и профиль
+#define CONFIG_FILE_NAME "config"   // в $XDG_CONFIG_HOME/layout_switcher, иначе в ~/.config/layout_switcher
+#define HIST_BUCKETS 40             // корзина b — задержки в [2^(b-1), 2^b) нс, последняя — всё больше
+
+// Темп инжекции; в профиле приложения -1 — как в общих настройках
+typedef struct {
+    int key_delay_us;       // пауза между нажатиями, 0 — пакет порциями по INJECT_CHUNK_EVENTS
+    int switch_delay_us;    // после сочетания переключения раскладки (без X11)
+    int delete_delay_us;    // после стирания слова, если приложение не успевало за вводом
+} InjectPacing;
+
+// Пакет событий для uinput
+typedef struct {
+    int fd;
+    Display *display;       // собственное соединение X11 потока инжекции (XkbLockGroup)
+    bool use_super_space;
+    bool direct;            // группа переключается сочетаниями keymap внутри пакета (send_text_direct)
+    struct input_event events[INJECT_BATCH_MAX];
+    size_t count;
+    InjectPacing pacing;    // темп: общий или профиля приложения из последнего задания
+    unsigned long flushes;
+    unsigned long writes;
+    unsigned long events_sent;
+} Injector;
+
+// Чем закончилось решение по слову
+typedef enum {
+    WORD_KEPT,          // есть в словаре набранной раскладки
+    WORD_UNDECIDED,     // нет ни в одном словаре, модель не уверена
+    WORD_CORRECTED,
+    WORD_LEARNED        // оставлено по таблице обучения, не трогаем и задним числом
+} WordDecision;
+
+// Слово из недавней истории: клавиши, раскладка набора и что с ним сделано
+typedef struct {
+    uint8_t keys[RECENT_WORD_LEN];  // позиции в WORD_KEYS
+    uint32_t shifted;               // биты клавиш, нажатых с Shift
+    uint8_t len;
+    int8_t typed_layout;
+    int8_t layout;                  // раскладка, в которой слово сейчас на экране
+    uint8_t decision;               // WordDecision
+} RecentWord;
+
+// Последние RECENT_WORDS слов перед текущим. count — сколько из них идут подряд
+// через одиночные пробелы до курсора: только их можно стереть и набрать заново
+typedef struct {
+    RecentWord words[RECENT_WORDS];
+    unsigned head;                  // следующая запись — words[head % RECENT_WORDS]
+    unsigned count;
+} RecentWords;
+
+// Состояние набираемого слова
+typedef struct {
+    wchar_t word[MAX_WORD_LEN];        // символы первого уровня раскладки, без учёта Shift
+    uint8_t shifted[MAX_WORD_LEN];     // 1 — символ набран с Shift: исправление его сохраняет
+    int word_len;
+    uint32_t trie_path[MAX_WORD_LEN];  // trie_path[i] — узел графа клавиш после i символов
+    unsigned long generation;          // набор словарей, по графу которого построен trie_path
+    RecentWords recent;                // reset_word не трогает: история переживает слово
+    unsigned long focus_changes;       // смена активного окна, после которой набирается слово
+    bool shift_pressed;
+    bool alt_pressed;
+    bool super_pressed;
+} WordState;
+
+// Способ стереть набранное слово перед повторным вводом
+typedef enum {
+    CORRECT_SELECT,             // Shift + Left на каждый символ, затем Backspace
+    CORRECT_BACKSPACE,          // Backspace на каждый символ, одним пакетом
+    CORRECT_CTRL_BACKSPACE      // Ctrl + Backspace: слово целиком одним аккордом
+} CorrectionStrategy;
+
+#define MAX_APP_RULES 32
+
+// Профиль приложения по WM_CLASS окна в фокусе. У общего профиля wm_class пуст,
+// у профиля приложения -1 в поле — значение общего
 typedef struct {
-    wchar_t **words;
+    char wm_class[64];
+    int strategy;           // CorrectionStrategy или -1
+    InjectPacing pacing;
+    int exclude;            // 1 — слова в окне не проверяются и не исправляются, -1 — как в общем
+} AppProfile;
+
+typedef struct {
+    AppProfile defaults;
+    AppProfile apps[MAX_APP_RULES];
+    size_t count;
+} AppProfiles;
+
+// Сочетание, которым пользователь переключает раскладку
+typedef enum {
+    HOTKEY_AUTO,            // из опций XKB сервера X11, без X11 — из настроек GNOME
+    HOTKEY_SHIFT_ALT,
+    HOTKEY_SUPER_SPACE
+} SwitchHotkey;
+
+// Настройки запуска: значения по умолчанию, затем файл конфигурации, затем аргументы.
+// Профили, remember_layout и уровень журнала меняются и на ходу через сокет управления
+typedef struct {
+    char layouts[128];          // пусто — раскладки X11 или GNOME
+    char xkb_rules[64];
+    char xkb_model[64];
+    char xkb_options[128];      // пусто — по сочетанию переключения
+    SwitchHotkey switch_hotkey;
+    char inject[16];            // direct или switch, пусто — по наличию X11
+    char devices[MAX_INPUT_DEVICES][PATH_MAX];
+    int device_count;
+    char dict_dir[PATH_MAX];    // словари и модель n-грамм, пусто — текущий каталог
+    char learn_file[PATH_MAX];
+    char stats_socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    bool remember_layout;       // окно получает фокус в той раскладке, в которой его оставили
+    AppProfiles profiles;
+} Config;
+
+// Терминалы не выделяют текст по Shift + Left, а Ctrl + Backspace там стирает один символ
+static const char *const terminal_classes[] = {
+    "xterm", "uxterm", "urxvt", "gnome-terminal-server", "konsole", "xfce4-terminal",
+    "alacritty", "kitty", "terminator", "tilix", "st-256color", "wezterm", "foot"
+};
+
+// Окна ввода паролей: поле пароля X11 не различает, поэтому исключаются окна целиком
+static const char *const password_classes[] = {
+    "pinentry", "pinentry-gtk-2", "pinentry-qt", "gcr-prompter", "ssh-askpass", "keepassxc",
+    "polkit-gnome-authentication-agent-1", "lxqt-policykit-agent"
+};
+
+// Вес слова — насколько оно частое: 63 - 3·log2(ранг + 1), шаг в треть бита частоты.
+// Ранг — номер строки в словаре, отсортированном по частоте, или место по числу
+// "слово число" в строке. Словарь по алфавиту частот не содержит, его слова получают
+// одинаковый средний вес. 0 — слова нет
+#define DICT_WEIGHT_MAX 63
+#define DICT_WEIGHT_STEPS 3          // шагов веса на удвоение частоты
+#define DICT_SLOT_WORD 0x00FFFFFFu   // слот индекса: номер слова + 1 и вес в старшем байте
+#define DICT_SLOT_WEIGHT_SHIFT 24
+#define DICT_SORTED_SHARE 0.95       // доля пар строк по алфавиту, при которой порядок — не частота
+#define DICT_OVERRIDE_MARGIN 6       // слово, верное как набрано, уступает вчетверо более частому
+
+// Структура словаря: все слова лежат подряд в одной арене в UTF-8
+typedef struct {
+    char *arena;            // слова в UTF-8, каждое завершено '\0'
+    size_t arena_size;
+    size_t arena_capacity;
+    uint32_t *offsets;      // смещение каждого слова в арене
     size_t count;
+    size_t capacity;
+    uint8_t *weights;       // вес каждого слова до построения индекса; NULL — средний вес
+    bool ranked;            // веса из частот или порядка строк; иначе у всех слов средний
+    uint32_t *index;        // хеш-таблица с открытой адресацией: слот DICT_SLOT_*, 0 — пустой слот
+    size_t index_mask;      // размер таблицы - 1 (размер — степень двойки)
+    void *mapping;          // отображённый .idx-файл, если словарь загружен из него
+    size_t mapping_size;
 } Dictionary;
 
-// Таблицы символов для раскладок
-static const wchar_t eng_chars[] = L"qwertyuiop[]asdfghjkl;'zxcvbnm,./`QWERTYUIOP{}ASDFGHJKL:\"ZXCVBNM<>?~";
-static const wchar_t rus_chars[] = L"йцукенгшщзхъфывапролджэячсмитьбю.ёЙЦУКЕНГШЩЗХЪФЫВАПРОЛДЖЭЯЧСМИТЬБЮ,Ё";
-
-// Таблица соответствия кодов клавиш и символов QWERTY
-static const struct {
-    int key_code;
-    wchar_t eng_char;
-} key_map[] = {
-        {KEY_Q, L'q'}, {KEY_W, L'w'}, {KEY_E, L'e'}, {KEY_R, L'r'}, {KEY_T, L't'},
-        {KEY_Y, L'y'}, {KEY_U, L'u'}, {KEY_I, L'i'}, {KEY_O, L'o'}, {KEY_P, L'p'},
-        {KEY_A, L'a'}, {KEY_S, L's'}, {KEY_D, L'd'}, {KEY_F, L'f'}, {KEY_G, L'g'},
-        {KEY_H, L'h'}, {KEY_J, L'j'}, {KEY_K, L'k'}, {KEY_L, L'l'}, {KEY_Z, L'z'},
-        {KEY_X, L'x'}, {KEY_C, L'c'}, {KEY_V, L'v'}, {KEY_B, L'b'}, {KEY_N, L'n'},
-        {KEY_M, L'm'}, {KEY_1, L'1'}, {KEY_2, L'2'}, {KEY_3, L'3'}, {KEY_4, L'4'},
-        {KEY_5, L'5'}, {KEY_6, L'6'}, {KEY_7, L'7'}, {KEY_8, L'8'}, {KEY_9, L'9'},
-        {KEY_0, L'0'}, {KEY_MINUS, L'-'}, {KEY_EQUAL, L'='}, {KEY_LEFTBRACE, L'['},
-        {KEY_RIGHTBRACE, L']'}, {KEY_SEMICOLON, L';'}, {KEY_APOSTROPHE, L'\''},
-        {KEY_GRAVE, L'`'}, {KEY_BACKSLASH, L'\\'}, {KEY_COMMA, L','}, {KEY_DOT, L'.'},
-        {KEY_SLASH, L'/'}
+// Общий для всех раскладок префиксный граф по физическим клавишам. Слово из словаря
+// переводится в последовательность позиций клавиш (slot в WORD_KEYS),
+// поэтому путь по графу одинаков для набранного слова и всех его конвертированных форм.
+#define TRIE_KEYS 47                // клавиш в WORD_KEYS
+#define TRIE_ROOT 0u
+#define TRIE_DEAD UINT32_MAX        // путь вышел за пределы всех словарей
+#define TRIE_WORD(layout) (1u << (layout))                      // путь — слово словаря раскладки
+#define TRIE_PREFIX(layout) (1u << (MAX_LAYOUTS + (layout)))    // под узлом есть слова раскладки
+#define TRIE_WORDS ((1u << MAX_LAYOUTS) - 1)
+// Вес слова каждой раскладки (до DICT_WEIGHT_MAX) — в оставшихся битах флагов: 8 + 4·6 = 32
+#define TRIE_WEIGHT_BITS 6
+#define TRIE_WEIGHT_SHIFT(layout) (2 * MAX_LAYOUTS + TRIE_WEIGHT_BITS * (layout))
+#define TRIE_WEIGHT(flags, layout) (((flags) >> TRIE_WEIGHT_SHIFT(layout)) & ((1u << TRIE_WEIGHT_BITS) - 1))
+
+typedef struct {
+    uint64_t child_mask;    // бит k — есть переход по клавише k
+    uint32_t first_child;   // дети лежат подряд в порядке клавиш
+    uint32_t flags;         // TRIE_WORD, TRIE_PREFIX и TRIE_WEIGHT: узел со всем нужным — одно чтение
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;
+    size_t count;
+} KeyTrie;
+
+// Нечёткий поиск по тем же клавишам (SymSpell): для каждого слова словарей в таблицу
+// кладутся хеши его первых FUZZY_PREFIX клавиш без одной и без двух клавиш. Запрос
+// порождает такие же варианты, кандидаты проверяются расстоянием Дамерау — Левенштейна.
+// Опечатка "ghbdtnn" находит "привет" сразу во всех раскладках, без конвертации
+#define FUZZY_MAX_DISTANCE 2
+#define FUZZY_PREFIX 7
+#define FUZZY_VARIANTS (1 + FUZZY_PREFIX + FUZZY_PREFIX * (FUZZY_PREFIX - 1) / 2)
+#define FUZZY_MIN_LEN 4             // более короткие слова нечётким поиском не исправляются
+#define FUZZY_LONG_LEN 8            // с этой длины допускаются две ошибки
+#define FUZZY_MAX_KEYS 32           // более длинные слова в индекс не попадают
+#define FUZZY_MIN_VARIANT (FUZZY_MIN_LEN - 1)  // короче запрос не укорачивается, а такие варианты общие у тысяч слов
+#define FUZZY_MAX_CANDIDATES 256    // проверок расстояния на запрос: поиск не дольше долей миллисекунды
+#define FUZZY_WORD_MASK 0x00FFFFFFu // слот: старшие 8 бит — тег хеша, младшие — номер слова + 1
+
+typedef struct {
+    uint32_t *slots;        // открытая адресация, 0 — пустой слот
+    size_t mask;
+    uint8_t *keys;          // клавиши всех слов подряд
+    uint32_t *offsets;      // [count + 1]: начало клавиш слова
+    uint8_t *layouts;       // раскладка слова
+    size_t count;
+    size_t entries;
+} FuzzyIndex;
+
+// Модель триграмм по тем же клавишам: для каждой раскладки log2 P(клавиша | две предыдущие),
+// обученная по её словарю. Набранное слово и все его конвертированные формы — одна и та же
+// последовательность клавиш, поэтому все раскладки оцениваются одним проходом,
+// по одному чтению таблицы на символ для каждой. Символы модели — только клавиши,
+// которые хотя бы в одной раскладке дают букву (LayoutSet.symbols), и граница слова
+#define NGRAM_SCALE 256                     // логарифмы хранятся в 1/256 бита
+#define NGRAM_MIN_LEN 3                     // более короткие слова моделью не исправляются
+#define NGRAM_MARGIN (NGRAM_SCALE * 3 / 2)  // нужный перевес другого языка на символ (1.5 бита)
+#define NGRAM_CONTEXT_MARGIN (NGRAM_SCALE / 2)  // то же для слова перед уже исправленным (0.5 бита)
+#define NGRAM_SHORT_CONTEXT_MARGIN (-NGRAM_SCALE / 2)  // для короткого слова не из словарей: однобуквенных
+                                                      // слов в словарях нет, и модель их почти не знает
+
+typedef struct {
+    const int16_t *logprob;     // [a][b][c][раскладка]: оценки всех раскладок для триграммы рядом
+    int layouts;
+    int symbols;                // буквенные клавиши и граница слова (последний символ)
+    uint32_t trained;           // бит l — раскладка обучена по непустому словарю
+    void *mapping;              // отображённый файл модели; NULL — таблицы обучены при запуске
+    size_t mapping_size;
+} NgramModel;
+
+// Заголовок файла модели; за ним идут таблицы. Модель устаревает вместе со словарями
+// и при смене набора раскладок
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    char layouts[MAX_LAYOUTS][16];  // имена раскладок в порядке групп
+    uint64_t source_size[MAX_LAYOUTS];
+    int64_t source_mtime_sec[MAX_LAYOUTS];
+    int64_t source_mtime_nsec[MAX_LAYOUTS];
+    uint64_t letter_keys;           // от буквенных клавиш зависит нумерация символов
+    uint32_t layout_count;
+    uint32_t symbols;
+    uint32_t scale;
+    uint32_t trained;
+} NgramHeader;
+
+// Задание для потока инжекции. Нажатия пользователя (при захвате устройства)
+// и исправления идут через одну очередь, поэтому попадают в приложение по порядку
+typedef enum {
+    JOB_FORWARD,        // передать событие клавиши как есть
+    JOB_CORRECTION,     // стереть слово, переключить раскладку, набрать target
+    JOB_PASTE,          // вставить CLIPBOARD поверх выделения (конвертация выделения)
+    JOB_PACING,         // сменить темп (настройка изменена через сокет управления, сменилось окно)
+    JOB_SWITCH_LAYOUT,  // переключить раскладку old_group -> new_group (окно получило фокус)
+    JOB_STOP
+} InjectJobType;
+
+typedef struct {
+    InjectJobType type;
+    struct input_event event;       // JOB_FORWARD
+    CorrectionStrategy strategy;    // JOB_CORRECTION
+    int erase_count;                // сколько символов стереть
+    int old_group;                  // раскладка, в которой слово набрано
+    int new_group;                  // раскладка target
+    int retro_words;                // слов перед текущим, исправленных вместе с ним (target — фраза)
+    bool terminal;                  // JOB_PASTE: в терминале вставка — Ctrl + Shift + V
+    InjectPacing pacing;            // темп окна в фокусе; остаётся и для следующих нажатий
+    uint64_t captured_ns;           // время захвата пробела, 0 — неизвестно
+    wchar_t target[MAX_WORD_LEN];
+} InjectJob;
+
+// Кольцевой буфер без блокировок: один производитель, один потребитель.
+// Индексы растут монотонно, позиция — индекс & mask
+typedef struct {
+    _Alignas(64) _Atomic size_t head;   // пишет только производитель
+    _Alignas(64) _Atomic size_t tail;   // пишет только потребитель
+    _Alignas(64) size_t mask;
+    size_t elem_size;
+    unsigned char *slots;
+} SpscRing;
+
+// Клавиатура, которую читает поток захвата
+typedef struct {
+    int fd;                     // -1 — слот свободен
+    bool grabbed;               // EVIOCGRAB удался: нажатия идут через инжектор
+    bool grab_pending;          // подключена с зажатой клавишей: захват после её отпускания
+    bool kernel_clock;          // ядро ставит метки времени по CLOCK_MONOTONIC
+    char path[128];
+    char name[64];
+} InputDevice;
+
+// Нажатие из потока захвата. У каждого устройства своё набираемое слово: буквы
+// с двух клавиатур не склеиваются. EV_SYN/SYN_DROPPED — устройство подключено,
+// отключено или ядро потеряло события: слово этого устройства сбрасывается
+typedef struct {
+    struct input_event event;
+    uint8_t device;             // слот в Pipeline.devices
+    bool grabbed;
+} CapturedEvent;
+
+// Конвейер: поток захвата -> анализ (основной поток) -> поток инжекции
+typedef struct {
+    InputDevice devices[MAX_INPUT_DEVICES];     // после запуска — только поток захвата
+    const char *device_paths[MAX_INPUT_DEVICES];    // --device; пусто — все клавиатуры из INPUT_DIR
+    int device_path_count;
+    const unsigned char *forward_keys;  // клавиши виртуальной клавиатуры (KEY_BITS_SIZE байт)
+    int capture_epoll_fd;
+    int inotify_fd;             // INPUT_DIR: подключение и отключение клавиатур
+    SpscRing captured;          // CapturedEvent
+    SpscRing jobs;              // InjectJob
+    int captured_fd;            // eventfd: в captured есть события
+    int jobs_fd;                // eventfd: в jobs есть задания
+    int stop_fd;                // eventfd: остановить поток захвата
+    _Atomic bool capture_failed;
+    Injector *injector;
+    pthread_t capture_thread;
+    pthread_t injector_thread;
+    unsigned long captured_events;
+    unsigned long executed_jobs;
+    unsigned long attached_devices;     // подключений клавиатур, считая найденные при запуске
+    unsigned long detached_devices;
+    size_t max_captured_backlog;    // наибольшая очередь необработанных нажатий
+    size_t max_jobs_backlog;
+} Pipeline;
+
+// Долгоживущий "gsettings monitor" вместо запуска gsettings на каждое нажатие (GNOME/Wayland)
+typedef struct {
+    pid_t pid;
+    int fd;                     // stdout процесса, неблокирующий
+    char line[256];
+    size_t line_len;
+} LayoutMonitor;
+
+// Соединение сокета управления: недочитанная строка команды
+typedef struct {
+    int fd;                     // -1 — место свободно
+    char line[512];
+    size_t len;
+    bool answered;              // была команда, метрики при закрытии не нужны
+} ControlClient;
+
+// Раскладка кешируется и обновляется событиями; счётчики показывают, сколько
+// синхронных запросов (XkbGetState) и запусков gsettings не понадобилось
+typedef struct {
+    unsigned long reads;                // чтений кеша на горячем пути
+    unsigned long x11_queries_avoided;
+    unsigned long forks_avoided;
+    unsigned long event_updates;        // обновлений по XkbStateNotify / gsettings monitor
+    unsigned long manual_toggles;       // обновлений по распознанному сочетанию без источника событий
+} LayoutCacheStats;
+
+// Всё, что собирается из словарей. Поток анализа читает текущий набор, поток
+// перезагрузки собирает новый и подменяет указатель (RCU с указателем опасности)
+typedef struct {
+    Dictionary dicts[MAX_LAYOUTS];  // [группа]; пустой — у раскладки нет словаря
+    KeyTrie trie;
+    FuzzyIndex fuzzy;
+    NgramModel ngram;
+    unsigned long generation;   // растёт с каждой перезагрузкой
+    double build_ms;
+} DictSet;
+
+typedef struct {
+    _Atomic(DictSet *) current;
+    _Atomic(DictSet *) hazard;  // набор, который сейчас читает поток анализа; NULL — никакой
+    int inotify_fd;
+    int stop_fd;                // eventfd: остановить поток перезагрузки
+    pthread_t thread;
+    bool thread_started;
+    unsigned long reloads;
+    unsigned long failed_reloads;
+} DictStore;
+
+// Обучение: журнал только дописывается (отмены исправлений и повторно набранные
+// неизвестные слова), а в памяти по нему строится небольшая хеш-таблица, которую
+// process_word проверяет до словарей. Неизвестные слова сначала считаются в
+// приблизительных счётчиках (count-min) и попадают в таблицу и журнал, только
+// набранные LEARN_REPEAT_MIN раз: разовые опечатки и пароли на диск не пишутся
+typedef enum {
+    LEARN_REVERT,       // пользователь сразу отменил исправление
+    LEARN_SEEN,         // слова нет в словарях, оставлено как есть
+} LearnKind;
+
+typedef struct {
+    uint32_t hash;
+    uint16_t reverts;
+    uint16_t seen;
+    char word[LEARN_WORD_MAX];  // как набрано, UTF-8; пустая строка — свободный слот
+} LearnEntry;
+
+typedef struct {
+    LearnKind kind;
+    unsigned count;
+    char word[LEARN_WORD_MAX];
+} LearnRecord;
+
+typedef struct {
+    LearnEntry entries[LEARN_CAPACITY];
+    size_t count;
+    uint8_t sketch[LEARN_SKETCH_ROWS][LEARN_SKETCH_WIDTH];
+    unsigned sketch_adds;       // наборов с последнего деления счётчиков
+    bool full_warned;           // о заполненной таблице сказано в журнале
+    char path[PATH_MAX];
+    int log_fd;                 // только для потока записи: сжатие журнала его меняет
+    bool logging;               // журнал ведётся; задаётся при открытии, до цикла событий
+    int wake_fd;                // eventfd: в records есть записи
+    int stop_fd;
+    SpscRing records;           // LearnRecord: поток анализа -> поток записи
+    pthread_t thread;
+    bool thread_started;
+    size_t log_lines;           // строк в журнале (ведёт поток записи)
+    unsigned long batches;      // дописываний с fsync
+    wchar_t last_typed[MAX_WORD_LEN];   // слово до последнего исправления
+    bool correction_pending;    // исправление ещё может быть отменено
+} LearnStore;
+
+// Инжектор прогона (--replay): задания не выполняются, а записываются
+typedef struct {
+    bool corrected;                 // последнее слово исправлено
+    wchar_t target[MAX_WORD_LEN];   // во что (только последнее слово фразы)
+    unsigned long corrections;
+    unsigned long retro_words;      // слов исправлено задним числом
+    unsigned long forwarded;
+} ReplayInjector;
+
+// Гистограмма задержек со степенными корзинами. Запись — атомарные инкременты
+// без блокировок, поэтому писать может любой поток, а читать — сервер статистики
+typedef struct {
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+} Histogram;
+
+// Счётчики и задержки горячего пути. Метки времени — CLOCK_MONOTONIC: захват
+// (ядро или поток захвата), решение (конец обработки нажатия) и окончание инжекции
+typedef struct {
+    _Atomic uint64_t key_events;        // нажатий обработано анализом
+    _Atomic uint64_t words;             // слов передано в process_word
+    _Atomic uint64_t corrections;
+    _Atomic uint64_t retro_words;       // слов исправлено задним числом вместе со следующим
+    _Atomic uint64_t dict_lookups;      // проверок слова по словарю (хеш или граф)
+    _Atomic uint64_t layout_queries;    // чтений кеша раскладки и запросов к X11/gsettings
+    _Atomic uint64_t injected_events;   // событий записано в uinput
+    _Atomic uint64_t learned_reverts;   // отменённых исправлений
+    _Atomic uint64_t learned_skips;     // слов, оставленных по таблице обучения
+    _Atomic uint64_t dict_reloads;
+    _Atomic uint64_t dict_memory;       // байт в текущем наборе словарей
+    Histogram capture_to_decision;      // захват нажатия -> анализ закончен
+    Histogram word_decision;            // время process_word
+    Histogram capture_to_correction;    // захват пробела -> исправление записано в uinput
+    Histogram capture_to_forward;       // захват нажатия -> переслано (при захвате устройства)
+} Metrics;
+
+// Окно, которое уже было в фокусе: его профиль и раскладка, в которой его оставили
+typedef struct {
+    Window window;
+    uint64_t last_used;         // 0 — запись свободна
+    int layout;                 // -1 — окно ещё не теряло фокус
+    char wm_class[128];         // пусто — класс неизвестен, профиль общий
+    AppProfile profile;
+} WindowContext;
+
+// Кеш последних активных окон (вытесняется давно не бывшее в фокусе). Активное окно
+// приходит PropertyNotify на _NET_ACTIVE_WINDOW корневого окна, без опроса фокуса
+typedef struct {
+    WindowContext entries[WINDOW_CACHE_SIZE];
+    uint64_t clock;
+    Atom net_active_window;
+    Window active;
+    WindowContext *current;     // NULL — активное окно неизвестно
+    unsigned long focus_changes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long restores;     // раскладок восстановлено при смене фокуса
+    unsigned long excluded_words;
+} WindowCache;
+
+// Конвертация выделения X11: по Pause текст PRIMARY (по Shift + Pause — CLIPBOARD)
+// запрашивается у владельца, конвертируется целиком и становится содержимым CLIPBOARD
+// этой программы; выделение затем заменяется одной вставкой, без набора по символу.
+// По Pause результат нужен только для этой вставки: прежний текст CLIPBOARD сначала
+// запрашивается и сохраняется, а после вставки снова отдаётся вместо результата
+typedef struct {
+    Window window;              // невидимое окно: получатель выделения и владелец CLIPBOARD
+    Atom clipboard, utf8_string, targets, incr, property;
+    Atom source;                // запрошенное выделение, None — запроса нет
+    bool paste;                 // вставить результат поверх выделения
+    bool incremental;           // текст приходит частями (INCR)
+    char *incoming;             // полученный UTF-8
+    size_t incoming_len;
+    size_t incoming_capacity;
+    char *text;                 // результат, который отдаётся по запросам CLIPBOARD
+    size_t text_len;
+    bool saving;                // принимается прежнее содержимое CLIPBOARD, а не выделение
+    char *pending;              // результат Pause, ждущий сохранения CLIPBOARD
+    size_t pending_len;
+    char *saved;                // прежний текст CLIPBOARD, NULL — текста в нём не было
+    size_t saved_len;
+    bool restore_pending;       // после вставки CLIPBOARD вернётся к saved
+    int restore_fd;             // timerfd возврата CLIPBOARD, -1 — нет
+    size_t max_property;        // больше за одно свойство не отдать
+    unsigned long conversions;
+} SelectionService;
+
+// Всё, что нужно обработке событий клавиатуры и слов
+typedef struct {
+    const Dictionary *dicts;    // [группа], LayoutSet.count словарей
+    const KeyTrie *trie;
+    const FuzzyIndex *fuzzy;    // NULL или пустой — без нечёткого поиска
+    const NgramModel *ngram;    // NULL — исправляются только слова из словарей
+    DictStore *dict_store;      // источник словарей выше; NULL — словари не перезагружаются
+    LearnStore *learn;          // NULL — без обучения
+    Injector *injector;
+    Config *config;             // профили приложений; меняется только в потоке анализа
+    bool use_super_space;
+    int system_layout;
+    Display *display;
+    int xkb_event_base;         // -1, если события XKB недоступны
+    struct xkb_state *xkb_state;
+    LayoutMonitor *layout_monitor;
+    LayoutCacheStats layout_stats;
+    Pipeline *pipeline;         // NULL — задания выполняются сразу в этом потоке
+    bool grabbed;               // нажатия перехвачены и пересылаются через инжектор
+    ReplayInjector *replay;     // не NULL — задания только записываются (прогон без устройств)
+    uint64_t event_ns;          // время захвата текущего нажатия, 0 — неизвестно
+    const char *stats_socket;   // путь сокета статистики, NULL — без сокета
+    SelectionService *selection;    // NULL — без X11 выделение не конвертируется
+    WindowCache *windows;           // NULL — активное окно не отслеживается, действует общий профиль
+} Switcher;
+
+// Заголовок скомпилированного словаря; за ним идут offsets[count], index[index_size] и арена
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_size;       // размер и время изменения текстового словаря,
+    int64_t source_mtime_sec;   // из которого собран индекс
+    int64_t source_mtime_nsec;
+    uint32_t count;
+    uint32_t index_size;
+    uint32_t arena_size;
+    uint32_t flags;             // DICT_INDEX_RANKED
+} DictIndexHeader;
+
+// Клавиши, из которых может состоять слово: позиция в графе клавиш и код. Символы
+// клавиш берутся из раскладок xkb при запуске (build_layout_set); буквами в разных
+// раскладках бывают и знаки препинания (б, ю, ж в ru), и цифры (é, è, ç, à в fr)
+#define WORD_KEYS(X) \
+    X(0,  KEY_Q)          X(1,  KEY_W)          X(2,  KEY_E)          X(3,  KEY_R)          \
+    X(4,  KEY_T)          X(5,  KEY_Y)          X(6,  KEY_U)          X(7,  KEY_I)          \
+    X(8,  KEY_O)          X(9,  KEY_P)          X(10, KEY_LEFTBRACE)  X(11, KEY_RIGHTBRACE) \
+    X(12, KEY_A)          X(13, KEY_S)          X(14, KEY_D)          X(15, KEY_F)          \
+    X(16, KEY_G)          X(17, KEY_H)          X(18, KEY_J)          X(19, KEY_K)          \
+    X(20, KEY_L)          X(21, KEY_SEMICOLON)  X(22, KEY_APOSTROPHE) X(23, KEY_Z)          \
+    X(24, KEY_X)          X(25, KEY_C)          X(26, KEY_V)          X(27, KEY_B)          \
+    X(28, KEY_N)          X(29, KEY_M)          X(30, KEY_COMMA)      X(31, KEY_DOT)        \
+    X(32, KEY_SLASH)      X(33, KEY_GRAVE)      X(34, KEY_1)          X(35, KEY_2)          \
+    X(36, KEY_3)          X(37, KEY_4)          X(38, KEY_5)          X(39, KEY_6)          \
+    X(40, KEY_7)          X(41, KEY_8)          X(42, KEY_9)          X(43, KEY_0)          \
+    X(44, KEY_MINUS)      X(45, KEY_EQUAL)      X(46, KEY_BACKSLASH)
+
+#define KEY_TABLE_SIZE 64           // все коды из списка выше меньше 64
+#define CHAR_RANGE 0x500            // символы раскладок: латиница с расширениями, греческий, кириллица
+
+// Позиция клавиши в графе клавиш по коду и код по позиции
+#define KEYCODE_SLOT(slot, code) [code] = slot + 1,
+#define SLOT_KEYCODE(slot, code) [slot] = code,
+static const int8_t keycode_slots[KEY_TABLE_SIZE] = { WORD_KEYS(KEYCODE_SLOT) };  // хранится slot + 1
+static const uint8_t slot_keycodes[TRIE_KEYS] = { WORD_KEYS(SLOT_KEYCODE) };
+
+// Клавиша и Shift для символа раскладки
+typedef struct {
+    uint8_t keycode;    // 0 — символа нет в раскладке
+    uint8_t shift;
+} CharKey;
+
+// Клавиши-модификаторы, которыми инжектор набирает уровни keymap и сочетания
+// переключения группы; бит i в InjectKey.modifiers — зажать inject_modifier_keys[i]
+static const uint8_t inject_modifier_keys[] = {
+    LEFTSHIFT_KEY_CODE, RIGHTALT_KEY_CODE, LEFTCTRL_KEY_CODE, LEFTALT_KEY_CODE, LEFTMETA_KEY_CODE,
+};
+#define INJECT_MODIFIERS ((int)sizeof(inject_modifier_keys))
+#define INJECT_KEYCODES 256         // коды, разрешённые виртуальной клавиатуре
+
+// Нажатие, которое в группе xkb даёт символ или переключает группу
+typedef struct {
+    uint8_t keycode;    // 0 — нет такого нажатия
+    uint8_t modifiers;
+} InjectKey;
+
+// Раскладка (группа xkb): символы клавиш и обратная таблица
+typedef struct {
+    char name[16];                      // короткое имя xkb: us, ru, ua, de
+    char dict_file[64];
+    wchar_t chars[2][KEY_TABLE_SIZE];   // [Shift][код], 0 — клавиша ничего не печатает
+    CharKey keys[CHAR_RANGE];           // [символ]
+} Layout;
+
+// Все раскладки системы в порядке групп. Строится один раз при запуске
+// и дальше только читается, поэтому общая для всех потоков
+typedef struct {
+    Layout layouts[MAX_LAYOUTS];
+    int count;
+    uint64_t letter_keys;               // бит k — клавиша k без Shift даёт букву хотя бы в одной раскладке
+    int8_t symbols[TRIE_KEYS];          // символ модели n-грамм для клавиши, -1 — не буква
+    int symbol_count;                   // буквенных клавиш; следующий номер — граница слова
+    wchar_t convert[MAX_LAYOUTS][MAX_LAYOUTS][CHAR_RANGE];  // [из][в][символ], 0 — не меняется
+    // Прямая инжекция (build_inject_tables): символы на любых клавишах и уровнях keymap
+    // и сочетания keymap, которые переключают группу (ISO_Next_Group и подобные)
+    InjectKey inject[MAX_LAYOUTS][CHAR_RANGE];      // [группа][символ]
+    InjectKey group_keys[MAX_LAYOUTS][MAX_LAYOUTS]; // [из][в]: одно сочетание
+    int8_t group_route[MAX_LAYOUTS][MAX_LAYOUTS];   // [из][в]: группа после первого сочетания пути, -1 — недостижима
+    uint8_t group_hops[MAX_LAYOUTS][MAX_LAYOUTS];   // сочетаний на кратчайшем пути
+    bool direct_switch;                             // сочетаниями достижима любая группа из любой
+} LayoutSet;
+
+// Словари, которые лежали рядом с программой до поддержки произвольных раскладок
+static const struct { const char *layout; const char *file; } known_dictionaries[] = {
+    {"us", "english_dict.txt"}, {"gb", "english_dict.txt"}, {"ru", "russian_dict.txt"},
 };
 
+static _Atomic int log_level = LOG_INFO;   // меняется сокетом управления, читается всеми потоками
+static const InjectPacing default_pacing = { 0, LAYOUT_SWITCH_DELAY, DELETE_WORD_DELAY };
+static Metrics metrics;
+static LayoutSet layout_set;
+
 /* ========== FUNCTION PROTOTYPES ========== */
-void send_key(int fd, int keycode, int value);
-void switch_layout(Display *display, int uinput_fd, bool use_super_space, int *system_layout);
-void switch_layout_fallback(int uinput_fd, bool use_super_space);
-void convert_layout(const wchar_t *input, wchar_t *output, bool to_russian);
-int detect_word_layout(const wchar_t *text, int system_layout);
-int setup_uinput_device(int *uinput_fd);
+void send_key(Injector *injector, int keycode, int value);
+int flush_injector(Injector *injector);
+void switch_layout(Injector *injector, int old_group, int new_group);
+void switch_layout_fallback(Injector *injector, bool use_super_space, int presses);
+int plan_injection(const wchar_t *target, int from, int to, int8_t *groups);
+bool send_text_direct(Injector *injector, const wchar_t *target, int from, int to);
+void delete_typed_word(Injector *injector, CorrectionStrategy strategy, int count);
+AppProfile profile_for_class(const char *wm_class, const AppProfiles *profiles);
+int ignore_window_errors(Display *display, XErrorEvent *error);
+bool init_window_cache(WindowCache *cache, Display *display);
+void refresh_window_profiles(WindowCache *cache, const AppProfiles *profiles);
+void window_focus_changed(Switcher *sw);
+const AppProfile *focused_profile(const Switcher *sw);
+void convert_layout(const wchar_t *input, wchar_t *output, int from, int to);
+void convert_layout_bulk(const wchar_t *input, wchar_t *output, size_t count, int from, int to);
+bool init_selection_service(SelectionService *service, Display *display);
+void free_selection_service(SelectionService *service, Display *display);
+void request_selection(SelectionService *service, Display *display, Atom source, bool paste);
+bool build_layout_set(LayoutSet *set, struct xkb_keymap *keymap, const char *names);
+bool init_layouts(const char *names);
+int detect_word_layout(const NgramModel *model, const wchar_t *word, int typed_layout, uint32_t candidates);
+int rank_word_layouts(const NgramModel *model, const wchar_t *word, int typed_layout, uint32_t candidates);
+void uinput_key_bits(unsigned char *keys, const char *const *device_paths, int device_path_count);
+int setup_uinput_device(int *uinput_fd, const unsigned char *keys);
 int get_x11_layout_group(Display *display);
 int get_gsettings_layout_group();
 void sync_xkb_state(struct xkb_state *xkb_state, int group);
 int update_system_layout(Display *display, int *system_layout);
+bool build_dict_index(Dictionary *dict);
+void free_dictionary(Dictionary *dict);
+bool load_layout_dictionaries(Dictionary *dicts);
+void free_layout_dictionaries(Dictionary *dicts);
+int compile_dictionary(const char *filename, const char *output);
+int char_to_key(wchar_t c, int layout);
+bool build_fuzzy_index(FuzzyIndex *index, const Dictionary *dicts);
+void free_fuzzy_index(FuzzyIndex *index);
+bool load_ngram_model(NgramModel *model, const Dictionary *dicts);
+void free_ngram_model(NgramModel *model);
+void free_dict_set(DictSet *set);
+void stop_dict_watcher(DictStore *store);
+void close_learn_store(LearnStore *store);
+int train_ngram_file(void);
+size_t format_metrics(char *out, size_t size);
+int open_stats_socket(const char *path);
+void serve_stats(int stats_fd, int epoll_fd, ControlClient *clients);
+bool serve_control_client(Switcher *sw, ControlClient *client);
+int run_dict_benchmark(void);
+int run_inject_benchmark(void);
+int run_convert_benchmark(void);
+int run_ngram_benchmark(void);
+int run_fuzzy_benchmark(void);
+int run_selection_benchmark(void);
+int run_replay(const char *events_file, const char *labels_file, const char *corpus_file, int layout);
+int make_replay_corpus(const char *output);
 
 /* ========== UTILITY FUNCTIONS ========== */
 
-// Конвертация слова между раскладками
-void convert_layout(const wchar_t *input, wchar_t *output, bool to_russian) {
-    size_t len = wcslen(input);
-    for (size_t i = 0; i < len; i++) {
-        const wchar_t *pos;
-        if (to_russian) {
-            pos = wcschr(eng_chars, input[i]);
-            output[i] = pos ? rus_chars[pos - eng_chars] : input[i];
+static double monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Время захвата из события (часы устройства переключены на CLOCK_MONOTONIC)
+static inline uint64_t event_time_ns(const struct input_event *ev) {
+    return (uint64_t)ev->time.tv_sec * 1000000000ull + (uint64_t)ev->time.tv_usec * 1000ull;
+}
+
+static inline bool is_modifier_key(int code) {
+    switch (code) {
+        case KEY_LEFTSHIFT: case KEY_RIGHTSHIFT: case KEY_LEFTCTRL: case KEY_RIGHTCTRL:
+        case KEY_LEFTALT: case KEY_RIGHTALT: case KEY_LEFTMETA: case KEY_RIGHTMETA: case KEY_CAPSLOCK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline void count_metric(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static void hist_record(Histogram *hist, uint64_t ns) {
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= HIST_BUCKETS) bucket = HIST_BUCKETS - 1;
+    atomic_fetch_add_explicit(&hist->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum_ns, ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&hist->max_ns, &max, ns,
+                                                              memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Верхняя граница корзины, в которую попадает квантиль q
+static uint64_t hist_percentile(const Histogram *hist, double q) {
+    uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+    if (count == 0) return 0;
+    uint64_t max = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+    uint64_t rank = (uint64_t)(q * count), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += atomic_load_explicit(&hist->buckets[b], memory_order_relaxed);
+        if (seen > rank) return b == 0 ? 0 : (1ull << b) < max ? 1ull << b : max;
+    }
+    return max;
+}
+
+static int format_histogram(char *out, size_t size, const char *name, const Histogram *hist) {
+    uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+    return snprintf(out, size, "%s count=%llu mean_us=%.1f p50_us<=%.1f p90_us<=%.1f p99_us<=%.1f max_us=%.1f\n",
+                    name, (unsigned long long)count, count ? sum / 1e3 / count : 0.0,
+                    hist_percentile(hist, 0.5) / 1e3, hist_percentile(hist, 0.9) / 1e3,
+                    hist_percentile(hist, 0.99) / 1e3,
+                    atomic_load_explicit(&hist->max_ns, memory_order_relaxed) / 1e3);
+}
+
+// Текстовый снимок метрик: строки "имя значение" и по строке на гистограмму
+size_t format_metrics(char *out, size_t size) {
+    size_t len = 0;
+    static const struct { const char *name; size_t offset; } counters[] = {
+        {"key_events", offsetof(Metrics, key_events)},
+        {"words", offsetof(Metrics, words)},
+        {"corrections", offsetof(Metrics, corrections)},
+        {"retro_words", offsetof(Metrics, retro_words)},
+        {"dict_lookups", offsetof(Metrics, dict_lookups)},
+        {"layout_queries", offsetof(Metrics, layout_queries)},
+        {"injected_events", offsetof(Metrics, injected_events)},
+        {"learned_reverts", offsetof(Metrics, learned_reverts)},
+        {"learned_skips", offsetof(Metrics, learned_skips)},
+        {"dict_reloads", offsetof(Metrics, dict_reloads)},
+        {"dict_memory", offsetof(Metrics, dict_memory)},
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]) && len < size; i++) {
+        _Atomic uint64_t *counter = (_Atomic uint64_t *)((char *)&metrics + counters[i].offset);
+        len += snprintf(out + len, size - len, "%s %llu\n", counters[i].name,
+                        (unsigned long long)atomic_load_explicit(counter, memory_order_relaxed));
+    }
+    if (len < size) len += format_histogram(out + len, size - len, "capture_to_decision", &metrics.capture_to_decision);
+    if (len < size) len += format_histogram(out + len, size - len, "word_decision", &metrics.word_decision);
+    if (len < size) len += format_histogram(out + len, size - len, "capture_to_correction", &metrics.capture_to_correction);
+    if (len < size) len += format_histogram(out + len, size - len, "capture_to_forward", &metrics.capture_to_forward);
+    return len < size ? len : size - 1;
+}
+
+// capacity — степень двойки
+bool ring_init(SpscRing *ring, size_t capacity, size_t elem_size) {
+    ring->slots = malloc(capacity * elem_size);
+    if (!ring->slots) return false;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->mask = capacity - 1;
+    ring->elem_size = elem_size;
+    return true;
+}
+
+void ring_free(SpscRing *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+// Только для производителя
+bool ring_push(SpscRing *ring, const void *elem) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail > ring->mask) return false;
+    memcpy(ring->slots + (head & ring->mask) * ring->elem_size, elem, ring->elem_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Только для потребителя
+bool ring_pop(SpscRing *ring, void *elem) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) return false;
+    memcpy(elem, ring->slots + (tail & ring->mask) * ring->elem_size, ring->elem_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+size_t ring_size(SpscRing *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+static inline const char *layout_name(int group) {
+    return group >= 0 && group < layout_set.count ? layout_set.layouts[group].name : "?";
+}
+
+// Группа по имени раскладки; -1 — такой нет
+int find_layout(const char *name) {
+    for (int i = 0; i < layout_set.count; i++) {
+        if (strcmp(layout_set.layouts[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Символ клавиши на уровне level группы group; 0 — клавиша не печатает символ из CHAR_RANGE
+static wchar_t keymap_char(struct xkb_keymap *keymap, int keycode, int group, int level) {
+    const xkb_keysym_t *syms;
+    // Коды xkb сдвинуты относительно evdev на 8
+    if (xkb_keymap_key_get_syms_by_level(keymap, (xkb_keycode_t)keycode + 8, (xkb_layout_index_t)group,
+                                         (xkb_level_index_t)level, &syms) != 1) {
+        return 0;
+    }
+    uint32_t c = xkb_keysym_to_utf32(syms[0]);
+    return c >= 0x20 && c < CHAR_RANGE && c != 0x7F ? (wchar_t)c : 0;
+}
+
+static void layout_dictionary_file(const char *name, char *out, size_t size) {
+    for (size_t i = 0; i < sizeof(known_dictionaries) / sizeof(known_dictionaries[0]); i++) {
+        if (strcmp(known_dictionaries[i].layout, name) == 0) {
+            snprintf(out, size, "%s", known_dictionaries[i].file);
+            return;
+        }
+    }
+    snprintf(out, size, DICT_FILE_PATTERN, name);
+}
+
+// Состояние xkb в группе group с зажатыми modifiers — так приложение увидит нажатия инжектора
+static struct xkb_state *inject_state(struct xkb_keymap *keymap, int group, int modifiers) {
+    struct xkb_state *state = xkb_state_new(keymap);
+    if (!state) return NULL;
+    xkb_state_update_mask(state, 0, 0, 0, 0, 0, (xkb_layout_index_t)group);
+    for (int i = 0; i < INJECT_MODIFIERS; i++) {
+        if ((modifiers >> i) & 1) xkb_state_update_key(state, inject_modifier_keys[i] + 8, XKB_KEY_DOWN);
+    }
+    return state;
+}
+
+// Модификаторы для уровня level клавиши: первая из масок уровня, которую можно собрать
+// из inject_modifier_keys (masks[i] — что даёт клавиша i в этой группе); -1 — нельзя
+static int level_modifiers(struct xkb_keymap *keymap, int keycode, int group, int level, const xkb_mod_mask_t *masks) {
+    xkb_mod_mask_t level_masks[8];
+    size_t count = xkb_keymap_key_get_mods_for_level(keymap, (xkb_keycode_t)keycode + 8, (xkb_layout_index_t)group,
+                                                     (xkb_level_index_t)level, level_masks, 8);
+    for (size_t m = 0; m < count; m++) {
+        xkb_mod_mask_t left = level_masks[m];
+        int modifiers = 0;
+        for (int i = 0; i < INJECT_MODIFIERS && left; i++) {
+            if (masks[i] && (masks[i] & ~level_masks[m]) == 0 && (masks[i] & left)) {
+                modifiers |= 1 << i;
+                left &= ~masks[i];
+            }
+        }
+        if (!left) return modifiers;
+    }
+    return -1;
+}
+
+static bool is_group_keysym(xkb_keysym_t sym) {
+    return sym == XKB_KEY_ISO_Next_Group || sym == XKB_KEY_ISO_Prev_Group ||
+           sym == XKB_KEY_ISO_First_Group || sym == XKB_KEY_ISO_Last_Group;
+}
+
+// Таблицы прямой инжекции. Каждое нажатие проверяется прогоном через xkb_state: в таблицы
+// попадает только то, что приложение действительно получит. Из нескольких нажатий
+// для символа остаётся то, где меньше модификаторов
+static void build_inject_tables(LayoutSet *set, struct xkb_keymap *keymap) {
+    for (int g = 0; g < set->count; g++) {
+        xkb_mod_mask_t masks[INJECT_MODIFIERS];
+        for (int i = 0; i < INJECT_MODIFIERS; i++) {
+            struct xkb_state *state = inject_state(keymap, g, 1 << i);
+            masks[i] = state ? xkb_state_serialize_mods(state, XKB_STATE_MODS_DEPRESSED) : 0;
+            if (state) xkb_state_unref(state);
+        }
+        for (int code = 1; code < INJECT_KEYCODES; code++) {
+            int levels = (int)xkb_keymap_num_levels_for_key(keymap, (xkb_keycode_t)code + 8, (xkb_layout_index_t)g);
+            for (int level = 0; level < levels; level++) {
+                const xkb_keysym_t *syms;
+                if (xkb_keymap_key_get_syms_by_level(keymap, (xkb_keycode_t)code + 8, (xkb_layout_index_t)g,
+                                                     (xkb_level_index_t)level, &syms) != 1) {
+                    continue;
+                }
+                int modifiers = level_modifiers(keymap, code, g, level, masks);
+                struct xkb_state *state = modifiers >= 0 ? inject_state(keymap, g, modifiers) : NULL;
+                if (!state) continue;
+                InjectKey key = {(uint8_t)code, (uint8_t)modifiers};
+                if (is_group_keysym(syms[0])) {
+                    xkb_state_update_key(state, (xkb_keycode_t)code + 8, XKB_KEY_DOWN);
+                    xkb_state_update_key(state, (xkb_keycode_t)code + 8, XKB_KEY_UP);
+                    for (int i = INJECT_MODIFIERS - 1; i >= 0; i--) {
+                        if ((modifiers >> i) & 1) xkb_state_update_key(state, inject_modifier_keys[i] + 8, XKB_KEY_UP);
+                    }
+                    int to = (int)xkb_state_serialize_layout(state, XKB_STATE_LAYOUT_EFFECTIVE);
+                    InjectKey *slot = to >= 0 && to < set->count && to != g ? &set->group_keys[g][to] : NULL;
+                    if (slot && (!slot->keycode || __builtin_popcount(modifiers) < __builtin_popcount(slot->modifiers))) {
+                        *slot = key;
+                    }
+                } else {
+                    uint32_t c = xkb_state_key_get_utf32(state, (xkb_keycode_t)code + 8);
+                    InjectKey *slot = c >= 0x20 && c < CHAR_RANGE && c != 0x7F ? &set->inject[g][c] : NULL;
+                    if (slot && (!slot->keycode || __builtin_popcount(modifiers) < __builtin_popcount(slot->modifiers))) {
+                        *slot = key;
+                    }
+                }
+                xkb_state_unref(state);
+            }
+        }
+    }
+
+    // Кратчайшие пути между группами по сочетаниям (групп не больше MAX_LAYOUTS — Флойд)
+    for (int from = 0; from < set->count; from++) {
+        for (int to = 0; to < set->count; to++) {
+            bool direct = from == to || set->group_keys[from][to].keycode;
+            set->group_hops[from][to] = from == to ? 0 : direct ? 1 : UINT8_MAX;
+            set->group_route[from][to] = direct ? (int8_t)to : -1;
+        }
+    }
+    for (int via = 0; via < set->count; via++) {
+        for (int from = 0; from < set->count; from++) {
+            for (int to = 0; to < set->count; to++) {
+                int hops = set->group_hops[from][via] + set->group_hops[via][to];
+                if (hops < set->group_hops[from][to]) {
+                    set->group_hops[from][to] = (uint8_t)hops;
+                    set->group_route[from][to] = set->group_route[from][via];
+                }
+            }
+        }
+    }
+    set->direct_switch = true;
+    for (int from = 0; from < set->count; from++) {
+        for (int to = 0; to < set->count; to++) {
+            if (set->group_route[from][to] < 0) set->direct_switch = false;
+        }
+    }
+}
+
+// Таблицы раскладок из keymap: символы клавиш WORD_KEYS на уровнях без Shift и с Shift
+// для каждой группы, обратные таблицы и конвертация между каждой парой раскладок.
+// names — имена групп через запятую ("us,ru,ua"), как в правилах xkb
+bool build_layout_set(LayoutSet *set, struct xkb_keymap *keymap, const char *names) {
+    memset(set, 0, sizeof(*set));
+    int groups = (int)xkb_keymap_num_layouts(keymap);
+    if (groups > MAX_LAYOUTS) {
+        wprintf(L"Раскладок %d, используются первые %d\n", groups, MAX_LAYOUTS);
+        groups = MAX_LAYOUTS;
+    }
+    const char *name = names;
+    for (int g = 0; g < groups; g++) {
+        Layout *layout = &set->layouts[g];
+        size_t len = name ? strcspn(name, ",") : 0;
+        if (len == 0 || len >= sizeof(layout->name)) {
+            snprintf(layout->name, sizeof(layout->name), "group%d", g + 1);
         } else {
-            pos = wcschr(rus_chars, input[i]);
-            output[i] = pos ? eng_chars[pos - rus_chars] : input[i];
+            memcpy(layout->name, name, len);
+        }
+        name = name && name[len] == ',' ? name + len + 1 : NULL;
+        layout_dictionary_file(layout->name, layout->dict_file, sizeof(layout->dict_file));
+
+        // Сначала все символы без Shift: если символ есть на двух уровнях, набирается без Shift
+        for (int level = 0; level < 2; level++) {
+            for (int slot = 0; slot < TRIE_KEYS; slot++) {
+                int code = slot_keycodes[slot];
+                wchar_t c = keymap_char(keymap, code, g, level);
+                layout->chars[level][code] = c;
+                if (c && layout->keys[c].keycode == 0) layout->keys[c] = (CharKey){(uint8_t)code, (uint8_t)level};
+                if (level == 0 && c && iswalpha(c)) set->letter_keys |= 1ull << slot;
+            }
+        }
+    }
+    set->count = groups;
+    if (groups == 0) return false;
+
+    for (int slot = 0; slot < TRIE_KEYS; slot++) {
+        set->symbols[slot] = (set->letter_keys >> slot) & 1 ? (int8_t)set->symbol_count++ : -1;
+    }
+    for (int from = 0; from < groups; from++) {
+        for (int to = 0; to < groups; to++) {
+            if (from == to) continue;
+            const Layout *src = &set->layouts[from], *dst = &set->layouts[to];
+            for (wchar_t c = 1; c < CHAR_RANGE; c++) {
+                CharKey key = src->keys[c];
+                wchar_t mapped = key.keycode ? dst->chars[key.shift][key.keycode] : 0;
+                set->convert[from][to][c] = mapped != c ? mapped : 0;
+            }
+        }
+    }
+    build_inject_tables(set, keymap);
+    return true;
+}
+
+// Keymap для режимов без X11. Сочетание переключения — как у демона по умолчанию,
+// чтобы замер прямой инжекции шёл по тем же путям
+static struct xkb_keymap *offline_keymap(struct xkb_context *context, const char *names) {
+    struct xkb_rule_names rule_names = { "evdev", "pc105", names, "", "grp:alt_shift_toggle" };
+    return xkb_keymap_new_from_names(context, &rule_names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+}
+
+// Раскладки без подключения к X11 (прогоны, обучение, замеры): keymap собирается по именам
+bool init_layouts(const char *names) {
+    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    if (!context) {
+        wprintf(L"Ошибка: Не удалось создать xkb_context\n");
+        return false;
+    }
+    struct xkb_keymap *keymap = offline_keymap(context, names);
+    bool ok = keymap && build_layout_set(&layout_set, keymap, names);
+    if (!ok) wprintf(L"Ошибка: Не удалось собрать раскладки %hs\n", names);
+    if (keymap) xkb_keymap_unref(keymap);
+    xkb_context_unref(context);
+    return ok;
+}
+
+// Конвертация count символов из раскладки from в to (output может совпадать с input).
+// Для больших буферов (буфер обмена): с AVX2 — по 8 символов через gather по
+// таблице, иначе — развёрнутый цикл без ветвлений
+void convert_layout_bulk(const wchar_t *input, wchar_t *output, size_t count, int from, int to) {
+    const wchar_t *table = layout_set.convert[from][to];
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256i range = _mm256_set1_epi32(CHAR_RANGE);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 8 <= count; i += 8) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(input + i));
+        __m256i in_range = _mm256_and_si256(_mm256_cmpgt_epi32(range, c), _mm256_cmpgt_epi32(c, zero));
+        // Символы вне таблицы получают индекс 0, а table[0] == 0 — "не менять"
+        __m256i index = _mm256_and_si256(in_range, c);
+        __m256i mapped = _mm256_i32gather_epi32((const int *)table, index, 4);
+        __m256i unchanged = _mm256_cmpeq_epi32(mapped, zero);
+        _mm256_storeu_si256((__m256i *)(output + i), _mm256_blendv_epi8(mapped, c, unchanged));
+    }
+#endif
+    for (; i + 4 <= count; i += 4) {
+        for (size_t j = 0; j < 4; j++) {
+            wchar_t c = input[i + j];
+            wchar_t mapped = table[c > 0 && c < CHAR_RANGE ? c : 0];
+            output[i + j] = mapped ? mapped : c;
         }
     }
+    for (; i < count; i++) {
+        wchar_t c = input[i];
+        wchar_t mapped = table[c > 0 && c < CHAR_RANGE ? c : 0];
+        output[i] = mapped ? mapped : c;
+    }
+}
+
+// Конвертация слова между раскладками
+void convert_layout(const wchar_t *input, wchar_t *output, int from, int to) {
+    size_t len = wcslen(input);
+    convert_layout_bulk(input, output, len, from, to);
     output[len] = L'\0';
 }
 
 // Получение текущей раскладки через gsettings (Wayland)
 int get_gsettings_layout_group() {
+    count_metric(&metrics.layout_queries, 1);
     FILE *pipe = popen("gsettings get org.gnome.desktop.input-sources current", "r");
     if (!pipe) {
-        wprintf(L"Failed to run gsettings\n");
+        LOG(LOG_WARN, L"Failed to run gsettings\n");
         return -1;
     }
     char buffer[256];
     if (fgets(buffer, sizeof(buffer), pipe)) {
         int group = atoi(buffer);
-        wprintf(L"gsettings layout group: %d (%ls)\n", group, group == 0 ? L"us" : L"ru");
+        LOG(LOG_DEBUG, L"gsettings layout group: %d (%hs)\n", group, layout_name(group));
         pclose(pipe);
         return group;
     }
@@ -113,6 +1207,32 @@ int get_gsettings_layout_group() {
     return -1;
 }
 
+// Источники ввода GNOME (Wayland): "[('xkb', 'us'), ('xkb', 'de+nodeadkeys')]"
+// превращаются в "us,de" и ",nodeadkeys"
+bool get_gsettings_layout_names(char *layouts, size_t layouts_size, char *variants, size_t variants_size) {
+    FILE *pipe = popen("gsettings get org.gnome.desktop.input-sources sources", "r");
+    if (!pipe) return false;
+    char buffer[512];
+    bool ok = fgets(buffer, sizeof(buffer), pipe) != NULL;
+    pclose(pipe);
+    if (!ok) return false;
+    size_t layouts_len = 0, variants_len = 0;
+    int count = 0;
+    for (const char *p = buffer; (p = strstr(p, "('xkb', '")); count++) {
+        p += strlen("('xkb', '");
+        size_t len = strcspn(p, "'");
+        size_t name_len = strcspn(p, "+'");
+        const char *variant = name_len < len ? p + name_len + 1 : p + len;
+        layouts_len += snprintf(layouts + layouts_len, layouts_size - layouts_len, "%s%.*s",
+                                count ? "," : "", (int)name_len, p);
+        variants_len += snprintf(variants + variants_len, variants_size - variants_len, "%s%.*s",
+                                 count ? "," : "", (int)(p + len - variant), variant);
+        if (layouts_len >= layouts_size || variants_len >= variants_size) return false;
+        p += len;
+    }
+    return count > 0;
+}
+
 // Обновление system_layout
 int update_system_layout(Display *display, int *system_layout) {
     int new_layout = -1;
@@ -120,364 +1240,5285 @@ int update_system_layout(Display *display, int *system_layout) {
         XkbStateRec xkb_state;
         if (XkbGetState(display, XkbUseCoreKbd, &xkb_state) == Success) {
             new_layout = xkb_state.group;
-            wprintf(L"X11 layout group: %d (%ls)\n", new_layout, new_layout == 0 ? L"us" : L"ru");
+            LOG(LOG_DEBUG, L"X11 layout group: %d (%hs)\n", new_layout, layout_name(new_layout));
         } else {
-            wprintf(L"Failed to get X11 keyboard state\n");
+            LOG(LOG_WARN, L"Failed to get X11 keyboard state\n");
         }
     }
     if (new_layout < 0) {
         new_layout = get_gsettings_layout_group();
         if (new_layout < 0) {
-            new_layout = (*system_layout + 1) % 2;
-            wprintf(L"Fallback: Updated system_layout: %d (%ls)\n",
-                    new_layout, new_layout == 0 ? L"us" : L"ru");
+            new_layout = (*system_layout + 1) % layout_set.count;
+            LOG(LOG_DEBUG, L"Fallback: Updated system_layout: %d (%hs)\n", new_layout, layout_name(new_layout));
+        }
+    }
+    *system_layout = new_layout;
+    return new_layout;
+}
+
+
+// Переключение раскладки через X11 или fallback
+void switch_layout(Injector *injector, int old_group, int new_group) {
+    if (injector->display) {
+        LOG(LOG_DEBUG, L"Switching layout via X11 to group: %d (%hs)\n", new_group, layout_name(new_group));
+        XkbLockGroup(injector->display, XkbUseCoreKbd, new_group);
+        XFlush(injector->display);
+    } else {
+        LOG(LOG_DEBUG, L"X11 unavailable, using fallback layout switch\n");
+        // Сочетание перебирает группы по кругу
+        int presses = (new_group - old_group + layout_set.count) % layout_set.count;
+        switch_layout_fallback(injector, injector->use_super_space, presses);
+    }
+}
+
+// Fallback для переключения раскладки через uinput (Wayland): presses нажатий сочетания
+void switch_layout_fallback(Injector *injector, bool use_super_space, int presses) {
+    LOG(LOG_DEBUG, L"Switching layout via uinput: Emulating %ls x%d\n", use_super_space ? L"Super + Space" : L"Shift + Alt",
+        presses);
+    int modifier = use_super_space ? LEFTMETA_KEY_CODE : LEFTSHIFT_KEY_CODE;
+    int trigger = use_super_space ? SPACE_KEY_CODE : LEFTALT_KEY_CODE;
+    for (int i = 0; i < presses; i++) {
+        send_key(injector, modifier, 1);
+        send_key(injector, trigger, 1);
+        send_key(injector, trigger, 0);
+        send_key(injector, modifier, 0);
+        flush_injector(injector);
+        usleep(injector->pacing.switch_delay_us);
+    }
+}
+
+/* ========== INJECTION FUNCTIONS ========== */
+
+// Все send_* только добавляют события в пакет; flush_injector отправляет его
+// порциями по INJECT_CHUNK_EVENTS (или по клавише, если задана пауза между нажатиями)
+void send_key(Injector *injector, int keycode, int value) {
+    if (injector->count + 2 > INJECT_BATCH_MAX) flush_injector(injector);
+    struct input_event *ev = &injector->events[injector->count];
+    memset(ev, 0, 2 * sizeof(*ev));
+    ev[0].type = EV_KEY;
+    ev[0].code = keycode;
+    ev[0].value = value;
+    ev[1].type = EV_SYN;
+    ev[1].code = SYN_REPORT;
+    injector->count += 2;
+}
+
+void send_tap(Injector *injector, int keycode) {
+    send_key(injector, keycode, 1);
+    send_key(injector, keycode, 0);
+}
+
+static bool write_events(Injector *injector, const struct input_event *events, size_t count) {
+    const char *data = (const char *)events;
+    size_t left = count * sizeof(*events);
+    while (left > 0) {
+        ssize_t written = write(injector->fd, data, left);
+        injector->writes++;
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            perror("Не удалось записать в uinput");
+            return false;
+        }
+        data += written;
+        left -= (size_t)written;
+    }
+    return true;
+}
+
+int flush_injector(Injector *injector) {
+    if (injector->count == 0) return 0;
+    bool ok = true;
+    size_t start = 0;
+    for (size_t i = 0; i + 1 < injector->count && ok; i += 2) {
+        // Порция кончается на SYN_REPORT: после отпускания клавиши, если задана пауза
+        // между нажатиями, иначе по заполнении INJECT_CHUNK_EVENTS
+        size_t end = i + 2;
+        bool key_done = injector->pacing.key_delay_us > 0 && injector->events[i].value == 0;
+        if (end < injector->count && !key_done && end - start < INJECT_CHUNK_EVENTS) continue;
+        ok = write_events(injector, injector->events + start, end - start);
+        start = end;
+        if (start < injector->count) {
+            usleep(injector->pacing.key_delay_us > 0 ? injector->pacing.key_delay_us : INJECT_CHUNK_PAUSE_US);
         }
     }
-    *system_layout = new_layout;
-    return new_layout;
+    injector->events_sent += injector->count;
+    count_metric(&metrics.injected_events, injector->count);
+    injector->flushes++;
+    injector->count = 0;
+    return ok ? 0 : -1;
+}
+
+void set_injector_pacing(Injector *injector, const InjectPacing *pacing) {
+    injector->pacing = *pacing;
+}
+
+void init_injector(Injector *injector, int fd, const InjectPacing *pacing) {
+    memset(injector, 0, sizeof(*injector));
+    injector->fd = fd;
+    set_injector_pacing(injector, pacing);
+}
+
+// Нажатие клавиши с модификаторами: модификаторы зажимаются до неё и отпускаются в обратном порядке
+static void send_inject_key(Injector *injector, InjectKey key) {
+    for (int i = 0; i < INJECT_MODIFIERS; i++) {
+        if ((key.modifiers >> i) & 1) send_key(injector, inject_modifier_keys[i], 1);
+    }
+    send_tap(injector, key.keycode);
+    for (int i = INJECT_MODIFIERS - 1; i >= 0; i--) {
+        if ((key.modifiers >> i) & 1) send_key(injector, inject_modifier_keys[i], 0);
+    }
+}
+
+// Эмуляция ввода символа раскладки layout через uinput
+bool send_char(Injector *injector, wchar_t target_char, int layout) {
+    InjectKey key = target_char > 0 && target_char < CHAR_RANGE ? layout_set.inject[layout][target_char]
+                                                                 : (InjectKey){0, 0};
+    if (key.keycode == 0) {
+        LOG(LOG_WARN, L"No key code for char: %lc\n", target_char);
+        return false;
+    }
+    send_inject_key(injector, key);
+    return true;
+}
+
+// Сочетания keymap, переводящие группу from в to по кратчайшему пути
+static void send_group_switch(Injector *injector, int from, int to) {
+    while (from != to) {
+        int next = layout_set.group_route[from][to];
+        send_inject_key(injector, layout_set.group_keys[from][next]);
+        from = next;
+    }
+}
+
+// Группа для каждого символа target (groups[i], -1 — символа нет ни в одной группе)
+// с наименьшим числом сочетаний переключения: набор начинается в группе from,
+// а после него должна остаться to. Возвращает число сочетаний, -1 — пути нет
+int plan_injection(const wchar_t *target, int from, int to, int8_t *groups) {
+    enum { UNREACHABLE = 1 << 20 };
+    const int count = layout_set.count;
+    size_t len = wcslen(target);
+    if (len >= MAX_WORD_LEN) return -1;
+    // cost[g] — сочетаний, чтобы набрать target[0..i) и оказаться в группе g;
+    // back[i][g] — группа перед символом i на лучшем пути в g
+    int cost[MAX_LAYOUTS];
+    int8_t back[MAX_WORD_LEN][MAX_LAYOUTS];
+    for (int g = 0; g < count; g++) cost[g] = g == from ? 0 : UNREACHABLE;
+    for (size_t i = 0; i < len; i++) {
+        wchar_t c = target[i];
+        int next[MAX_LAYOUTS];
+        bool typeable = false;
+        for (int g = 0; g < count; g++) {
+            next[g] = UNREACHABLE;
+            back[i][g] = (int8_t)g;
+            if (c <= 0 || c >= CHAR_RANGE || !layout_set.inject[g][c].keycode) continue;
+            typeable = true;
+            for (int h = 0; h < count; h++) {
+                if (cost[h] == UNREACHABLE || layout_set.group_route[h][g] < 0) continue;
+                int total = cost[h] + layout_set.group_hops[h][g];
+                if (total < next[g]) {
+                    next[g] = total;
+                    back[i][g] = (int8_t)h;
+                }
+            }
+        }
+        // Символ, которого нет нигде, пропускается, не меняя группу
+        if (typeable) memcpy(cost, next, sizeof(cost));
+        groups[i] = typeable ? 0 : -1;
+    }
+    int best = -1, best_cost = UNREACHABLE;
+    for (int g = 0; g < count; g++) {
+        if (cost[g] == UNREACHABLE || layout_set.group_route[g][to] < 0) continue;
+        if (cost[g] + layout_set.group_hops[g][to] < best_cost) {
+            best_cost = cost[g] + layout_set.group_hops[g][to];
+            best = g;
+        }
+    }
+    if (best < 0) return -1;
+    for (size_t i = len; i-- > 0;) {
+        if (groups[i] < 0) continue;
+        groups[i] = (int8_t)best;
+        best = back[i][best];
+    }
+    return best_cost;
+}
+
+// Прямая инжекция: символы и сочетания переключения группы одним пакетом. Приложение
+// разбирает пакет по порядку своей keymap, поэтому ни XkbLockGroup, ни паузы
+// на переключение не нужны. false — между группами нет пути сочетаниями
+bool send_text_direct(Injector *injector, const wchar_t *target, int from, int to) {
+    int8_t groups[MAX_WORD_LEN];
+    if (plan_injection(target, from, to, groups) < 0) return false;
+    int group = from;
+    for (size_t i = 0; target[i]; i++) {
+        if (groups[i] < 0) {
+            LOG(LOG_WARN, L"No key code for char: %lc\n", target[i]);
+            continue;
+        }
+        send_group_switch(injector, group, groups[i]);
+        group = groups[i];
+        send_inject_key(injector, layout_set.inject[group][target[i]]);
+    }
+    send_group_switch(injector, group, to);
+    return true;
+}
+
+// Выделение и удаление count символов перед курсором
+void select_and_delete_word(Injector *injector, int count) {
+    send_key(injector, LEFTSHIFT_KEY_CODE, 1);
+    for (int i = 0; i < count; i++) {
+        send_tap(injector, LEFTARROW_KEY_CODE);
+    }
+    send_key(injector, LEFTSHIFT_KEY_CODE, 0);
+    send_tap(injector, BACKSPACE_KEY_CODE);
+}
+
+// Стирание count символов перед курсором выбранным способом
+// (Ctrl + Backspace стирает слово целиком вместе с пробелом после него)
+void delete_typed_word(Injector *injector, CorrectionStrategy strategy, int count) {
+    switch (strategy) {
+        case CORRECT_SELECT:
+            select_and_delete_word(injector, count);
+            break;
+        case CORRECT_BACKSPACE:
+            for (int i = 0; i < count; i++) send_tap(injector, BACKSPACE_KEY_CODE);
+            break;
+        case CORRECT_CTRL_BACKSPACE:
+            send_key(injector, LEFTCTRL_KEY_CODE, 1);
+            send_tap(injector, BACKSPACE_KEY_CODE);
+            send_key(injector, LEFTCTRL_KEY_CODE, 0);
+            break;
+    }
+    flush_injector(injector);
+    // Пауза нужна, только если приложению задан медленный темп
+    if (injector->pacing.key_delay_us > 0) usleep(injector->pacing.delete_delay_us);
+}
+
+// Выполнение задания. Пересылаемые нажатия только копятся в пакете,
+// исправление отправляется сразу: раскладка должна смениться между стиранием и вводом
+void execute_job(Injector *injector, const InjectJob *job) {
+    switch (job->type) {
+        case JOB_FORWARD:
+            send_key(injector, job->event.code, job->event.value);
+            break;
+        case JOB_CORRECTION:
+            set_injector_pacing(injector, &job->pacing);
+            delete_typed_word(injector, job->strategy, job->erase_count);
+            LOG(LOG_DEBUG, L"Inputting word: %ls\n", job->target);
+            if (!injector->direct || !send_text_direct(injector, job->target, job->old_group, job->new_group)) {
+                switch_layout(injector, job->old_group, job->new_group);
+                for (size_t i = 0; job->target[i]; i++) {
+                    send_char(injector, job->target[i], job->new_group);
+                }
+            }
+            flush_injector(injector);
+            break;
+        case JOB_PASTE:
+            set_injector_pacing(injector, &job->pacing);
+            send_key(injector, LEFTCTRL_KEY_CODE, 1);
+            if (job->terminal) send_key(injector, LEFTSHIFT_KEY_CODE, 1);
+            send_tap(injector, KEY_V);
+            if (job->terminal) send_key(injector, LEFTSHIFT_KEY_CODE, 0);
+            send_key(injector, LEFTCTRL_KEY_CODE, 0);
+            flush_injector(injector);
+            break;
+        case JOB_PACING:
+            flush_injector(injector);
+            set_injector_pacing(injector, &job->pacing);
+            break;
+        case JOB_SWITCH_LAYOUT:
+            flush_injector(injector);
+            switch_layout(injector, job->old_group, job->new_group);
+            break;
+        case JOB_STOP:
+            break;
+    }
+}
+
+const wchar_t *correction_name(CorrectionStrategy strategy) {
+    switch (strategy) {
+        case CORRECT_SELECT: return L"select";
+        case CORRECT_BACKSPACE: return L"backspace";
+        case CORRECT_CTRL_BACKSPACE: return L"ctrl-backspace";
+    }
+    return L"?";
+}
+
+bool parse_correction(const char *name, CorrectionStrategy *strategy) {
+    if (strcmp(name, "select") == 0) *strategy = CORRECT_SELECT;
+    else if (strcmp(name, "backspace") == 0) *strategy = CORRECT_BACKSPACE;
+    else if (strcmp(name, "ctrl-backspace") == 0) *strategy = CORRECT_CTRL_BACKSPACE;
+    else return false;
+    return true;
+}
+
+/* ========== X11 FUNCTIONS ========== */
+
+int get_x11_layout_group(Display *display) {
+    count_metric(&metrics.layout_queries, 1);
+    if (!display) {
+        LOG(LOG_WARN, L"X11 display not available\n");
+        return -1;
+    }
+    XkbStateRec xkb_state;
+    if (XkbGetState(display, XkbUseCoreKbd, &xkb_state) != Success) {
+        LOG(LOG_WARN, L"Failed to get X11 keyboard state\n");
+        return -1;
+    }
+    int group = xkb_state.group;
+    LOG(LOG_DEBUG, L"X11 layout group: %d (%hs)\n", group, layout_name(group));
+    return group;
+}
+
+// Свойство _XKB_RULES_NAMES корневого окна (его ставит setxkbmap): строки rules,
+// model, layout, variant, options через '\0'. Данные освобождаются XFree, NULL — свойства нет
+static unsigned char *get_x11_rules_names(Display *display, const char *fields[5]) {
+    if (!display) return NULL;
+    Atom property = XInternAtom(display, "_XKB_RULES_NAMES", True);
+    if (property == None) return NULL;
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char *data = NULL;
+    if (XGetWindowProperty(display, DefaultRootWindow(display), property, 0, 1024, False, XA_STRING,
+                           &type, &format, &count, &after, &data) != Success || !data) {
+        return NULL;
+    }
+    if (format != 8) {
+        XFree(data);
+        return NULL;
+    }
+    size_t field = 0;
+    for (size_t i = 0; i < 5; i++) fields[i] = NULL;
+    for (size_t i = 0; i < count && field < 5; i++) {
+        if (i == 0 || data[i - 1] == '\0') fields[field++] = (const char *)data + i;
+    }
+    // Xlib завершает данные нулём, последняя строка не выйдет за буфер
+    return data;
+}
+
+// Раскладки и варианты сервера X11
+bool get_x11_layout_names(Display *display, char *layouts, size_t layouts_size, char *variants, size_t variants_size) {
+    const char *fields[5];
+    unsigned char *data = get_x11_rules_names(display, fields);
+    if (!data) return false;
+    bool ok = fields[2] && fields[2][0];
+    if (ok) {
+        snprintf(layouts, layouts_size, "%s", fields[2]);
+        snprintf(variants, variants_size, "%s", fields[3] ? fields[3] : "");
+    }
+    XFree(data);
+    return ok;
+}
+
+// Опции XKB сервера X11 ("grp:win_space_toggle,..."), пустые — тоже ответ
+bool get_x11_xkb_options(Display *display, char *options, size_t size) {
+    const char *fields[5];
+    unsigned char *data = get_x11_rules_names(display, fields);
+    if (!data) return false;
+    snprintf(options, size, "%s", fields[4] ? fields[4] : "");
+    XFree(data);
+    return true;
+}
+
+// WM_CLASS окна: поднимаемся от него к предкам, пока не найдём подсказку
+static bool get_window_wm_class(Display *display, Window focus, char *wm_class, size_t size) {
+    Window root = DefaultRootWindow(display);
+    while (focus != None && focus != PointerRoot && focus != root) {
+        XClassHint hint;
+        if (XGetClassHint(display, focus, &hint)) {
+            snprintf(wm_class, size, "%s", hint.res_class ? hint.res_class : (hint.res_name ? hint.res_name : ""));
+            // Совпадение ищем и по res_name: у терминалов оно точнее
+            if (hint.res_name && hint.res_class) {
+                size_t len = strlen(wm_class);
+                snprintf(wm_class + len, size - len, "/%s", hint.res_name);
+            }
+            if (hint.res_name) XFree(hint.res_name);
+            if (hint.res_class) XFree(hint.res_class);
+            return true;
+        }
+        Window parent, *children = NULL;
+        unsigned int count;
+        if (!XQueryTree(display, focus, &root, &parent, &children, &count)) break;
+        if (children) XFree(children);
+        focus = parent;
+    }
+    return false;
+}
+
+static bool get_focused_wm_class(Display *display, char *wm_class, size_t size) {
+    Window focus;
+    int revert;
+    XGetInputFocus(display, &focus, &revert);
+    return get_window_wm_class(display, focus, wm_class, size);
+}
+
+static bool wm_class_matches(const char *wm_class, const char *name) {
+    // wm_class имеет вид "Class/name"
+    size_t len = strlen(name);
+    const char *slash = strchr(wm_class, '/');
+    size_t class_len = slash ? (size_t)(slash - wm_class) : strlen(wm_class);
+    if (class_len == len && strncasecmp(wm_class, name, len) == 0) return true;
+    return slash && strcasecmp(slash + 1, name) == 0;
+}
+
+static bool is_terminal_class(const char *wm_class) {
+    for (size_t i = 0; i < sizeof(terminal_classes) / sizeof(terminal_classes[0]); i++) {
+        if (wm_class_matches(wm_class, terminal_classes[i])) return true;
+    }
+    return false;
+}
+
+// Поля app, заданные явно (не -1), поверх profile
+static void overlay_profile(AppProfile *profile, const AppProfile *app) {
+    if (app->strategy >= 0) profile->strategy = app->strategy;
+    if (app->pacing.key_delay_us >= 0) profile->pacing.key_delay_us = app->pacing.key_delay_us;
+    if (app->pacing.switch_delay_us >= 0) profile->pacing.switch_delay_us = app->pacing.switch_delay_us;
+    if (app->pacing.delete_delay_us >= 0) profile->pacing.delete_delay_us = app->pacing.delete_delay_us;
+    if (app->exclude >= 0) profile->exclude = app->exclude;
+}
+
+// Профиль окна с классом wm_class: общий, для терминалов стирание Backspace, окна
+// паролей не исправляются; поверх — заданные поля первого подходящего профиля приложения
+AppProfile profile_for_class(const char *wm_class, const AppProfiles *profiles) {
+    AppProfile profile = profiles->defaults;
+    if (is_terminal_class(wm_class)) profile.strategy = CORRECT_BACKSPACE;
+    for (size_t i = 0; i < sizeof(password_classes) / sizeof(password_classes[0]); i++) {
+        if (wm_class_matches(wm_class, password_classes[i])) profile.exclude = 1;
+    }
+    for (size_t i = 0; i < profiles->count; i++) {
+        const AppProfile *app = &profiles->apps[i];
+        if (!wm_class_matches(wm_class, app->wm_class)) continue;
+        snprintf(profile.wm_class, sizeof(profile.wm_class), "%s", app->wm_class);
+        overlay_profile(&profile, app);
+        break;
+    }
+    return profile;
+}
+
+void sync_xkb_state(struct xkb_state *xkb_state, int group) {
+    if (xkb_state && group >= 0) {
+        LOG(LOG_TRACE, L"Syncing xkb_state to group: %d\n", group);
+        xkb_state_update_mask(xkb_state, 0, 0, 0, 0, 0, group);
+    }
+}
+
+/* ========== DICTIONARY FUNCTIONS ========== */
+
+static inline const char *dict_word(const Dictionary *dict, size_t i) {
+    return dict->arena + dict->offsets[i];
+}
+
+// Кодирование слова в UTF-8; 0, если не помещается в буфер
+static size_t utf8_encode_word(const wchar_t *word, char *out, size_t out_size) {
+    size_t len = 0;
+    for (; *word; word++) {
+        uint32_t c = (uint32_t)*word;
+        if (len + 5 > out_size) return 0;
+        if (c < 0x80) {
+            out[len++] = (char)c;
+        } else if (c < 0x800) {
+            out[len++] = (char)(0xC0 | (c >> 6));
+            out[len++] = (char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out[len++] = (char)(0xE0 | (c >> 12));
+            out[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[len++] = (char)(0x80 | (c & 0x3F));
+        } else {
+            out[len++] = (char)(0xF0 | (c >> 18));
+            out[len++] = (char)(0x80 | ((c >> 12) & 0x3F));
+            out[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[len++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// Добавление слова в конец арены (арена и массив смещений растут удвоением)
+bool dict_add_word(Dictionary *dict, const char *word, size_t len) {
+    if (dict->arena_size + len + 1 > dict->arena_capacity) {
+        size_t capacity = dict->arena_capacity ? dict->arena_capacity * 2 : 4096;
+        while (capacity < dict->arena_size + len + 1) capacity *= 2;
+        char *arena = realloc(dict->arena, capacity);
+        if (!arena) return false;
+        dict->arena = arena;
+        dict->arena_capacity = capacity;
+    }
+    if (dict->count == dict->capacity) {
+        size_t capacity = dict->capacity ? dict->capacity * 2 : 1024;
+        uint32_t *offsets = realloc(dict->offsets, capacity * sizeof(uint32_t));
+        if (!offsets) return false;
+        dict->offsets = offsets;
+        dict->capacity = capacity;
+    }
+    memcpy(dict->arena + dict->arena_size, word, len);
+    dict->arena[dict->arena_size + len] = '\0';
+    dict->offsets[dict->count++] = (uint32_t)dict->arena_size;
+    dict->arena_size += len + 1;
+    return true;
+}
+
+// Память, занятая словарём: арена, смещения и индекс
+size_t dictionary_memory(const Dictionary *dict) {
+    size_t index_size = dict->index ? (dict->index_mask + 1) * sizeof(uint32_t) : 0;
+    return dict->arena_capacity + dict->capacity * sizeof(uint32_t) + index_size;
+}
+
+// Индекс читается демоном от root: смещения, номера слов в слотах и завершающий
+// ноль арены проверяются один раз, чтобы испорченный файл не увёл поиск за пределы
+// отображения, а пустой слот нужен, чтобы пробирование в dict_lookup кончалось
+static bool dict_index_valid(const DictIndexHeader *header) {
+    const uint32_t *offsets = (const uint32_t *)(header + 1);
+    const uint32_t *index = offsets + header->count;
+    const char *arena = (const char *)(index + header->index_size);
+    if (header->count > 0 && (header->arena_size == 0 || arena[header->arena_size - 1] != '\0')) return false;
+    for (uint32_t i = 0; i < header->count; i++) {
+        if (offsets[i] >= header->arena_size) return false;
+    }
+    bool has_empty = false;
+    for (uint32_t i = 0; i < header->index_size; i++) {
+        uint32_t word = index[i] & DICT_SLOT_WORD;
+        if (!index[i]) has_empty = true;
+        else if (word == 0 || word - 1 >= header->count) return false;
+    }
+    return has_empty;
+}
+
+// Отображение скомпилированного словаря: без разбора и копирования, только
+// линейная проверка индекса. false — файла нет, он устарел или повреждён
+static bool map_compiled_dictionary(const char *filename, Dictionary *dict) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", filename, DICT_INDEX_SUFFIX) >= (int)sizeof(path)) return false;
+
+    struct stat source_st, index_st;
+    if (stat(filename, &source_st) < 0) return false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    if (fstat(fd, &index_st) < 0 || (size_t)index_st.st_size < sizeof(DictIndexHeader)) {
+        close(fd);
+        return false;
+    }
+    void *mapping = mmap(NULL, index_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    const DictIndexHeader *header = mapping;
+    uint64_t expected_size = sizeof(DictIndexHeader) + ((uint64_t)header->count + header->index_size) * sizeof(uint32_t)
+                             + header->arena_size;
+    if (header->magic != DICT_INDEX_MAGIC || header->version != DICT_INDEX_VERSION ||
+        expected_size != (uint64_t)index_st.st_size ||
+        header->index_size == 0 || (header->index_size & (header->index_size - 1)) != 0 ||
+        !dict_index_valid(header)) {
+        wprintf(L"Файл %hs повреждён или другой версии, используется текстовый словарь\n", path);
+        munmap(mapping, index_st.st_size);
+        return false;
+    }
+    if (header->source_size != (uint64_t)source_st.st_size ||
+        header->source_mtime_sec != (int64_t)source_st.st_mtim.tv_sec ||
+        header->source_mtime_nsec != (int64_t)source_st.st_mtim.tv_nsec) {
+        wprintf(L"Файл %hs устарел, используется текстовый словарь (пересоберите: --compile-dict %hs)\n",
+                path, filename);
+        munmap(mapping, index_st.st_size);
+        return false;
+    }
+
+    dict->offsets = (uint32_t *)(header + 1);
+    dict->index = dict->offsets + header->count;
+    dict->arena = (char *)(dict->index + header->index_size);
+    dict->count = header->count;
+    dict->arena_size = header->arena_size;
+    dict->index_mask = header->index_size - 1;
+    dict->ranked = (header->flags & DICT_INDEX_RANKED) != 0;
+    dict->mapping = mapping;
+    dict->mapping_size = index_st.st_size;
+    return true;
+}
+
+static inline uint8_t rank_weight(double rank) {
+    double weight = DICT_WEIGHT_MAX - DICT_WEIGHT_STEPS * log2(rank + 1);
+    return weight < 1 ? 1 : (uint8_t)weight;
+}
+
+// Средний вес слова словаря без частот: для закона Ципфа среднее log2 ранга — log2(N) - 1.44
+static inline uint8_t flat_weight(size_t count) {
+    return rank_weight(count * 0.37);
+}
+
+// Веса слов: по числам в строках (ранг по Ципфу — во сколько раз реже самого частого),
+// иначе по номеру строки, если строки не отсортированы по алфавиту. Возвращает источник весов
+static const wchar_t *rank_dictionary(Dictionary *dict, const uint32_t *counts, uint32_t max_count) {
+    if (max_count > 0) {
+        for (size_t i = 0; i < dict->count; i++) {
+            dict->weights[i] = counts[i] ? rank_weight((double)max_count / counts[i] - 1) : 1;
+        }
+        return L"по частотам";
+    }
+    size_t sorted = 0;
+    for (size_t i = 1; i < dict->count; i++) sorted += strcmp(dict_word(dict, i - 1), dict_word(dict, i)) <= 0;
+    if (dict->count > 1 && sorted >= DICT_SORTED_SHARE * (dict->count - 1)) {
+        free(dict->weights);
+        dict->weights = NULL;
+        return L"по алфавиту, без частот";
+    }
+    for (size_t i = 0; i < dict->count; i++) dict->weights[i] = rank_weight((double)i);
+    return L"по частоте";
+}
+
+// Текстовый файл читается целиком в арену, строки разрезаются на месте без перекодирования.
+// Строка — слово, за ним через пробел или табуляцию может идти число употреблений
+static bool load_text_dictionary(const char *filename, Dictionary *dict, double start) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        wprintf(L"Ошибка: Не удалось открыть файл словаря %hs\n", filename);
+        return false;
+    }
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) size = ftell(file);
+    if (size < 0 || size >= UINT32_MAX || fseek(file, 0, SEEK_SET) != 0) {
+        wprintf(L"Ошибка: Не удалось определить размер файла словаря %hs\n", filename);
+        fclose(file);
+        return false;
+    }
+    dict->arena = malloc((size_t)size + 1);
+    if (!dict->arena) {
+        fclose(file);
+        return false;
+    }
+    size_t read_size = fread(dict->arena, 1, (size_t)size, file);
+    fclose(file);
+    dict->arena[read_size] = '\n';
+
+    size_t lines = 1;
+    for (size_t i = 0; i < read_size; i++) {
+        if (dict->arena[i] == '\n') lines++;
+    }
+    dict->offsets = malloc(lines * sizeof(uint32_t));
+    dict->weights = malloc(lines);
+    uint32_t *counts = malloc(lines * sizeof(uint32_t));
+    if (!dict->offsets || !dict->weights || !counts) {
+        free(counts);
+        free_dictionary(dict);
+        return false;
+    }
+    dict->capacity = lines;
+    dict->count = 0;
+
+    size_t out = 0;
+    size_t line_start = 0;
+    uint32_t max_count = 0;
+    for (size_t i = 0; i <= read_size; i++) {
+        if (dict->arena[i] != '\n') continue;
+        size_t len = i - line_start;
+        while (len > 0 && (dict->arena[line_start + len - 1] == '\r' || dict->arena[line_start + len - 1] == ' ')) len--;
+        // Число после слова разбирается до сдвига строки: за ним в арене ещё стоит '\n'
+        size_t word_len = strcspn(dict->arena + line_start, " \t\r\n");
+        unsigned long count = 0;
+        if (word_len < len) count = strtoul(dict->arena + line_start + word_len, NULL, 10);
+        len = word_len;
+        if (len > 0 && len < MAX_WORD_LEN) {
+            memmove(dict->arena + out, dict->arena + line_start, len);
+            dict->arena[out + len] = '\0';
+            counts[dict->count] = count > UINT32_MAX ? UINT32_MAX : (uint32_t)count;
+            if (counts[dict->count] > max_count) max_count = counts[dict->count];
+            dict->offsets[dict->count++] = (uint32_t)out;
+            out += len + 1;
+        }
+        line_start = i + 1;
+    }
+    dict->arena_size = out;
+    char *arena = realloc(dict->arena, out ? out : 1);
+    if (arena) dict->arena = arena;
+    dict->arena_capacity = out;
+    uint32_t *offsets = realloc(dict->offsets, (dict->count ? dict->count : 1) * sizeof(uint32_t));
+    if (offsets) dict->offsets = offsets;
+    dict->capacity = dict->count;
+    const wchar_t *ranking = rank_dictionary(dict, counts, max_count);
+    dict->ranked = dict->weights != NULL;
+    free(counts);
+
+    bool indexed = build_dict_index(dict);
+    // Веса переехали в слоты индекса
+    free(dict->weights);
+    dict->weights = NULL;
+    if (!indexed) {
+        wprintf(L"Ошибка: Не удалось построить индекс словаря %hs\n", filename);
+        return false;
+    }
+    wprintf(L"Словарь %hs: %zu слов (%ls), %zu КБ (арена %zu Б, смещения %zu Б, индекс %zu Б), загрузка %.1f мс\n",
+            filename, dict->count, ranking, dictionary_memory(dict) / 1024, dict->arena_capacity,
+            dict->capacity * sizeof(uint32_t), (dict->index_mask + 1) * sizeof(uint32_t),
+            (monotonic_ns() - start) / 1e6);
+    return true;
+}
+
+// Скомпилированный индекс рядом со словарём, если он свежий, иначе текст
+bool load_dictionary(const char *filename, Dictionary *dict) {
+    double start = monotonic_ns();
+    if (map_compiled_dictionary(filename, dict)) {
+        wprintf(L"Словарь %hs%hs: %zu слов, отображено %zu КБ, загрузка %.3f мс\n",
+                filename, DICT_INDEX_SUFFIX, dict->count, dict->mapping_size / 1024,
+                (monotonic_ns() - start) / 1e6);
+        return true;
+    }
+    return load_text_dictionary(filename, dict, start);
+}
+
+void free_dictionary(Dictionary *dict) {
+    if (dict->mapping) {
+        munmap(dict->mapping, dict->mapping_size);
+    } else {
+        free(dict->arena);
+        free(dict->offsets);
+        free(dict->index);
+    }
+    free(dict->weights);
+    memset(dict, 0, sizeof(*dict));
+}
+
+// Сборка .idx-файла из текстового словаря (режим --compile-dict)
+int compile_dictionary(const char *filename, const char *output) {
+    char path[PATH_MAX];
+    if (!output) {
+        if (snprintf(path, sizeof(path), "%s%s", filename, DICT_INDEX_SUFFIX) >= (int)sizeof(path)) return 1;
+        output = path;
+    }
+    struct stat source_st;
+    if (stat(filename, &source_st) < 0) {
+        perror("Не удалось прочитать словарь");
+        return 1;
+    }
+    // Собираем всегда из текста; старый индекс остаётся на месте до rename
+    Dictionary dict = {0};
+    if (!load_text_dictionary(filename, &dict, monotonic_ns())) return 1;
+
+    DictIndexHeader header = {
+        .magic = DICT_INDEX_MAGIC,
+        .version = DICT_INDEX_VERSION,
+        .source_size = (uint64_t)source_st.st_size,
+        .source_mtime_sec = (int64_t)source_st.st_mtim.tv_sec,
+        .source_mtime_nsec = (int64_t)source_st.st_mtim.tv_nsec,
+        .count = (uint32_t)dict.count,
+        .index_size = (uint32_t)(dict.index_mask + 1),
+        .arena_size = (uint32_t)dict.arena_size,
+        .flags = dict.ranked ? DICT_INDEX_RANKED : 0,
+    };
+
+    // Пишем во временный файл и переименовываем, чтобы демон не отобразил недописанный индекс
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", output);
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        perror("Не удалось создать файл индекса");
+        free_dictionary(&dict);
+        return 1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(dict.offsets, sizeof(uint32_t), dict.count, file) == dict.count &&
+              fwrite(dict.index, sizeof(uint32_t), header.index_size, file) == header.index_size &&
+              fwrite(dict.arena, 1, dict.arena_size, file) == dict.arena_size;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path, output) < 0) {
+        perror("Не удалось записать файл индекса");
+        unlink(tmp_path);
+        free_dictionary(&dict);
+        return 1;
+    }
+    wprintf(L"Индекс %hs: %zu слов, %zu слотов\n", output, dict.count, dict.index_mask + 1);
+    free_dictionary(&dict);
+    return 0;
+}
+
+// FNV-1a по байтам UTF-8
+static uint32_t hash_word(const char *word, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)word[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Построение индекса: таблица минимум вдвое больше числа слов, линейное пробирование.
+// Вес лежит в самом слоте: проверка слова и его частота — одно чтение
+bool build_dict_index(Dictionary *dict) {
+    if (dict->count >= DICT_SLOT_WORD) return false;
+    uint8_t flat = flat_weight(dict->count);
+    size_t size = 16;
+    while (size < dict->count * 2) size <<= 1;
+    free(dict->index);
+    dict->index = calloc(size, sizeof(uint32_t));
+    if (!dict->index) {
+        dict->index_mask = 0;
+        return false;
+    }
+    dict->index_mask = size - 1;
+    for (size_t i = 0; i < dict->count; i++) {
+        const char *word = dict_word(dict, i);
+        size_t slot = hash_word(word, strlen(word)) & dict->index_mask;
+        while (dict->index[slot]) {
+            if (strcmp(dict_word(dict, (dict->index[slot] & DICT_SLOT_WORD) - 1), word) == 0) break;
+            slot = (slot + 1) & dict->index_mask;
+        }
+        // Повтор слова оставляет первую, самую частую строку
+        uint32_t weight = dict->weights ? dict->weights[i] : flat;
+        if (!dict->index[slot]) dict->index[slot] = (weight << DICT_SLOT_WEIGHT_SHIFT) | (uint32_t)(i + 1);
+    }
+    return true;
+}
+
+static uint8_t dict_lookup(const char *word, size_t len, const Dictionary *dict) {
+    if (!dict->index) {
+        for (size_t i = 0; i < dict->count; i++) {
+            if (strcmp(word, dict_word(dict, i)) == 0) return dict->weights ? dict->weights[i] : flat_weight(dict->count);
+        }
+        return 0;
+    }
+    size_t slot = hash_word(word, len) & dict->index_mask;
+    while (dict->index[slot]) {
+        uint32_t value = dict->index[slot];
+        if (strcmp(word, dict_word(dict, (value & DICT_SLOT_WORD) - 1)) == 0) return (uint8_t)(value >> DICT_SLOT_WEIGHT_SHIFT);
+        slot = (slot + 1) & dict->index_mask;
+    }
+    return 0;
+}
+
+// Вес слова в словаре; 0 — слова нет
+uint8_t dict_word_weight_utf8(const char *word, size_t len, const Dictionary *dict) {
+    count_metric(&metrics.dict_lookups, 1);
+    return dict_lookup(word, len, dict);
+}
+
+uint8_t dict_word_weight(const wchar_t *word, const Dictionary *dict) {
+    char utf8[MAX_WORD_LEN * 4];
+    size_t len = utf8_encode_word(word, utf8, sizeof(utf8));
+    if (len == 0) return 0;
+    return dict_word_weight_utf8(utf8, len, dict);
+}
+
+bool is_in_dict_utf8(const char *word, size_t len, const Dictionary *dict) {
+    return dict_word_weight_utf8(word, len, dict) > 0;
+}
+
+bool is_in_dict(const wchar_t *word, const Dictionary *dict) {
+    return dict_word_weight(word, dict) > 0;
+}
+
+// Словари всех раскладок в порядке групп. Раскладка без словаря допустима: её слова
+// не исправляются и в неё ничего не исправляется. false — не загружено ни одного словаря
+bool load_layout_dictionaries(Dictionary *dicts) {
+    int loaded = 0;
+    for (int l = 0; l < layout_set.count; l++) {
+        const Layout *layout = &layout_set.layouts[l];
+        if (access(layout->dict_file, F_OK) < 0) {
+            wprintf(L"Нет словаря %hs для раскладки %hs\n", layout->dict_file, layout->name);
+            continue;
+        }
+        if (!load_dictionary(layout->dict_file, &dicts[l])) {
+            free_layout_dictionaries(dicts);
+            return false;
+        }
+        loaded++;
+    }
+    if (loaded == 0) wprintf(L"Ошибка: Нет ни одного словаря\n");
+    return loaded > 0;
+}
+
+void free_layout_dictionaries(Dictionary *dicts) {
+    for (int l = 0; l < MAX_LAYOUTS; l++) free_dictionary(&dicts[l]);
+}
+
+/* ========== KEY TRIE FUNCTIONS ========== */
+
+// Позиция буквенной клавиши по коду; -1 для остальных клавиш
+static inline int keycode_to_key(int keycode) {
+    if (keycode <= 0 || keycode >= KEY_TABLE_SIZE) return -1;
+    return keycode_slots[keycode] - 1;
+}
+
+// Позиция клавиши для символа раскладки; -1, если символа нет на клавишах WORD_KEYS
+int char_to_key(wchar_t c, int layout) {
+    if (c <= 0 || c >= CHAR_RANGE) return -1;
+    return keycode_to_key(layout_set.layouts[layout].keys[c].keycode);
+}
+
+// Декодирование UTF-8 из арены словаря; 0 при ошибке или переполнении
+static size_t utf8_decode_word(const char *word, wchar_t *out, size_t out_len) {
+    size_t len = 0;
+    const unsigned char *p = (const unsigned char *)word;
+    while (*p) {
+        uint32_t c;
+        int extra;
+        if (*p < 0x80) { c = *p; extra = 0; }
+        else if ((*p & 0xE0) == 0xC0) { c = *p & 0x1F; extra = 1; }
+        else if ((*p & 0xF0) == 0xE0) { c = *p & 0x0F; extra = 2; }
+        else if ((*p & 0xF8) == 0xF0) { c = *p & 0x07; extra = 3; }
+        else return 0;
+        p++;
+        for (int i = 0; i < extra; i++, p++) {
+            if ((*p & 0xC0) != 0x80) return 0;
+            c = (c << 6) | (*p & 0x3F);
+        }
+        if (len + 1 >= out_len) return 0;
+        out[len++] = (wchar_t)c;
+    }
+    out[len] = L'\0';
+    return len;
+}
+
+// Узел при построении: дети связаны списком, отсортированным по клавише
+typedef struct {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint8_t key;
+    uint32_t flags;
+} TrieBuildNode;
+
+typedef struct {
+    TrieBuildNode *nodes;
+    size_t count;
+    size_t capacity;
+} TrieBuilder;
+
+static uint32_t trie_builder_child(TrieBuilder *builder, uint32_t parent, uint8_t key) {
+    uint32_t *link = &builder->nodes[parent].first_child;
+    while (*link && builder->nodes[*link].key < key) link = &builder->nodes[*link].next_sibling;
+    if (*link && builder->nodes[*link].key == key) return *link;
+    if (builder->count == builder->capacity) {
+        size_t capacity = builder->capacity * 2;
+        TrieBuildNode *nodes = realloc(builder->nodes, capacity * sizeof(TrieBuildNode));
+        if (!nodes) return 0;
+        builder->nodes = nodes;
+        builder->capacity = capacity;
+        link = NULL;  // массив переехал, ссылку ищем заново
+    }
+    uint32_t child = (uint32_t)builder->count++;
+    builder->nodes[child] = (TrieBuildNode){0, 0, key, 0};
+    if (!link) {
+        link = &builder->nodes[parent].first_child;
+        while (*link && builder->nodes[*link].key < key) link = &builder->nodes[*link].next_sibling;
+    }
+    builder->nodes[child].next_sibling = *link;
+    *link = child;
+    return child;
+}
+
+static bool trie_builder_add_dictionary(TrieBuilder *builder, const Dictionary *dict, int layout) {
+    uint32_t word_flag = TRIE_WORD(layout);
+    uint32_t prefix_flag = TRIE_PREFIX(layout);
+    wchar_t word[MAX_WORD_LEN];
+    int keys[MAX_WORD_LEN];
+    for (size_t i = 0; i < dict->count; i++) {
+        size_t len = utf8_decode_word(dict_word(dict, i), word, MAX_WORD_LEN);
+        size_t j;
+        for (j = 0; j < len; j++) {
+            keys[j] = char_to_key(word[j], layout);
+            if (keys[j] < 0) break;
+        }
+        if (len == 0 || j < len) continue;  // слово нельзя набрать на клавишах WORD_KEYS
+
+        uint32_t node = TRIE_ROOT;
+        builder->nodes[node].flags |= prefix_flag;
+        for (j = 0; j < len; j++) {
+            node = trie_builder_child(builder, node, (uint8_t)keys[j]);
+            if (!node) return false;
+            builder->nodes[node].flags |= prefix_flag;
+        }
+        // Одни и те же клавиши в раскладке — одно слово с точностью до регистра: берём самый частый вариант
+        const char *utf8 = dict_word(dict, i);
+        uint32_t weight = dict_lookup(utf8, strlen(utf8), dict);
+        uint32_t *flags = &builder->nodes[node].flags;
+        if (weight > TRIE_WEIGHT(*flags, layout)) {
+            *flags = (*flags & ~(((1u << TRIE_WEIGHT_BITS) - 1) << TRIE_WEIGHT_SHIFT(layout))) |
+                     (weight << TRIE_WEIGHT_SHIFT(layout));
+        }
+        *flags |= word_flag;
+    }
+    return true;
+}
+
+// Построение графа по словарям всех раскладок; дети каждого узла раскладываются подряд (обход в ширину)
+bool build_key_trie(KeyTrie *trie, const Dictionary *dicts) {
+    TrieBuilder builder = {0};
+    builder.capacity = 1024;
+    builder.nodes = malloc(builder.capacity * sizeof(TrieBuildNode));
+    if (!builder.nodes) return false;
+    builder.nodes[0] = (TrieBuildNode){0, 0, 0, 0};
+    builder.count = 1;
+
+    for (int layout = 0; layout < layout_set.count; layout++) {
+        if (!trie_builder_add_dictionary(&builder, &dicts[layout], layout)) {
+            free(builder.nodes);
+            return false;
+        }
+    }
+
+    trie->nodes = calloc(builder.count, sizeof(TrieNode));
+    uint32_t *order = malloc(builder.count * sizeof(uint32_t));
+    if (!trie->nodes || !order) {
+        free(trie->nodes);
+        free(order);
+        free(builder.nodes);
+        trie->nodes = NULL;
+        return false;
+    }
+    // order[i] — узел построителя, занявший место i в итоговом массиве
+    order[0] = TRIE_ROOT;
+    size_t next = 1;
+    for (size_t i = 0; i < builder.count; i++) {
+        const TrieBuildNode *src = &builder.nodes[order[i]];
+        TrieNode *dst = &trie->nodes[i];
+        dst->flags = src->flags;
+        dst->first_child = (uint32_t)next;
+        for (uint32_t child = src->first_child; child; child = builder.nodes[child].next_sibling) {
+            dst->child_mask |= 1ull << builder.nodes[child].key;
+            order[next++] = child;
+        }
+    }
+    trie->count = builder.count;
+    free(order);
+    free(builder.nodes);
+    return true;
+}
+
+void free_key_trie(KeyTrie *trie) {
+    free(trie->nodes);
+    trie->nodes = NULL;
+    trie->count = 0;
+}
+
+// Переход по клавише: O(1), без сравнения строк
+static inline uint32_t trie_step(const KeyTrie *trie, uint32_t node, int key) {
+    if (node == TRIE_DEAD || key < 0 || !trie->nodes) return TRIE_DEAD;
+    uint64_t mask = trie->nodes[node].child_mask;
+    if (!(mask & (1ull << key))) return TRIE_DEAD;
+    return trie->nodes[node].first_child + (uint32_t)__builtin_popcountll(mask & ((1ull << key) - 1));
+}
+
+static inline uint32_t trie_flags(const KeyTrie *trie, uint32_t node) {
+    if (node == TRIE_DEAD || !trie->nodes) return 0;
+    return trie->nodes[node].flags;
+}
+
+/* ========== FUZZY INDEX FUNCTIONS ========== */
+
+// FNV-1a по клавишам без позиций skip1 и skip2, как у слов в хеш-таблице словаря
+static inline uint32_t fuzzy_hash(const uint8_t *keys, size_t len, size_t skip1, size_t skip2) {
+    uint32_t h = 2166136261u;
+    for (size_t k = 0; k < len; k++) {
+        if (k == skip1 || k == skip2) continue;
+        h ^= keys[k];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Хеши вариантов префикса: сам префикс, без одной и без двух клавиш
+// (distance — сколько клавиш можно убрать), не короче FUZZY_MIN_VARIANT
+static size_t fuzzy_variants(const uint8_t *keys, size_t len, int distance, uint32_t *hashes) {
+    if (len > FUZZY_PREFIX) len = FUZZY_PREFIX;
+    int removable = len > FUZZY_MIN_VARIANT ? (int)(len - FUZZY_MIN_VARIANT) : 0;
+    if (distance > removable) distance = removable;
+    size_t count = 0;
+    hashes[count++] = fuzzy_hash(keys, len, SIZE_MAX, SIZE_MAX);
+    for (size_t i = 0; i < len && distance >= 1; i++) {
+        hashes[count++] = fuzzy_hash(keys, len, i, SIZE_MAX);
+        for (size_t j = i + 1; j < len && distance >= 2; j++) hashes[count++] = fuzzy_hash(keys, len, i, j);
+    }
+    return count;
+}
+
+static void fuzzy_insert(FuzzyIndex *index, uint32_t hash, uint32_t word) {
+    uint32_t value = (hash & ~FUZZY_WORD_MASK) | (word + 1);
+    size_t slot = hash & index->mask;
+    while (index->slots[slot]) {
+        if (index->slots[slot] == value) return;  // тот же вариант того же слова ("ссора" без "с")
+        slot = (slot + 1) & index->mask;
+    }
+    index->slots[slot] = value;
+    index->entries++;
+}
+
+// Ограниченное расстояние Дамерау — Левенштейна (перестановка соседних клавиш — одна ошибка);
+// max + 1, как только расстояние заведомо больше max
+static int fuzzy_distance(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len, int max) {
+    if ((int)(a_len > b_len ? a_len - b_len : b_len - a_len) > max) return max + 1;
+    int rows[3][FUZZY_MAX_KEYS + 1];
+    int *prev2 = rows[0], *prev = rows[1], *cur = rows[2];
+    for (size_t j = 0; j <= b_len; j++) prev[j] = (int)j;
+    for (size_t i = 1; i <= a_len; i++) {
+        cur[0] = (int)i;
+        int row_min = cur[0];
+        for (size_t j = 1; j <= b_len; j++) {
+            int cost = a[i - 1] != b[j - 1];
+            int d = prev[j - 1] + cost;
+            if (prev[j] + 1 < d) d = prev[j] + 1;
+            if (cur[j - 1] + 1 < d) d = cur[j - 1] + 1;
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && prev2[j - 2] + 1 < d) {
+                d = prev2[j - 2] + 1;
+            }
+            cur[j] = d;
+            if (d < row_min) row_min = d;
+        }
+        if (row_min > max) return max + 1;
+        int *t = prev2;
+        prev2 = prev;
+        prev = cur;
+        cur = t;
+    }
+    return prev[b_len] > max ? max + 1 : prev[b_len];
+}
+
+// Индекс по словарям всех раскладок: клавиши слов и варианты их префиксов.
+// Таблица заполнена не больше чем на 3/4, слот — 4 байта
+bool build_fuzzy_index(FuzzyIndex *index, const Dictionary *dicts) {
+    memset(index, 0, sizeof(*index));
+    size_t words = 0, keys_size = 0;
+    for (int l = 0; l < layout_set.count; l++) {
+        words += dicts[l].count;
+        keys_size += dicts[l].arena_size;
+    }
+    if (words == 0) return true;
+    if (words >= FUZZY_WORD_MASK) return false;
+    index->keys = malloc(keys_size);
+    index->offsets = malloc((words + 1) * sizeof(uint32_t));
+    index->layouts = malloc(words);
+    if (!index->keys || !index->offsets || !index->layouts) {
+        free_fuzzy_index(index);
+        return false;
+    }
+
+    // Клавиши слов; слова, которые не набираются на клавишах WORD_KEYS, пропускаются
+    size_t variants = 0, pos = 0;
+    wchar_t word[MAX_WORD_LEN];
+    for (int l = 0; l < layout_set.count; l++) {
+        for (size_t i = 0; i < dicts[l].count; i++) {
+            size_t len = utf8_decode_word(dict_word(&dicts[l], i), word, MAX_WORD_LEN);
+            if (len < FUZZY_MIN_LEN - 1 || len > FUZZY_MAX_KEYS) continue;
+            size_t j;
+            for (j = 0; j < len; j++) {
+                int key = char_to_key(word[j], l);
+                if (key < 0) break;
+                index->keys[pos + j] = (uint8_t)key;
+            }
+            if (j < len) continue;
+            size_t prefix = len < FUZZY_PREFIX ? len : FUZZY_PREFIX;
+            variants += 1 + prefix + prefix * (prefix - 1) / 2;
+            index->offsets[index->count] = (uint32_t)pos;
+            index->layouts[index->count++] = (uint8_t)l;
+            pos += len;
+        }
+    }
+    index->offsets[index->count] = (uint32_t)pos;
+
+    size_t size = 16;
+    while (size * 3 < variants * 4) size <<= 1;
+    index->slots = calloc(size, sizeof(uint32_t));
+    if (!index->slots) {
+        free_fuzzy_index(index);
+        return false;
+    }
+    index->mask = size - 1;
+    uint32_t hashes[FUZZY_VARIANTS];
+    for (size_t w = 0; w < index->count; w++) {
+        const uint8_t *keys = index->keys + index->offsets[w];
+        size_t n = fuzzy_variants(keys, index->offsets[w + 1] - index->offsets[w], FUZZY_MAX_DISTANCE, hashes);
+        for (size_t v = 0; v < n; v++) fuzzy_insert(index, hashes[v], (uint32_t)w);
+    }
+    return true;
+}
+
+void free_fuzzy_index(FuzzyIndex *index) {
+    free(index->slots);
+    free(index->keys);
+    free(index->offsets);
+    free(index->layouts);
+    memset(index, 0, sizeof(*index));
+}
+
+static inline size_t fuzzy_index_memory(const FuzzyIndex *index) {
+    if (!index->slots) return 0;
+    return (index->mask + 1) * sizeof(uint32_t) + index->offsets[index->count] +
+           (index->count + 1) * sizeof(uint32_t) + index->count;
+}
+
+// Допустимое число ошибок для слова из len клавиш; 0 — слово слишком короткое
+static inline int fuzzy_max_distance(size_t len) {
+    if (len < FUZZY_MIN_LEN || len > FUZZY_MAX_KEYS) return 0;
+    return len >= FUZZY_LONG_LEN ? FUZZY_MAX_DISTANCE : 1;
+}
+
+// Наименьшее расстояние от клавиш слова до слов словаря каждой раскладки: distance[l]
+// не больше max_distance или UINT8_MAX. Возвращает маску раскладок, где слово нашлось.
+// Работа ограничена: не больше FUZZY_VARIANTS проб таблицы и FUZZY_MAX_CANDIDATES проверок
+// кандидатов с тем же тегом; варианты перебираются от точного префикса к более далёким
+uint32_t fuzzy_lookup(const FuzzyIndex *index, const uint8_t *keys, size_t len, int max_distance, uint8_t *distance) {
+    memset(distance, UINT8_MAX, MAX_LAYOUTS);
+    if (!index || !index->slots || max_distance <= 0) return 0;
+    count_metric(&metrics.dict_lookups, 1);
+    uint32_t hashes[FUZZY_VARIANTS];
+    size_t n = fuzzy_variants(keys, len, max_distance, hashes);
+    uint32_t found = 0;
+    int budget = FUZZY_MAX_CANDIDATES;
+    for (size_t v = 0; v < n && budget > 0; v++) {
+        uint32_t tag = hashes[v] & ~FUZZY_WORD_MASK;
+        for (size_t slot = hashes[v] & index->mask; index->slots[slot]; slot = (slot + 1) & index->mask) {
+            uint32_t value = index->slots[slot];
+            if ((value & ~FUZZY_WORD_MASK) != tag) continue;
+            uint32_t w = (value & FUZZY_WORD_MASK) - 1;
+            int l = index->layouts[w];
+            if (distance[l] == 0) continue;
+            int limit = distance[l] <= max_distance ? distance[l] - 1 : max_distance;
+            if (--budget < 0) break;
+            int d = fuzzy_distance(keys, len, index->keys + index->offsets[w], index->offsets[w + 1] - index->offsets[w],
+                                   limit);
+            if (d <= limit) {
+                distance[l] = (uint8_t)d;
+                found |= 1u << l;
+            }
+        }
+    }
+    return found;
+}
+
+// Раскладка из candidates, в словаре которой есть слово на расстоянии одной-двух ошибок
+// от набранных клавиш, и ближе, чем любое слово словаря набранной раскладки.
+// Несколько одинаково близких раскладок различает модель n-грамм; -1 — не нашлось
+int fuzzy_word_layout(const FuzzyIndex *index, const NgramModel *model, const wchar_t *word, int typed_layout,
+                      uint32_t candidates) {
+    uint8_t keys[FUZZY_MAX_KEYS];
+    size_t len = wcslen(word);
+    int max_distance = fuzzy_max_distance(len);
+    if (max_distance == 0) return -1;
+    for (size_t i = 0; i < len; i++) {
+        int key = char_to_key(word[i], typed_layout);
+        if (key < 0) return -1;
+        keys[i] = (uint8_t)key;
+    }
+    uint8_t distance[MAX_LAYOUTS];
+    uint32_t found = fuzzy_lookup(index, keys, len, max_distance, distance);
+    int best = UINT8_MAX;
+    uint32_t best_layouts = 0;
+    for (int l = 0; l < layout_set.count; l++) {
+        if (!(((found & candidates) >> l) & 1) || distance[l] > best) continue;
+        if (distance[l] < best) best_layouts = 0;
+        best = distance[l];
+        best_layouts |= 1u << l;
+    }
+    if (!best_layouts || distance[typed_layout] <= best) return -1;
+    LOG(LOG_DEBUG, L"Fuzzy match: %d edit(s) from a dictionary word, typed layout %d\n", best,
+        distance[typed_layout] == UINT8_MAX ? -1 : distance[typed_layout]);
+    int target = __builtin_ctz(best_layouts);
+    if (best_layouts & (best_layouts - 1)) {
+        int ranked = rank_word_layouts(model, word, typed_layout, best_layouts);
+        if (ranked >= 0) target = ranked;
+    }
+    return target;
+}
+
+/* ========== N-GRAM MODEL FUNCTIONS ========== */
+
+// Символы модели для клавиш слова; false — слово не набирается на буквенных клавишах
+static bool ngram_word_keys(const wchar_t *word, int layout, uint8_t *keys, size_t *len) {
+    size_t i;
+    for (i = 0; word[i] && i < MAX_WORD_LEN; i++) {
+        int key = char_to_key(word[i], layout);
+        if (key < 0 || layout_set.symbols[key] < 0) return false;
+        keys[i] = (uint8_t)layout_set.symbols[key];
+    }
+    *len = i;
+    return i > 0;
+}
+
+// Элементов в таблице одной раскладки
+static inline size_t ngram_table_size(int symbols) {
+    return (size_t)symbols * symbols * symbols;
+}
+
+// Обучение по словарям: интерполяция частот триграмм, биграмм и униграмм (со сглаживанием
+// Лапласа), чтобы у незнакомых сочетаний оставалась ненулевая вероятность.
+// logprob — [a][b][c][раскладка]. holdout > 0 — каждое holdout-е слово
+// пропускается (для проверки на отложенных словах)
+bool train_ngram_model(int16_t *logprob, const Dictionary *dicts, size_t holdout) {
+    const int S = layout_set.symbol_count + 1, boundary = S - 1;
+    const size_t cube = ngram_table_size(S);
+    const size_t counters = cube + 2 * (size_t)S * S + 2 * (size_t)S;
+    uint32_t *trigrams = calloc(counters, sizeof(uint32_t));
+    if (!trigrams) return false;
+    uint32_t *contexts = trigrams + cube, *bigrams = contexts + S * S;
+    uint32_t *bigram_contexts = bigrams + S * S, *unigrams = bigram_contexts + S;
+    wchar_t word[MAX_WORD_LEN];
+    uint8_t keys[MAX_WORD_LEN];
+
+    for (int layout = 0; layout < layout_set.count; layout++) {
+        const Dictionary *dict = &dicts[layout];
+        memset(trigrams, 0, counters * sizeof(uint32_t));
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < dict->count; i++) {
+            if (holdout && i % holdout == 0) continue;
+            size_t len;
+            utf8_decode_word(dict_word(dict, i), word, MAX_WORD_LEN);
+            if (!ngram_word_keys(word, layout, keys, &len)) continue;
+            int a = boundary, b = boundary;
+            for (size_t j = 0; j <= len; j++) {
+                int c = j < len ? keys[j] : boundary;
+                trigrams[((size_t)a * S + b) * S + c]++;
+                contexts[a * S + b]++;
+                bigrams[b * S + c]++;
+                bigram_contexts[b]++;
+                unigrams[c]++;
+                total++;
+                a = b;
+                b = c;
+            }
+        }
+
+        const int layouts = layout_set.count;
+        for (int a = 0; a < S; a++) {
+            for (int b = 0; b < S; b++) {
+                for (int c = 0; c < S; c++) {
+                    double p_uni = (unigrams[c] + 1.0) / (double)(total + S);
+                    double p_bi = bigram_contexts[b] ? (double)bigrams[b * S + c] / bigram_contexts[b] : 0.0;
+                    double p;
+                    if (contexts[a * S + b]) {
+                        p = 0.6 * trigrams[((size_t)a * S + b) * S + c] / contexts[a * S + b] + 0.3 * p_bi + 0.1 * p_uni;
+                    } else {
+                        p = 0.75 * p_bi + 0.25 * p_uni;
+                    }
+                    logprob[(((size_t)a * S + b) * S + c) * layouts + layout] = (int16_t)lrint(log2(p) * NGRAM_SCALE);
+                }
+            }
+        }
+    }
+    free(trigrams);
+    return true;
+}
+
+// Оценки последовательности символов для всех раскладок за один проход, без выделения
+// памяти: на символ — одно чтение соседних оценок всех раскладок
+static inline void ngram_score(const NgramModel *model, const uint8_t *keys, size_t len, int32_t *score) {
+    const int S = model->symbols, boundary = S - 1, layouts = model->layouts;
+    // Суммы в отдельных переменных, чтобы остались в регистрах (MAX_LAYOUTS == 4)
+    int32_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    int a = boundary, b = boundary;
+    for (size_t i = 0; i <= len; i++) {
+        int c = i < len ? keys[i] : boundary;
+        const int16_t *entry = model->logprob + (((size_t)a * S + b) * S + c) * layouts;
+        sum0 += entry[0];
+        if (layouts > 1) sum1 += entry[1];
+        if (layouts > 2) sum2 += entry[2];
+        if (layouts > 3) sum3 += entry[3];
+        a = b;
+        b = c;
+    }
+    score[0] = sum0;
+    score[1] = sum1;
+    score[2] = sum2;
+    score[3] = sum3;
+}
+
+// Лучшая обученная раскладка из candidates (бит на группу) и её перевес над
+// раскладкой other в 1/NGRAM_SCALE бита на символ; -1 — среди кандидатов нет обученных
+static inline int ngram_best(const NgramModel *model, const uint8_t *keys, size_t len, uint32_t candidates,
+                      int other, int32_t *margin) {
+    int32_t score[MAX_LAYOUTS];
+    ngram_score(model, keys, len, score);
+    int best = -1;
+    for (int l = 0; l < model->layouts; l++) {
+        if (((candidates & model->trained) >> l) & 1 && (best < 0 || score[l] > score[best])) best = l;
+    }
+    if (best >= 0) *margin = (score[best] - score[other]) / (int32_t)(len + 1);
+    return best;
+}
+
+// Раскладка из candidates, на язык которой похожи клавиши слова; -1 — слово короткое,
+// не набирается на буквенных клавишах или перевес над набранной раскладкой меньше NGRAM_MARGIN на символ
+int detect_word_layout(const NgramModel *model, const wchar_t *word, int typed_layout, uint32_t candidates) {
+    if (!model || !model->logprob || !word || !((model->trained >> typed_layout) & 1)) return -1;
+    uint8_t keys[MAX_WORD_LEN];
+    size_t len;
+    if (!ngram_word_keys(word, typed_layout, keys, &len) || len < NGRAM_MIN_LEN) return -1;
+
+    int32_t margin;
+    int best = ngram_best(model, keys, len, candidates & ~(1u << typed_layout), typed_layout, &margin);
+    if (best < 0) return -1;
+    LOG(LOG_DEBUG, L"N-gram margin: %.2f bits/char towards %hs over %hs\n", margin / (double)NGRAM_SCALE,
+        layout_name(best), layout_name(typed_layout));
+    return margin >= NGRAM_MARGIN ? best : -1;
+}
+
+// Выбор между несколькими раскладками, в словарях которых слово есть: самая похожая,
+// без порога; -1 — модели нет
+int rank_word_layouts(const NgramModel *model, const wchar_t *word, int typed_layout, uint32_t candidates) {
+    if (!model || !model->logprob || !word) return -1;
+    uint8_t keys[MAX_WORD_LEN];
+    size_t len;
+    if (!ngram_word_keys(word, typed_layout, keys, &len)) return -1;
+    int32_t margin;
+    return ngram_best(model, keys, len, candidates, typed_layout, &margin);
+}
+
+// Ожидаемый заголовок файла модели для текущего набора раскладок и словарей
+static void ngram_expected_header(NgramHeader *header) {
+    memset(header, 0, sizeof(*header));
+    header->magic = NGRAM_MAGIC;
+    header->version = NGRAM_VERSION;
+    header->letter_keys = layout_set.letter_keys;
+    header->layout_count = (uint32_t)layout_set.count;
+    header->symbols = (uint32_t)layout_set.symbol_count + 1;
+    header->scale = NGRAM_SCALE;
+    for (int l = 0; l < layout_set.count; l++) {
+        const Layout *layout = &layout_set.layouts[l];
+        memcpy(header->layouts[l], layout->name, sizeof(header->layouts[l]));
+        struct stat st;
+        if (stat(layout->dict_file, &st) < 0) {
+            header->source_mtime_sec[l] = header->source_mtime_nsec[l] = -1;
+            continue;
+        }
+        header->source_size[l] = (uint64_t)st.st_size;
+        header->source_mtime_sec[l] = (int64_t)st.st_mtim.tv_sec;
+        header->source_mtime_nsec[l] = (int64_t)st.st_mtim.tv_nsec;
+    }
+}
+
+// Отображение файла модели; false — файла нет, он повреждён, словари или раскладки изменились
+static bool map_ngram_model(NgramModel *model) {
+    int fd = open(NGRAM_FILE, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(NgramHeader)) {
+        close(fd);
+        return false;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    const NgramHeader *header = mapping;
+    NgramHeader expected;
+    ngram_expected_header(&expected);
+    size_t tables_size = layout_set.count * ngram_table_size(expected.symbols) * sizeof(int16_t);
+    if (header->magic != NGRAM_MAGIC || header->version != NGRAM_VERSION || header->scale != NGRAM_SCALE) {
+        wprintf(L"Файл %hs повреждён или другой версии\n", NGRAM_FILE);
+        munmap(mapping, st.st_size);
+        return false;
+    }
+    expected.trained = header->trained;
+    if (memcmp(header, &expected, sizeof(expected)) != 0 || (size_t)st.st_size != sizeof(NgramHeader) + tables_size) {
+        wprintf(L"Файл %hs устарел (пересоберите: --train-ngram)\n", NGRAM_FILE);
+        munmap(mapping, st.st_size);
+        return false;
+    }
+    model->logprob = (const int16_t *)(header + 1);
+    model->layouts = layout_set.count;
+    model->symbols = (int)expected.symbols;
+    model->trained = header->trained;
+    model->mapping = mapping;
+    model->mapping_size = st.st_size;
+    return true;
+}
+
+// Память таблиц модели
+static inline size_t ngram_model_memory(const NgramModel *model) {
+    if (model->mapping) return model->mapping_size;
+    return model->logprob ? model->layouts * ngram_table_size(model->symbols) * sizeof(int16_t) : 0;
+}
+
+// Модель из файла, а если его нет или он устарел — обучение по уже загруженным словарям
+bool load_ngram_model(NgramModel *model, const Dictionary *dicts) {
+    double start = monotonic_ns();
+    if (map_ngram_model(model)) {
+        wprintf(L"Модель %hs: %zu КБ, загрузка %.3f мс\n", NGRAM_FILE, model->mapping_size / 1024,
+                (monotonic_ns() - start) / 1e6);
+        return true;
+    }
+    int symbols = layout_set.symbol_count + 1;
+    int16_t *logprob = malloc(layout_set.count * ngram_table_size(symbols) * sizeof(int16_t));
+    if (!logprob) return false;
+    if (!train_ngram_model(logprob, dicts, 0)) {
+        free(logprob);
+        return false;
+    }
+    model->logprob = logprob;
+    model->layouts = layout_set.count;
+    model->symbols = symbols;
+    model->trained = 0;
+    for (int l = 0; l < layout_set.count; l++) {
+        if (dicts[l].count > 0) model->trained |= 1u << l;
+    }
+    wprintf(L"Модель n-грамм обучена по словарям: %zu КБ, %.1f мс\n", ngram_model_memory(model) / 1024,
+            (monotonic_ns() - start) / 1e6);
+    return true;
+}
+
+void free_ngram_model(NgramModel *model) {
+    if (model->mapping) {
+        munmap(model->mapping, model->mapping_size);
+    } else {
+        free((void *)model->logprob);
+    }
+    memset(model, 0, sizeof(*model));
+}
+
+// Обучение модели и запись NGRAM_FILE (режим --train-ngram)
+int train_ngram_file(void) {
+    Dictionary dicts[MAX_LAYOUTS] = {0};
+    NgramHeader header;
+    ngram_expected_header(&header);
+    if (!load_layout_dictionaries(dicts)) return 1;
+    size_t tables_size = layout_set.count * ngram_table_size(header.symbols) * sizeof(int16_t);
+    int16_t *logprob = malloc(tables_size);
+    bool ok = logprob && train_ngram_model(logprob, dicts, 0);
+    for (int l = 0; l < layout_set.count; l++) {
+        if (dicts[l].count > 0) header.trained |= 1u << l;
+    }
+    free_layout_dictionaries(dicts);
+    if (!ok) {
+        free(logprob);
+        return 1;
+    }
+
+    // Как и для .idx: временный файл и переименование
+    char tmp_path[] = NGRAM_FILE ".tmp";
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        perror("Не удалось создать файл модели");
+        free(logprob);
+        return 1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(logprob, tables_size, 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+    free(logprob);
+    if (!ok || rename(tmp_path, NGRAM_FILE) < 0) {
+        perror("Не удалось записать файл модели");
+        unlink(tmp_path);
+        return 1;
+    }
+    wprintf(L"Модель записана в %hs (%zu КБ)\n", NGRAM_FILE, (sizeof(header) + tables_size) / 1024);
+    return 0;
+}
+
+/* ========== DICTIONARY RELOAD FUNCTIONS ========== */
+
+size_t dict_set_memory(const DictSet *set) {
+    size_t memory = set->trie.count * sizeof(TrieNode) + fuzzy_index_memory(&set->fuzzy) + ngram_model_memory(&set->ngram);
+    for (int l = 0; l < layout_set.count; l++) {
+        const Dictionary *dict = &set->dicts[l];
+        memory += dict->mapping ? dict->mapping_size : dictionary_memory(dict);
+    }
+    return memory;
+}
+
+static size_t dict_set_words(const DictSet *set) {
+    size_t words = 0;
+    for (int l = 0; l < layout_set.count; l++) words += set->dicts[l].count;
+    return words;
+}
+
+// Словари, граф клавиш и модель n-грамм; граф и модель необязательны
+bool load_dict_set(DictSet *set) {
+    double start = monotonic_ns();
+    if (!load_layout_dictionaries(set->dicts)) return false;
+    double trie_start = monotonic_ns();
+    if (build_key_trie(&set->trie, set->dicts)) {
+        wprintf(L"Граф клавиш: %zu узлов, %zu КБ, построен за %.1f мс\n",
+                set->trie.count, set->trie.count * sizeof(TrieNode) / 1024, (monotonic_ns() - trie_start) / 1e6);
+    } else {
+        wprintf(L"Не удалось построить граф клавиш, используется поиск по словарю\n");
+    }
+    double fuzzy_start = monotonic_ns();
+    if (build_fuzzy_index(&set->fuzzy, set->dicts)) {
+        wprintf(L"Индекс опечаток: %zu слов, %zu вариантов, %zu КБ, построен за %.1f мс\n", set->fuzzy.count,
+                set->fuzzy.entries, fuzzy_index_memory(&set->fuzzy) / 1024, (monotonic_ns() - fuzzy_start) / 1e6);
+    } else {
+        wprintf(L"Не удалось построить индекс опечаток, слова с опечатками решает модель n-грамм\n");
+    }
+    // Модель n-грамм для слов, которых нет в словарях
+    if (!load_ngram_model(&set->ngram, set->dicts)) {
+        wprintf(L"Не удалось загрузить модель n-грамм, исправляются только слова из словарей\n");
+    }
+    set->build_ms = (monotonic_ns() - start) / 1e6;
+    return true;
+}
+
+void free_dict_set(DictSet *set) {
+    free_layout_dictionaries(set->dicts);
+    free_key_trie(&set->trie);
+    free_fuzzy_index(&set->fuzzy);
+    free_ngram_model(&set->ngram);
+}
+
+// Текущий набор для потока анализа. Указатель объявляется опасным и перечитывается:
+// если за это время набор сменили, берём новый. Поток перезагрузки не освободит
+// набор, пока он объявлен опасным, поэтому чтение никогда не ждёт и не блокируется
+const DictSet *dict_store_acquire(DictStore *store) {
+    DictSet *set;
+    do {
+        set = atomic_load(&store->current);
+        atomic_store(&store->hazard, set);
+    } while (set != atomic_load(&store->current));
+    return set;
+}
+
+void dict_store_release(DictStore *store) {
+    atomic_store(&store->hazard, NULL);
+}
+
+// Публикация нового набора и освобождение старого, когда поток анализа его отпустит
+static void dict_store_publish(DictStore *store, DictSet *set) {
+    DictSet *old = atomic_exchange(&store->current, set);
+    while (atomic_load(&store->hazard) == old) usleep(1000);
+    free_dict_set(old);
+    free(old);
+}
+
+static bool is_dictionary_name(const char *name) {
+    for (int l = 0; l < layout_set.count; l++) {
+        if (strcmp(name, layout_set.layouts[l].dict_file) == 0) return true;
+    }
+    return false;
+}
+
+// Поток перезагрузки: ждёт изменений словарей, собирает новый набор целиком
+// и только потом публикует его. Редакторы часто сохраняют файл в несколько
+// шагов, поэтому после первого события ждём, пока каталог успокоится
+static void *dict_reload_thread_main(void *arg) {
+    DictStore *store = arg;
+    struct pollfd fds[2] = {
+        { .fd = store->inotify_fd, .events = POLLIN },
+        { .fd = store->stop_fd, .events = POLLIN },
+    };
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int timeout = -1;
+    bool changed = false;
+    while (true) {
+        int n = poll(fds, 2, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+        if (fds[1].revents) break;
+        if (n == 0) {
+            // Тишина после изменений: пора пересобирать
+            timeout = -1;
+            if (!changed) continue;
+            changed = false;
+            DictSet *set = calloc(1, sizeof(DictSet));
+            if (!set || !load_dict_set(set)) {
+                free(set);
+                store->failed_reloads++;
+                wprintf(L"Не удалось перезагрузить словари, остаются прежние\n");
+                continue;
+            }
+            set->generation = atomic_load(&store->current)->generation + 1;
+            dict_store_publish(store, set);
+            store->reloads++;
+            count_metric(&metrics.dict_reloads, 1);
+            atomic_store_explicit(&metrics.dict_memory, dict_set_memory(set), memory_order_relaxed);
+            wprintf(L"Словари перезагружены: %zu слов, %zu КБ, сборка %.1f мс\n",
+                    dict_set_words(set), dict_set_memory(set) / 1024, set->build_ms);
+            continue;
+        }
+        ssize_t len = read(store->inotify_fd, buffer, sizeof(buffer));
+        for (char *p = buffer; len > 0 && p < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->len > 0 && is_dictionary_name(event->name)) changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (changed) timeout = DICT_RELOAD_SETTLE_MS;
+    }
+    return NULL;
+}
+
+// Наблюдение за каталогом словарей: файлы часто заменяются переименованием,
+// поэтому следим не за самими файлами, а за записями в каталоге
+bool start_dict_watcher(DictStore *store) {
+    store->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    store->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (store->inotify_fd < 0 || store->stop_fd < 0 ||
+        inotify_add_watch(store->inotify_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+        perror("Не удалось следить за словарями");
+        stop_dict_watcher(store);
+        return false;
+    }
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    store->thread_started = pthread_create(&store->thread, NULL, dict_reload_thread_main, store) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!store->thread_started) {
+        perror("Не удалось запустить поток перезагрузки словарей");
+        stop_dict_watcher(store);
+        return false;
+    }
+    return true;
+}
+
+void stop_dict_watcher(DictStore *store) {
+    if (store->thread_started) {
+        eventfd_write(store->stop_fd, 1);
+        pthread_join(store->thread, NULL);
+        store->thread_started = false;
+    }
+    if (store->inotify_fd >= 0) close(store->inotify_fd);
+    if (store->stop_fd >= 0) close(store->stop_fd);
+    store->inotify_fd = store->stop_fd = -1;
+}
+
+// Набор сменился посреди слова: путь по старому графу пересчитывается по новому
+void rebase_word(const DictSet *set, WordState *ws, int system_layout) {
+    ws->generation = set->generation;
+    ws->trie_path[0] = TRIE_ROOT;
+    for (int i = 0; i < ws->word_len; i++) {
+        ws->trie_path[i + 1] = trie_step(&set->trie, ws->trie_path[i], char_to_key(ws->word[i], system_layout));
+    }
+}
+
+// Поля Switcher, через которые process_word читает словари
+void use_dict_set(Switcher *sw, const DictSet *set) {
+    sw->dicts = set->dicts;
+    sw->trie = &set->trie;
+    sw->fuzzy = &set->fuzzy;
+    sw->ngram = set->ngram.logprob ? &set->ngram : NULL;
+}
+
+/* ========== LEARNING FUNCTIONS ========== */
+
+static LearnEntry *learn_find(LearnStore *store, const char *word, size_t len, bool insert) {
+    uint32_t hash = hash_word(word, len);
+    for (size_t slot = hash & (LEARN_CAPACITY - 1);; slot = (slot + 1) & (LEARN_CAPACITY - 1)) {
+        LearnEntry *entry = &store->entries[slot];
+        if (entry->word[0] == '\0') {
+            if (!insert || store->count >= LEARN_CAPACITY / 2) return NULL;
+            entry->hash = hash;
+            memcpy(entry->word, word, len);
+            entry->word[len] = '\0';
+            store->count++;
+            return entry;
+        }
+        if (entry->hash == hash && strcmp(entry->word, word) == 0) return entry;
+    }
+}
+
+// Удаление со сдвигом назад: записи той же цепочки встают ближе к своему слоту
+static void learn_remove(LearnStore *store, size_t hole) {
+    const size_t mask = LEARN_CAPACITY - 1;
+    for (size_t next = (hole + 1) & mask; store->entries[next].word[0]; next = (next + 1) & mask) {
+        size_t home = store->entries[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            store->entries[hole] = store->entries[next];
+            hole = next;
+        }
+    }
+    memset(&store->entries[hole], 0, sizeof(store->entries[hole]));
+    store->count--;
+}
+
+// Место для отмены в заполненной таблице: вытесняется самое редкое слово без отмен
+static bool learn_evict_seen(LearnStore *store) {
+    size_t victim = LEARN_CAPACITY;
+    for (size_t i = 0; i < LEARN_CAPACITY; i++) {
+        const LearnEntry *entry = &store->entries[i];
+        if (entry->word[0] == '\0' || entry->reverts) continue;
+        if (victim == LEARN_CAPACITY || entry->seen < store->entries[victim].seen) victim = i;
+    }
+    if (victim == LEARN_CAPACITY) return false;
+    LOG(LOG_DEBUG, L"Learn table full, forgetting %hs\n", store->entries[victim].word);
+    learn_remove(store, victim);
+    return true;
+}
+
+static void learn_warn_full(LearnStore *store, const char *word) {
+    if (store->full_warned) return;
+    store->full_warned = true;
+    LOG(LOG_WARN, L"Таблица обучения заполнена (%zu слов), слово не запомнено: %hs\n", store->count, word);
+}
+
+// Count-min с консервативным обновлением: растут только минимальные счётчики
+// слова; возвращает оценку числа наборов. Старые наборы забываются делением
+// счётчиков пополам, иначе за недели разных слов оценки бы сплошь переполнились
+static unsigned learn_sketch_add(LearnStore *store, uint32_t hash, unsigned count) {
+    if (++store->sketch_adds >= LEARN_SKETCH_DECAY) {
+        store->sketch_adds = 0;
+        for (int row = 0; row < LEARN_SKETCH_ROWS; row++) {
+            for (size_t i = 0; i < LEARN_SKETCH_WIDTH; i++) store->sketch[row][i] >>= 1;
+        }
+    }
+    size_t slots[LEARN_SKETCH_ROWS];
+    unsigned estimate = UINT8_MAX;
+    for (int row = 0; row < LEARN_SKETCH_ROWS; row++) {
+        // Строкам нужны независимые слоты: хеш перемешивается заново (fmix32 из MurmurHash3)
+        uint32_t h = hash ^ ((uint32_t)row * 0x9E3779B9u);
+        h ^= h >> 16;
+        h *= 0x85EBCA6Bu;
+        h ^= h >> 13;
+        h *= 0xC2B2AE35u;
+        h ^= h >> 16;
+        slots[row] = h & (LEARN_SKETCH_WIDTH - 1);
+        if (store->sketch[row][slots[row]] < estimate) estimate = store->sketch[row][slots[row]];
+    }
+    estimate = estimate + count > UINT8_MAX ? UINT8_MAX : estimate + count;
+    for (int row = 0; row < LEARN_SKETCH_ROWS; row++) {
+        if (store->sketch[row][slots[row]] < estimate) store->sketch[row][slots[row]] = (uint8_t)estimate;
+    }
+    return estimate;
+}
+
+static inline void learn_bump(uint16_t *counter, unsigned count) {
+    *counter = *counter + count > UINT16_MAX ? UINT16_MAX : (uint16_t)(*counter + count);
+}
+
+// Учёт отмены или набора слова; true — это стоит записать в журнал: отмену
+// или слово, впервые набранное LEARN_REPEAT_MIN раз. Отмена не теряется и в
+// заполненной таблице, пока в ней есть слова без отмен
+static bool learn_apply(LearnStore *store, LearnKind kind, const char *word, unsigned count) {
+    size_t len = strlen(word);
+    if (len == 0 || len >= LEARN_WORD_MAX) return false;
+    LearnEntry *entry;
+    if (kind == LEARN_REVERT) {
+        entry = learn_find(store, word, len, true);
+        if (!entry && learn_evict_seen(store)) entry = learn_find(store, word, len, true);
+        if (!entry) {
+            learn_warn_full(store, word);
+            return false;
+        }
+        learn_bump(&entry->reverts, count);
+        return true;
+    }
+    entry = learn_find(store, word, len, false);
+    if (entry) {
+        learn_bump(&entry->seen, count);
+        return false;
+    }
+    unsigned seen = learn_sketch_add(store, hash_word(word, len), count);
+    if (seen < LEARN_REPEAT_MIN) return false;
+    entry = store->count < LEARN_SEEN_SLOTS ? learn_find(store, word, len, true) : NULL;
+    if (!entry) {
+        learn_warn_full(store, word);
+        return false;
+    }
+    learn_bump(&entry->seen, seen);
+    return true;
+}
+
+static inline bool learn_entry_keeps(const LearnEntry *entry) {
+    return entry && (entry->reverts > 0 || entry->seen >= LEARN_REPEAT_MIN);
+}
+
+// Слово, которое пользователь оставляет как набрал: проверяется раньше словарей, O(1)
+bool learn_keeps(LearnStore *store, const wchar_t *word) {
+    if (!store) return false;
+    char utf8[LEARN_WORD_MAX];
+    size_t len = utf8_encode_word(word, utf8, sizeof(utf8));
+    if (len == 0 || len >= LEARN_WORD_MAX - 1) return false;
+    return learn_entry_keeps(learn_find(store, utf8, len, false));
+}
+
+// Строка журнала: "revert|seen СЧЁТЧИК СЛОВО"
+static bool parse_learn_line(char *line, LearnKind *kind, unsigned *count, char **word) {
+    char *save = NULL;
+    char *name = strtok_r(line, " \t\r\n", &save);
+    char *number = strtok_r(NULL, " \t\r\n", &save);
+    *word = strtok_r(NULL, " \t\r\n", &save);
+    if (!name || !number || !*word) return false;
+    if (strcmp(name, "revert") == 0) *kind = LEARN_REVERT;
+    else if (strcmp(name, "seen") == 0) *kind = LEARN_SEEN;
+    else return false;
+    *count = (unsigned)strtoul(number, NULL, 10);
+    return *count > 0;
+}
+
+// Сборка таблицы из журнала; возвращает число прочитанных строк
+static size_t learn_read_log(LearnStore *store, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+    char line[LEARN_WORD_MAX + 32];
+    size_t lines = 0;
+    while (fgets(line, sizeof(line), file)) {
+        LearnKind kind;
+        unsigned count;
+        char *word;
+        if (parse_learn_line(line, &kind, &count, &word)) learn_apply(store, kind, word, count);
+        lines++;
+    }
+    fclose(file);
+    return lines;
+}
+
+// Запись в журнал уходит потоку записи; на потоке ввода — только копия в очередь
+static void learn_record(LearnStore *store, LearnKind kind, const wchar_t *word) {
+    LearnRecord record = { .kind = kind, .count = kind == LEARN_REVERT ? 1 : LEARN_REPEAT_MIN };
+    size_t len = utf8_encode_word(word, record.word, sizeof(record.word));
+    if (len == 0 || len >= LEARN_WORD_MAX - 1) return;
+    if (!learn_apply(store, kind, record.word, 1)) return;
+    if (store->logging && ring_push(&store->records, &record)) {
+        eventfd_write(store->wake_fd, 1);
+    }
+}
+
+// Исправление отправлено: следующие нажатия покажут, не отменил ли его пользователь
+void learn_note_correction(LearnStore *store, const wchar_t *typed) {
+    if (!store) return;
+    wcscpy(store->last_typed, typed);
+    store->correction_pending = true;
+}
+
+// Нажатие сразу после исправления: Backspace или сочетание смены раскладки — отмена,
+// модификаторы ждут продолжения сочетания, любая другая клавиша принимает исправление
+void learn_observe_key(LearnStore *store, int code, bool completes_chord) {
+    if (!store || !store->correction_pending) return;
+    if (code == BACKSPACE_KEY_CODE || completes_chord) {
+        store->correction_pending = false;
+        learn_record(store, LEARN_REVERT, store->last_typed);
+        count_metric(&metrics.learned_reverts, 1);
+        LOG(LOG_INFO, L"Исправление отменено, слово запомнено: %ls\n", store->last_typed);
+        return;
+    }
+    if (is_modifier_key(code)) return;
+    store->correction_pending = false;
+}
+
+// Слово не нашлось ни в одном словаре и осталось как есть
+void learn_note_uncorrected(LearnStore *store, const wchar_t *word) {
+    if (store) learn_record(store, LEARN_SEEN, word);
+}
+
+// Сжатие журнала: по строке на слово с суммарными счётчиками, через временный файл
+static bool compact_learn_log(LearnStore *store) {
+    LearnStore *table = calloc(1, sizeof(LearnStore));
+    if (!table) return false;
+    learn_read_log(table, store->path);
+
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store->path);
+    FILE *file = fopen(tmp_path, "w");
+    bool ok = file != NULL;
+    size_t lines = 0;
+    for (size_t i = 0; ok && i < LEARN_CAPACITY; i++) {
+        const LearnEntry *entry = &table->entries[i];
+        if (entry->word[0] == '\0') continue;
+        if (entry->reverts) {
+            ok = fprintf(file, "revert %u %s\n", entry->reverts, entry->word) > 0;
+            lines++;
+        }
+        if (entry->seen) {
+            ok = ok && fprintf(file, "seen %u %s\n", entry->seen, entry->word) > 0;
+            lines++;
+        }
+    }
+    free(table);
+    if (file) {
+        ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+        ok = (fclose(file) == 0) && ok;
+    }
+    if (!ok || rename(tmp_path, store->path) < 0) {
+        perror("Не удалось сжать журнал обучения");
+        unlink(tmp_path);
+        return false;
+    }
+    // Дальше дописываем в новый файл
+    int fd = open(store->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd >= 0) {
+        close(store->log_fd);
+        store->log_fd = fd;
+    }
+    store->log_lines = lines;
+    return true;
+}
+
+// Поток записи: копит записи и раз в LEARN_FLUSH_MS дописывает их одним write и fsync
+static void *learn_writer_thread_main(void *arg) {
+    LearnStore *store = arg;
+    struct pollfd fds[2] = {
+        { .fd = store->wake_fd, .events = POLLIN },
+        { .fd = store->stop_fd, .events = POLLIN },
+    };
+    char buffer[JOB_RING_SIZE * (LEARN_WORD_MAX + 16)];
+    bool running = true;
+    while (running || ring_size(&store->records) > 0) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+        if (fds[1].revents) running = false;
+        eventfd_t pending;
+        eventfd_read(store->wake_fd, &pending);
+        // Даём записям накопиться, чтобы fsync был один на пачку
+        if (running) usleep(LEARN_FLUSH_MS * 1000);
+
+        size_t len = 0, lines = 0;
+        LearnRecord record;
+        while (len + LEARN_WORD_MAX + 16 <= sizeof(buffer) && ring_pop(&store->records, &record)) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, "%s %u %s\n",
+                            record.kind == LEARN_REVERT ? "revert" : "seen", record.count, record.word);
+            lines++;
+        }
+        if (len == 0) continue;
+        if (write(store->log_fd, buffer, len) != (ssize_t)len || fsync(store->log_fd) < 0) {
+            perror("Не удалось записать журнал обучения");
+            continue;
+        }
+        store->log_lines += lines;
+        store->batches++;
+        if (store->log_lines > LEARN_COMPACT_LINES) compact_learn_log(store);
+        if (ring_size(&store->records) > 0) eventfd_write(store->wake_fd, 1);
+    }
+    return NULL;
+}
+
+// Путь журнала по умолчанию: $XDG_DATA_HOME/layout_switcher или ~/.local/share/layout_switcher
+void default_learn_path(char *path, size_t size) {
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    if (data_home && *data_home) snprintf(dir, sizeof(dir), "%s/layout_switcher", data_home);
+    else if (home && *home) snprintf(dir, sizeof(dir), "%s/.local/share/layout_switcher", home);
+    else {
+        snprintf(path, size, "%s", LEARN_FILE_NAME);
+        return;
+    }
+    mkdir(dir, 0700);
+    snprintf(path, size, "%s/%s", dir, LEARN_FILE_NAME);
+}
+
+// Загрузка журнала в таблицу и запуск потока записи. Без журнала обучение
+// работает только до выхода
+bool open_learn_store(LearnStore *store, const char *path) {
+    memset(store, 0, sizeof(*store));
+    store->log_fd = store->wake_fd = store->stop_fd = -1;
+    snprintf(store->path, sizeof(store->path), "%s", path);
+    double start = monotonic_ns();
+    store->log_lines = learn_read_log(store, path);
+    wprintf(L"Журнал обучения %hs: %zu слов, %zu строк, %.1f мс\n", path, store->count, store->log_lines,
+            (monotonic_ns() - start) / 1e6);
+
+    store->log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    store->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    store->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (store->log_fd < 0 || store->wake_fd < 0 || store->stop_fd < 0 ||
+        !ring_init(&store->records, JOB_RING_SIZE, sizeof(LearnRecord))) {
+        perror("Не удалось открыть журнал обучения");
+        close_learn_store(store);
+        return false;
+    }
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    store->thread_started = pthread_create(&store->thread, NULL, learn_writer_thread_main, store) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!store->thread_started) {
+        perror("Не удалось запустить поток журнала обучения");
+        close_learn_store(store);
+        return false;
+    }
+    store->logging = true;
+    return true;
+}
+
+// Остановка потока записи; оставшиеся в очереди записи дописываются
+void close_learn_store(LearnStore *store) {
+    if (store->thread_started) {
+        eventfd_write(store->stop_fd, 1);
+        pthread_join(store->thread, NULL);
+        store->thread_started = false;
+    }
+    store->logging = false;
+    if (store->log_fd >= 0) close(store->log_fd);
+    if (store->wake_fd >= 0) close(store->wake_fd);
+    if (store->stop_fd >= 0) close(store->stop_fd);
+    store->log_fd = store->wake_fd = store->stop_fd = -1;
+    ring_free(&store->records);
+}
+
+/* ========== LAYOUT SWITCHING FUNCTIONS ========== */
+
+static inline bool layout_events_available(const Switcher *sw) {
+    return sw->xkb_event_base >= 0 || sw->layout_monitor;
+}
+
+// Раскладка на горячем пути — чтение переменной; счётчики учитывают,
+// какой запрос раньше делался бы на этом месте
+int cached_layout(Switcher *sw) {
+    sw->layout_stats.reads++;
+    count_metric(&metrics.layout_queries, 1);
+    if (sw->display) {
+        sw->layout_stats.x11_queries_avoided++;
+    } else {
+        sw->layout_stats.forks_avoided++;
+    }
+    return sw->system_layout;
+}
+
+// Задание уходит в очередь потока инжекции или, без конвейера, выполняется сразу
+void submit_job(Switcher *sw, const InjectJob *job) {
+    if (sw->replay) {
+        if (job->type == JOB_CORRECTION) {
+            // Разметка прогона — по слову на пробел, слова перед ним уже оценены
+            const wchar_t *last = wcsrchr(job->target, L' ');
+            sw->replay->corrected = true;
+            wcscpy(sw->replay->target, last ? last + 1 : job->target);
+            sw->replay->corrections++;
+            sw->replay->retro_words += (unsigned long)job->retro_words;
+        } else if (job->type == JOB_FORWARD) {
+            sw->replay->forwarded++;
+        }
+        return;
+    }
+    if (!sw->pipeline) {
+        execute_job(sw->injector, job);
+        flush_injector(sw->injector);
+        return;
+    }
+    SpscRing *ring = &sw->pipeline->jobs;
+    while (!ring_push(ring, job)) {
+        // Инжектор отстал: будим его и ждём освобождения места
+        eventfd_write(sw->pipeline->jobs_fd, 1);
+        usleep(500);
+    }
+    size_t backlog = ring_size(ring);
+    if (backlog > sw->pipeline->max_jobs_backlog) sw->pipeline->max_jobs_backlog = backlog;
+}
+
+// Пересылка нажатия пользователя (при захвате устройства)
+void forward_event(Switcher *sw, const struct input_event *ev) {
+    InjectJob job;
+    job.type = JOB_FORWARD;
+    job.event = *ev;
+    submit_job(sw, &job);
+}
+
+// Символ клавиши, которой в раскладке from набран c, в раскладке to на уровне level
+static wchar_t key_char(wchar_t c, int from, int to, int level) {
+    int key = char_to_key(c, from);
+    wchar_t out = key >= 0 ? layout_set.layouts[to].chars[level][slot_keycodes[key]] : L'\0';
+    return out ? out : c;
+}
+
+// Слово уходит в историю недавних. Слово, которое не набирается на клавишах
+// WORD_KEYS или длиннее RECENT_WORD_LEN, историю прерывает. levels — Shift по символам
+static void remember_word(RecentWords *recent, const wchar_t *word, const uint8_t *levels, int typed, int layout,
+                          WordDecision decision) {
+    RecentWord *entry = &recent->words[recent->head % RECENT_WORDS];
+    size_t len = 0;
+    entry->shifted = 0;
+    for (; word[len]; len++) {
+        int key = len < RECENT_WORD_LEN ? char_to_key(word[len], typed) : -1;
+        if (key < 0) {
+            recent->count = 0;
+            return;
+        }
+        entry->keys[len] = (uint8_t)key;
+        if (levels[len]) entry->shifted |= 1u << len;
+    }
+    entry->len = (uint8_t)len;
+    entry->typed_layout = (int8_t)typed;
+    entry->layout = (int8_t)layout;
+    entry->decision = (uint8_t)decision;
+    recent->head++;
+    if (recent->count < RECENT_WORDS) recent->count++;
+}
+
+static inline RecentWord *recent_word(RecentWords *recent, unsigned back) {
+    return &recent->words[(recent->head - 1 - back) % RECENT_WORDS];
+}
+
+// Сколько слов перед словом, исправленным из typed в target, исправить вместе с ним:
+// подряд идущие слова той же раскладки, которые не были исправлены или выучены
+// (нет в словарях или короткие словарные вроде "j"), и модель n-грамм с меньшим
+// порогом тоже относит к target — язык фразы уже известен по следующему слову
+static int retro_word_count(const NgramModel *model, RecentWords *recent, int typed, int target) {
+    if (!model || !model->logprob || !((model->trained >> typed) & 1) || !((model->trained >> target) & 1)) return 0;
+    unsigned n = 0;
+    for (; n < recent->count; n++) {
+        const RecentWord *entry = recent_word(recent, n);
+        if (entry->typed_layout != typed || entry->layout != typed) break;
+        if (entry->decision != WORD_UNDECIDED && !(entry->decision == WORD_KEPT && entry->len <= RECENT_SHORT_LEN)) break;
+        uint8_t symbols[RECENT_WORD_LEN];
+        for (int i = 0; i < entry->len; i++) symbols[i] = (uint8_t)layout_set.symbols[entry->keys[i]];
+        int32_t score[MAX_LAYOUTS];
+        ngram_score(model, symbols, entry->len, score);
+        int32_t margin = (score[target] - score[typed]) / (int32_t)(entry->len + 1);
+        LOG(LOG_DEBUG, L"Context margin of word -%u: %.2f bits/char towards %hs\n", n + 1,
+            margin / (double)NGRAM_SCALE, layout_name(target));
+        bool short_unknown = entry->decision == WORD_UNDECIDED && entry->len <= RECENT_SHORT_LEN;
+        if (margin < (short_unknown ? NGRAM_SHORT_CONTEXT_MARGIN : NGRAM_CONTEXT_MARGIN)) break;
+    }
+    return (int)n;
+}
+
+// Решение по слову, набранному в раскладке typed: раскладка, в которую его исправить,
+// или -1 — оставить. trie_state — узел графа после клавиш слова; *found — в словарях
+// каких раскладок оно есть, *source — чем решено (для журнала). Побочных действий нет:
+// так же решается каждое слово при конвертации выделения
+int choose_word_layout(const Switcher *sw, const wchar_t *word, int typed, uint32_t trie_state, uint32_t *found_out,
+                       const wchar_t **source) {
+    uint32_t others = ((1u << layout_set.count) - 1) & ~(1u << typed);
+
+    // Путь по графу уже пройден при наборе или разборе текста: флаги узла говорят,
+    // в словарях каких раскладок есть слово, набранное этими клавишами, и насколько
+    // оно там частое — все N проверок одним чтением
+    uint32_t found = 0;
+    int weight[MAX_LAYOUTS] = {0};
+    if (sw->trie->nodes) {
+        count_metric(&metrics.dict_lookups, 1);
+        uint32_t flags = trie_flags(sw->trie, trie_state);
+        found = flags & TRIE_WORDS;
+        for (int l = 0; l < layout_set.count; l++) weight[l] = (int)TRIE_WEIGHT(flags, l);
+    } else {
+        wchar_t converted[MAX_WORD_LEN];
+        for (int l = 0; l < layout_set.count; l++) {
+            if (l != typed) convert_layout(word, converted, typed, l);
+            weight[l] = dict_word_weight(l == typed ? word : converted, &sw->dicts[l]);
+            if (weight[l]) found |= 1u << l;
+        }
+    }
+
+    int target = -1;
+    *source = L"dictionary";
+    if (found & others) {
+        // Самое частое из слов других раскладок; одинаково частые различает модель
+        uint32_t best = 0;
+        for (int l = 0; l < layout_set.count; l++) {
+            if (!(((found & others) >> l) & 1)) continue;
+            if (!best || weight[l] > weight[__builtin_ctz(best)]) best = 1u << l;
+            else if (weight[l] == weight[__builtin_ctz(best)]) best |= 1u << l;
+        }
+        target = __builtin_ctz(best);
+        if (best & (best - 1)) {
+            int ranked = rank_word_layouts(sw->ngram, word, typed, best);
+            if (ranked >= 0) target = ranked;
+        }
+        // Слово есть и в набранной раскладке ("ус" и "ec"): исправляется, только если
+        // оба словаря знают частоты и в другой раскладке оно заметно чаще. Средний
+        // вес словаря по алфавиту ничего не говорит о конкретном слове
+        bool ranked = sw->dicts && sw->dicts[typed].ranked && sw->dicts[target].ranked;
+        if (((found >> typed) & 1) && (!ranked || weight[target] < weight[typed] + DICT_OVERRIDE_MARGIN)) {
+            LOG(LOG_DEBUG, L"Also a word in %hs, but not clearly more frequent there (%d vs %d%ls)\n",
+                layout_name(target), weight[target], weight[typed], ranked ? L"" : L", no frequencies");
+            target = -1;
+        }
+    }
+    if (!found) {
+        // Слова нет ни в одном словаре: опечатка в слове другой раскладки находится
+        // нечётким поиском, редкое слово или опечатка посильнее — решает модель n-грамм
+        target = fuzzy_word_layout(sw->fuzzy, sw->ngram, word, typed, others);
+        if (target >= 0) {
+            *source = L"fuzzy match";
+        } else {
+            target = detect_word_layout(sw->ngram, word, typed, others);
+            *source = L"n-gram model";
+        }
+    }
+    *found_out = found;
+    return target;
+}
+
+// true — исправление отправлено инжектору. tail — знаки после слова, набранные
+// буквенными клавишами других раскладок (запятая, точка): стираются вместе со словом
+// и печатаются снова как были. recent — недавние слова: после уверенного исправления
+// непонятые слова перед ним исправляются задним числом одним заданием
+bool process_word(Switcher *sw, const AppProfile *profile, RecentWords *recent, wchar_t *word, const uint8_t *levels,
+                  uint32_t trie_state, const wchar_t *tail) {
+    if (!word || wcslen(word) == 0) {
+        LOG(LOG_TRACE, L"Empty word, skipping\n");
+        return false;
+    }
+
+    LOG(LOG_DEBUG, L"Processing word: %ls\n", word);
+    count_metric(&metrics.words, 1);
+    double start = monotonic_ns();
+
+    // Раскладка уже известна из событий, запрос не нужен
+    int typed = cached_layout(sw);
+    if (typed < 0 || typed >= layout_set.count) typed = 0;
+    // После знаков препинания слово стирается и набирается заново вместе с ними,
+    // поэтому следующее слово исправлять задним числом нельзя
+    bool breaks_phrase = tail[0] != L'\0';
+
+    if (learn_keeps(sw->learn, word)) {
+        LOG(LOG_DEBUG, L"Learned word, keeping as typed\n");
+        count_metric(&metrics.learned_skips, 1);
+        remember_word(recent, word, levels, typed, typed, WORD_LEARNED);
+        if (breaks_phrase) recent->count = 0;
+        hist_record(&metrics.word_decision, (uint64_t)(monotonic_ns() - start));
+        return false;
+    }
+
+    LOG(LOG_TRACE, L"System layout before processing: %d (%hs)\n", typed, layout_name(typed));
+    uint32_t found;
+    const wchar_t *source;
+    int target = choose_word_layout(sw, word, typed, trie_state, &found, &source);
+    if (target < 0 && found) {
+        LOG(LOG_DEBUG, L"Word is valid as typed, skipping\n");
+        remember_word(recent, word, levels, typed, typed, WORD_KEPT);
+        if (breaks_phrase) recent->count = 0;
+        hist_record(&metrics.word_decision, (uint64_t)(monotonic_ns() - start));
+        return false;
+    }
+
+    if (target >= 0) {
+        // При захвате устройства пробел ещё не передан приложению, иначе он уже напечатан
+        size_t tail_len = wcslen(tail);
+        InjectJob job = {
+            .type = JOB_CORRECTION,
+            .strategy = (CorrectionStrategy)profile->strategy,
+            .pacing = profile->pacing,
+            .erase_count = (int)(wcslen(word) + tail_len) + (sw->grabbed ? 0 : 1),
+            .old_group = typed,
+            .new_group = target,
+            .captured_ns = sw->event_ns,
+        };
+        // Заглавные остаются заглавными: "Ghbdtn" -> "Привет", как и знаки хвоста
+        size_t word_len = wcslen(word);
+        convert_layout(word, job.target, typed, target);
+        for (size_t i = 0; i < word_len; i++) {
+            if (levels[i]) job.target[i] = key_char(word[i], typed, target, 1);
+        }
+        if (word_len + tail_len < MAX_WORD_LEN) {
+            for (size_t i = 0; i <= tail_len; i++) {
+                job.target[word_len + i] = i < tail_len && levels[word_len + i] ? key_char(tail[i], typed, typed, 1) : tail[i];
+            }
+        }
+
+        // Слова перед этим стираются вместе с пробелами и печатаются в target перед ним
+        int retro = retro_word_count(sw->ngram, recent, typed, target);
+        size_t phrase_len = wcslen(job.target);
+        for (int i = 0; i < retro; i++) phrase_len += recent_word(recent, i)->len + 1;
+        while (retro > 0 && phrase_len >= MAX_WORD_LEN) phrase_len -= recent_word(recent, --retro)->len + 1;
+        if (retro > 0) {
+            wchar_t phrase[MAX_WORD_LEN];
+            size_t pos = 0;
+            for (int i = retro - 1; i >= 0; i--) {
+                RecentWord *entry = recent_word(recent, i);
+                for (int k = 0; k < entry->len; k++) {
+                    int level = (entry->shifted >> k) & 1;
+                    wchar_t c = layout_set.layouts[target].chars[level][slot_keycodes[entry->keys[k]]];
+                    phrase[pos++] = c ? c : layout_set.layouts[target].chars[0][slot_keycodes[entry->keys[k]]];
+                }
+                phrase[pos++] = L' ';
+                entry->layout = (int8_t)target;
+                entry->decision = WORD_CORRECTED;
+                job.erase_count += entry->len + 1;
+            }
+            wcscpy(phrase + pos, job.target);
+            wcscpy(job.target, phrase);
+            // Ctrl + Backspace стёр бы только последнее слово
+            if (job.strategy == CORRECT_CTRL_BACKSPACE) job.strategy = CORRECT_BACKSPACE;
+            job.retro_words = retro;
+            count_metric(&metrics.retro_words, (uint64_t)retro);
+        }
+        LOG(LOG_INFO, L"Correcting to %hs (%ls%ls): %ls, deleting %d chars (%ls)\n",
+            layout_name(target), source, retro > 0 ? L", with preceding words" : L"", job.target,
+            job.erase_count, correction_name(job.strategy));
+        count_metric(&metrics.corrections, 1);
+        hist_record(&metrics.word_decision, (uint64_t)(monotonic_ns() - start));
+        submit_job(sw, &job);
+        learn_note_correction(sw->learn, word);
+        remember_word(recent, word, levels, typed, target, WORD_CORRECTED);
+        if (breaks_phrase) recent->count = 0;
+        // Следующие нажатия анализируются уже в новой раскладке, даже если
+        // инжектор ещё не закончил исправление
+        sw->system_layout = job.new_group;
+        sync_xkb_state(sw->xkb_state, sw->system_layout);
+        return true;
+    }
+    LOG(LOG_DEBUG, L"No match in other dictionaries, model does not favour them either\n");
+    learn_note_uncorrected(sw->learn, word);
+    remember_word(recent, word, levels, typed, typed, WORD_UNDECIDED);
+    if (breaks_phrase) recent->count = 0;
+    hist_record(&metrics.word_decision, (uint64_t)(monotonic_ns() - start));
+    return false;
+}
+
+/* ========== WINDOW CONTEXT FUNCTIONS ========== */
+
+// Окно в фокусе (pinentry, диалог) могло исчезнуть раньше, чем до сервера дошёл
+// запрос его класса или подписка на него: BadWindow не должен завершать процесс,
+// как делает обработчик Xlib по умолчанию
+int ignore_window_errors(Display *display, XErrorEvent *error) {
+    (void)display;
+    LOG(LOG_DEBUG, L"X11 error %d (request %d) ignored\n", error->error_code, error->request_code);
+    return 0;
+}
+
+// Подписка на смену активного окна; false — X11 нет. Если оконный менеджер не ведёт
+// _NET_ACTIVE_WINDOW, фокус отслеживается по FocusIn/FocusOut окна в фокусе
+bool init_window_cache(WindowCache *cache, Display *display) {
+    memset(cache, 0, sizeof(*cache));
+    if (!display) return false;
+    cache->net_active_window = XInternAtom(display, "_NET_ACTIVE_WINDOW", True);
+    Window root = DefaultRootWindow(display);
+    XWindowAttributes attributes;
+    if (!XGetWindowAttributes(display, root, &attributes)) return false;
+    long mask = cache->net_active_window != None ? PropertyChangeMask : FocusChangeMask;
+    XSelectInput(display, root, attributes.your_event_mask | mask);
+    XFlush(display);
+    return true;
+}
+
+static Window get_active_window(Display *display, Atom property) {
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char *data = NULL;
+    Window window = None;
+    if (XGetWindowProperty(display, DefaultRootWindow(display), property, 0, 1, False, XA_WINDOW,
+                           &type, &format, &count, &after, &data) == Success && data) {
+        // Формат 32 Xlib отдаёт массивом long
+        if (format == 32 && count == 1) window = (Window)*(unsigned long *)data;
+        XFree(data);
+    }
+    return window;
+}
+
+// Запись окна: найденная становится самой свежей, новая занимает место
+// давно не бывшего в фокусе окна
+static WindowContext *window_context(WindowCache *cache, Window window, bool *hit) {
+    WindowContext *oldest = &cache->entries[0];
+    for (int i = 0; i < WINDOW_CACHE_SIZE; i++) {
+        WindowContext *entry = &cache->entries[i];
+        if (entry->last_used && entry->window == window) {
+            entry->last_used = ++cache->clock;
+            *hit = true;
+            return entry;
+        }
+        if (entry->last_used < oldest->last_used) oldest = entry;
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->window = window;
+    oldest->layout = -1;
+    oldest->last_used = ++cache->clock;
+    *hit = false;
+    return oldest;
+}
+
+// Профили в кеше после изменения настроек (по сохранённому классу, без запросов к X11)
+void refresh_window_profiles(WindowCache *cache, const AppProfiles *profiles) {
+    for (int i = 0; i < WINDOW_CACHE_SIZE; i++) {
+        WindowContext *entry = &cache->entries[i];
+        if (!entry->last_used) continue;
+        entry->profile = entry->wm_class[0] ? profile_for_class(entry->wm_class, profiles) : profiles->defaults;
+    }
+}
+
+// Активное окно сменилось: уходящее запоминает текущую раскладку, пришедшее
+// получает свою, если уже было в фокусе, а инжектор — темп его профиля
+void window_focus_changed(Switcher *sw) {
+    WindowCache *cache = sw->windows;
+    Window window = None;
+    if (cache->net_active_window != None) {
+        window = get_active_window(sw->display, cache->net_active_window);
+    } else {
+        int revert;
+        XGetInputFocus(sw->display, &window, &revert);
+        if (window == PointerRoot) window = None;
+    }
+    if (window == cache->active) return;
+    if (cache->current) cache->current->layout = sw->system_layout;
+    cache->active = window;
+    cache->current = NULL;
+    cache->focus_changes++;
+    if (window == None) return;
+    // Без _NET_ACTIVE_WINDOW уход фокуса из окна виден только подписавшись на него
+    if (cache->net_active_window == None && window != DefaultRootWindow(sw->display)) {
+        XSelectInput(sw->display, window, FocusChangeMask);
+    }
+
+    bool hit;
+    WindowContext *entry = window_context(cache, window, &hit);
+    if (hit) {
+        cache->hits++;
+    } else {
+        cache->misses++;
+        const AppProfiles *profiles = &sw->config->profiles;
+        if (!get_window_wm_class(sw->display, window, entry->wm_class, sizeof(entry->wm_class))) entry->wm_class[0] = '\0';
+        entry->profile = entry->wm_class[0] ? profile_for_class(entry->wm_class, profiles) : profiles->defaults;
+    }
+    cache->current = entry;
+    LOG(LOG_DEBUG, L"Active window 0x%lx (%hs)%ls\n", (unsigned long)window, entry->wm_class,
+        entry->profile.exclude > 0 ? L", excluded" : L"");
+    if (!sw->injector) return;
+
+    InjectJob job = { .type = JOB_PACING, .pacing = entry->profile.pacing };
+    submit_job(sw, &job);
+    if (sw->config->remember_layout && entry->layout >= 0 && entry->layout < layout_set.count &&
+        entry->layout != sw->system_layout) {
+        LOG(LOG_DEBUG, L"Restoring layout %hs for window 0x%lx\n", layout_name(entry->layout), (unsigned long)window);
+        job = (InjectJob){ .type = JOB_SWITCH_LAYOUT, .old_group = sw->system_layout, .new_group = entry->layout };
+        submit_job(sw, &job);
+        sw->system_layout = entry->layout;
+        sync_xkb_state(sw->xkb_state, sw->system_layout);
+        cache->restores++;
+    }
+    if (sw->pipeline) eventfd_write(sw->pipeline->jobs_fd, 1);
+}
+
+// Профиль окна в фокусе из кеша окон, без запросов к X11: кеш обновляется
+// только по событиям смены фокуса, без него действует общий профиль
+const AppProfile *focused_profile(const Switcher *sw) {
+    if (sw->windows && sw->windows->current) return &sw->windows->current->profile;
+    return &sw->config->profiles.defaults;
+}
+
+/* ========== SELECTION CONVERSION FUNCTIONS ========== */
+
+// Раскладка, в которой набирается каждый символ слова; -1 — ни в одной
+static int text_word_layout(const wchar_t *word, size_t len) {
+    for (int l = 0; l < layout_set.count; l++) {
+        size_t i = 0;
+        while (i < len && char_to_key(word[i], l) >= 0) i++;
+        if (i == len) return l;
+    }
+    return -1;
+}
+
+// Конвертация текста по словам (out может совпадать с in): каждое слово решается так же,
+// как набранное, — графом, частотами, нечётким поиском и моделью, — и переводится в свою
+// раскладку таблицей. Знаки вокруг слова остаются как есть, если только со знаком это
+// не слово словаря ("j,tl"). Возвращает число исправленных слов
+size_t convert_text(const Switcher *sw, const wchar_t *in, wchar_t *out, size_t count) {
+    if (out != in) wmemcpy(out, in, count);
+    size_t corrected = 0;
+    size_t i = 0;
+    while (i < count) {
+        while (i < count && iswspace(out[i])) i++;
+        size_t start = i;
+        while (i < count && !iswspace(out[i])) i++;
+        size_t begin = start, end = i;
+        if (end - begin >= MAX_WORD_LEN) continue;
+        int typed = text_word_layout(out + begin, end - begin);
+        if (typed < 0) continue;
+
+        uint32_t node = TRIE_ROOT;
+        for (size_t k = begin; k < end; k++) node = trie_step(sw->trie, node, char_to_key(out[k], typed));
+        if (!(trie_flags(sw->trie, node) & TRIE_WORDS)) {
+            while (begin < end && !iswalpha(out[begin])) begin++;
+            while (end > begin && !iswalpha(out[end - 1])) end--;
+            if (begin == end) continue;
+            node = TRIE_ROOT;
+            for (size_t k = begin; k < end; k++) node = trie_step(sw->trie, node, char_to_key(out[k], typed));
+        }
+
+        wchar_t word[MAX_WORD_LEN];
+        wmemcpy(word, out + begin, end - begin);
+        word[end - begin] = L'\0';
+        uint32_t found;
+        const wchar_t *source;
+        int target = choose_word_layout(sw, word, typed, node, &found, &source);
+        if (target >= 0) {
+            convert_layout_bulk(word, out + begin, end - begin, typed, target);
+            corrected++;
+        }
+    }
+    return corrected;
+}
+
+// Окно-получатель выделения; false — X11 нет или окно не создалось
+bool init_selection_service(SelectionService *service, Display *display) {
+    memset(service, 0, sizeof(*service));
+    service->restore_fd = -1;
+    if (!display) return false;
+    Window root = DefaultRootWindow(display);
+    service->window = XCreateSimpleWindow(display, root, 0, 0, 1, 1, 0, 0, 0);
+    if (!service->window) return false;
+    // PropertyNotify нужен для приёма по частям (INCR)
+    XSelectInput(display, service->window, PropertyChangeMask);
+    service->clipboard = XInternAtom(display, "CLIPBOARD", False);
+    service->utf8_string = XInternAtom(display, "UTF8_STRING", False);
+    service->targets = XInternAtom(display, "TARGETS", False);
+    service->incr = XInternAtom(display, "INCR", False);
+    service->property = XInternAtom(display, "LAYOUT_SWITCHER_SELECTION", False);
+    service->source = None;
+    // Размер запроса — в 4-байтовых словах, часть занимает заголовок
+    long max_request = XExtendedMaxRequestSize(display);
+    if (max_request == 0) max_request = XMaxRequestSize(display);
+    service->max_property = (size_t)max_request * 4 - 256;
+    // Без таймера CLIPBOARD после вставки остаётся с результатом, как по Shift + Pause
+    service->restore_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    XFlush(display);
+    return true;
+}
+
+void free_selection_service(SelectionService *service, Display *display) {
+    if (display && service->window) XDestroyWindow(display, service->window);
+    if (service->restore_fd >= 0) close(service->restore_fd);
+    free(service->incoming);
+    free(service->text);
+    free(service->pending);
+    free(service->saved);
+    memset(service, 0, sizeof(*service));
+    service->restore_fd = -1;
+}
+
+// Запрос выделения source (XA_PRIMARY или CLIPBOARD) в UTF-8; ответ придёт SelectionNotify
+void request_selection(SelectionService *service, Display *display, Atom source, bool paste) {
+    if (service->source != None) {
+        LOG(LOG_DEBUG, L"Selection request already pending\n");
+        return;
+    }
+    service->source = source;
+    service->paste = paste;
+    service->saving = false;
+    service->incremental = false;
+    service->incoming_len = 0;
+    XConvertSelection(display, source, service->utf8_string, service->property, service->window, CurrentTime);
+    XFlush(display);
+}
+
+// Дописывает к принятому тексту значение свойства и удаляет его; false — нет памяти
+static bool append_selection_property(SelectionService *service, Display *display, size_t *chunk_len) {
+    Atom type;
+    int format;
+    unsigned long items, remaining;
+    unsigned char *data = NULL;
+    *chunk_len = 0;
+    if (XGetWindowProperty(display, service->window, service->property, 0, LONG_MAX / 4, True, AnyPropertyType,
+                           &type, &format, &items, &remaining, &data) != Success) {
+        return true;
+    }
+    bool ok = true;
+    if (data && format == 8 && type != service->incr) {
+        if (service->incoming_len + items + 1 > service->incoming_capacity) {
+            size_t capacity = service->incoming_capacity ? service->incoming_capacity : 4096;
+            while (service->incoming_len + items + 1 > capacity) capacity *= 2;
+            char *incoming = realloc(service->incoming, capacity);
+            if (incoming) {
+                service->incoming = incoming;
+                service->incoming_capacity = capacity;
+            } else {
+                ok = false;
+            }
+        }
+        if (ok) {
+            memcpy(service->incoming + service->incoming_len, data, items);
+            service->incoming_len += items;
+            service->incoming[service->incoming_len] = '\0';
+            *chunk_len = items;
+        }
+    }
+    if (data) XFree(data);
+    return ok;
+}
+
+// Программа становится владельцем CLIPBOARD с результатом и, если это была Pause,
+// вставляет его поверх выделения; CLIPBOARD вернётся к saved по таймеру
+static void take_clipboard(Switcher *sw, char *text, size_t text_len, bool paste) {
+    SelectionService *service = sw->selection;
+    free(service->text);
+    service->text = text;
+    service->text_len = text_len;
+    XSetSelectionOwner(sw->display, service->clipboard, service->window, CurrentTime);
+    if (XGetSelectionOwner(sw->display, service->clipboard) != service->window) {
+        LOG(LOG_WARN, L"Could not take CLIPBOARD ownership\n");
+        service->restore_pending = false;
+        return;
+    }
+    if (!paste) {
+        // Shift + Pause: результат и есть новое содержимое CLIPBOARD
+        service->restore_pending = false;
+        return;
+    }
+
+    char wm_class[256];
+    bool terminal = get_focused_wm_class(sw->display, wm_class, sizeof(wm_class)) && is_terminal_class(wm_class);
+    InjectJob job = {
+        .type = JOB_PASTE,
+        .terminal = terminal,
+        .pacing = focused_profile(sw)->pacing,
+        .captured_ns = (uint64_t)monotonic_ns(),
+    };
+    submit_job(sw, &job);
+    if (sw->pipeline) eventfd_write(sw->pipeline->jobs_fd, 1);
+    if (service->restore_fd >= 0) {
+        // Приложение забирает CLIPBOARD уже после Ctrl + V, поэтому возврат — с запасом
+        struct itimerspec timer = { .it_value = { .tv_sec = SELECTION_RESTORE_MS / 1000,
+                                                  .tv_nsec = SELECTION_RESTORE_MS % 1000 * 1000000L } };
+        timerfd_settime(service->restore_fd, 0, &timer, NULL);
+        service->restore_pending = true;
+    }
+}
+
+// Возврат CLIPBOARD после вставки по Pause: снова отдаётся прежний текст, а если текста
+// не было — владение снимается, и CLIPBOARD остаётся пустым, как до вставки
+void restore_clipboard(Switcher *sw) {
+    SelectionService *service = sw->selection;
+    uint64_t expirations;
+    if (service->restore_fd >= 0 && read(service->restore_fd, &expirations, sizeof(expirations)) < 0) return;
+    if (!service->restore_pending) return;
+    service->restore_pending = false;
+    free(service->text);
+    service->text = service->saved;
+    service->text_len = service->saved_len;
+    service->saved = NULL;
+    service->saved_len = 0;
+    if (!service->text && XGetSelectionOwner(sw->display, service->clipboard) == service->window) {
+        XSetSelectionOwner(sw->display, service->clipboard, None, CurrentTime);
+    }
+    XFlush(sw->display);
+    LOG(LOG_DEBUG, L"CLIPBOARD restored after paste\n");
+}
+
+// Прежний текст CLIPBOARD принят (или его нет): результат Pause занимает CLIPBOARD
+static void finish_saving(Switcher *sw, bool received) {
+    SelectionService *service = sw->selection;
+    service->source = None;
+    service->saving = false;
+    free(service->saved);
+    service->saved = NULL;
+    service->saved_len = 0;
+    if (received && service->incoming_len > 0) {
+        service->saved = malloc(service->incoming_len);
+        if (service->saved) {
+            memcpy(service->saved, service->incoming, service->incoming_len);
+            service->saved_len = service->incoming_len;
+        }
+    }
+    char *text = service->pending;
+    service->pending = NULL;
+    if (text) take_clipboard(sw, text, service->pending_len, true);
+}
+
+// Принятый текст конвертируется целиком. Для Pause сначала сохраняется прежний текст
+// CLIPBOARD: если владелец — другое приложение, он запрашивается тем же путём
+static void finish_selection(Switcher *sw) {
+    SelectionService *service = sw->selection;
+    if (service->saving) {
+        finish_saving(sw, true);
+        return;
+    }
+    bool paste = service->paste;
+    service->source = None;
+    if (service->incoming_len == 0) {
+        LOG(LOG_INFO, L"Selection is empty\n");
+        return;
+    }
+    double start = monotonic_ns();
+    size_t capacity = service->incoming_len + 1;
+    wchar_t *text = malloc(capacity * sizeof(wchar_t));
+    // Символ UTF-8 занимает не больше 4 байт
+    char *utf8 = malloc(capacity * 4 + 1);
+    size_t len = text ? utf8_decode_word(service->incoming, text, capacity) : 0;
+    if (!utf8 || len == 0) {
+        LOG(LOG_WARN, L"Selection is not valid UTF-8 or too large, skipping\n");
+        free(text);
+        free(utf8);
+        return;
+    }
+
+    // Словари держатся только на время конвертации, как и для пачки событий
+    const DictSet *set = sw->dict_store ? dict_store_acquire(sw->dict_store) : NULL;
+    if (set) use_dict_set(sw, set);
+    size_t corrected = convert_text(sw, text, text, len);
+    if (sw->dict_store) dict_store_release(sw->dict_store);
+    size_t utf8_len = utf8_encode_word(text, utf8, capacity * 4 + 1);
+    free(text);
+    service->conversions++;
+    LOG(LOG_INFO, L"Selection converted: %zu chars, %zu words corrected in %.2f ms\n", len, corrected,
+        (monotonic_ns() - start) / 1e6);
+
+    if (!paste || service->restore_pending) {
+        // Прежний текст уже сохранён прошлой вставкой, ещё не возвращённой
+        take_clipboard(sw, utf8, utf8_len, paste);
+        return;
+    }
+    if (XGetSelectionOwner(sw->display, service->clipboard) == service->window) {
+        // CLIPBOARD уже у программы: прежний текст — тот, что она сейчас отдаёт
+        free(service->saved);
+        service->saved = NULL;
+        service->saved_len = 0;
+        if (service->text) {
+            service->saved = malloc(service->text_len);
+            if (service->saved) {
+                memcpy(service->saved, service->text, service->text_len);
+                service->saved_len = service->text_len;
+            }
+        }
+        take_clipboard(sw, utf8, utf8_len, true);
+        return;
+    }
+    free(service->pending);
+    service->pending = utf8;
+    service->pending_len = utf8_len;
+    request_selection(service, sw->display, service->clipboard, true);
+    service->saving = true;
+}
+
+// Запрос к CLIPBOARD, которым владеет программа: список форматов или текст
+static void answer_selection_request(SelectionService *service, Display *display, const XSelectionRequestEvent *request) {
+    XSelectionEvent reply = {
+        .type = SelectionNotify,
+        .display = request->display,
+        .requestor = request->requestor,
+        .selection = request->selection,
+        .target = request->target,
+        .property = None,
+        .time = request->time,
+    };
+    // Старые клиенты не указывают свойство: тогда им служит сам target
+    Atom property = request->property != None ? request->property : request->target;
+    if (request->selection == service->clipboard && service->text) {
+        if (request->target == service->targets) {
+            Atom targets[] = { service->targets, service->utf8_string };
+            XChangeProperty(display, request->requestor, property, XA_ATOM, 32, PropModeReplace,
+                            (unsigned char *)targets, sizeof(targets) / sizeof(targets[0]));
+            reply.property = property;
+        } else if (request->target == service->utf8_string && service->text_len <= service->max_property) {
+            // Больше одного запроса не отдаём: такой текст не выделить разумным образом
+            XChangeProperty(display, request->requestor, property, request->target, 8, PropModeReplace,
+                            (unsigned char *)service->text, (int)service->text_len);
+            reply.property = property;
+        }
+    }
+    XSendEvent(display, request->requestor, False, NoEventMask, (XEvent *)&reply);
+    XFlush(display);
+}
+
+// События X11 окна выделения; false — событие не его
+bool handle_selection_event(Switcher *sw, XEvent *event) {
+    SelectionService *service = sw->selection;
+    if (!service) return false;
+    switch (event->type) {
+        case SelectionNotify: {
+            if (event->xselection.requestor != service->window || service->source == None) return false;
+            if (event->xselection.property == None) {
+                // CLIPBOARD пуст или не отдаётся текстом: вставка всё равно выполняется
+                if (service->saving) finish_saving(sw, false);
+                else LOG(LOG_INFO, L"Nothing selected\n");
+                service->source = None;
+                return true;
+            }
+            Atom type;
+            int format;
+            unsigned long items, remaining;
+            unsigned char *data = NULL;
+            XGetWindowProperty(sw->display, service->window, service->property, 0, 0, False, AnyPropertyType,
+                               &type, &format, &items, &remaining, &data);
+            if (data) XFree(data);
+            if (type == service->incr) {
+                // Большой текст: удаление свойства просит владельца прислать первую часть
+                service->incremental = true;
+                XDeleteProperty(sw->display, service->window, service->property);
+                XFlush(sw->display);
+                return true;
+            }
+            size_t chunk_len;
+            if (append_selection_property(service, sw->display, &chunk_len)) finish_selection(sw);
+            else if (service->saving) finish_saving(sw, false);
+            else service->source = None;
+            return true;
+        }
+        case PropertyNotify:
+            if (event->xproperty.window != service->window || event->xproperty.atom != service->property ||
+                event->xproperty.state != PropertyNewValue || !service->incremental) {
+                return event->xproperty.window == service->window;
+            }
+            {
+                // Часть нулевой длины завершает передачу
+                size_t chunk_len;
+                if (!append_selection_property(service, sw->display, &chunk_len)) {
+                    service->incremental = false;
+                    if (service->saving) finish_saving(sw, false);
+                    else service->source = None;
+                } else if (chunk_len == 0) {
+                    service->incremental = false;
+                    finish_selection(sw);
+                }
+                XFlush(sw->display);
+            }
+            return true;
+        case SelectionRequest:
+            if (event->xselectionrequest.owner != service->window) return false;
+            answer_selection_request(service, sw->display, &event->xselectionrequest);
+            return true;
+        case SelectionClear:
+            if (event->xselectionclear.window != service->window) return false;
+            // CLIPBOARD перешёл к другому приложению: ни результат, ни сохранённый
+            // прежний текст больше не нужны
+            free(service->text);
+            service->text = NULL;
+            service->text_len = 0;
+            free(service->saved);
+            service->saved = NULL;
+            service->saved_len = 0;
+            service->restore_pending = false;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* ========== INPUT DEVICE FUNCTIONS ========== */
+
+// Клавиатура: EV_KEY и буквы. Мышь, кнопка питания и крышка ноутбука тоже шлют
+// EV_KEY, но без букв. Своя виртуальная клавиатура отсеивается по id.
+// key_bits (KEY_BITS_SIZE байт, может быть NULL) получает клавиши устройства
+static bool is_keyboard(int fd, unsigned char *key_bits) {
+    unsigned long ev_bits[EV_MAX / (8 * sizeof(long)) + 1] = {0};
+    unsigned char bits[KEY_BITS_SIZE] = {0};
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0 || !(ev_bits[0] & (1ul << EV_KEY))) return false;
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) < 0) return false;
+    static const int letters[] = {KEY_A, KEY_Z, KEY_SPACE};
+    for (size_t i = 0; i < sizeof(letters) / sizeof(letters[0]); i++) {
+        if (!KEY_BIT(bits, letters[i])) return false;
+    }
+    struct input_id id;
+    if (ioctl(fd, EVIOCGID, &id) == 0 && id.vendor == UINPUT_VENDOR && id.product == UINPUT_PRODUCT) return false;
+    if (key_bits) memcpy(key_bits, bits, sizeof(bits));
+    return true;
+}
+
+// Обход кандидатов в клавиатуры: заданные --device пути или все eventN из INPUT_DIR
+static void scan_input_paths(const char *const *paths, int count, void (*visit)(const char *path, void *context),
+                             void *context) {
+    for (int i = 0; i < count; i++) visit(paths[i], context);
+    if (count > 0) return;
+    DIR *dir = opendir(INPUT_DIR);
+    if (!dir) {
+        perror(INPUT_DIR);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+        char path[sizeof(((InputDevice *)0)->path)];
+        snprintf(path, sizeof(path), INPUT_DIR "/%.32s", entry->d_name);
+        visit(path, context);
+    }
+    closedir(dir);
+}
+
+static void add_keyboard_keys(const char *path, void *context) {
+    unsigned char *keys = context, device_keys[KEY_BITS_SIZE];
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return;
+    if (is_keyboard(fd, device_keys)) {
+        for (size_t i = 0; i < KEY_BITS_SIZE; i++) keys[i] |= device_keys[i];
+    }
+    close(fd);
+}
+
+// Клавиши виртуальной клавиатуры — всё, что инжектор может отправить: клавиши
+// стирания, таблицы инжекции и клавиши клавиатур, нажатия которых пересылаются
+// при захвате. Клавиатура, подключённая позже с клавишами вне этого набора,
+// читается без захвата (open_input_device), чтобы её нажатия не терялись
+void uinput_key_bits(unsigned char *keys, const char *const *device_paths, int device_path_count) {
+    memset(keys, 0, KEY_BITS_SIZE);
+    static const int correction_keys[] = {
+        BACKSPACE_KEY_CODE, LEFTARROW_KEY_CODE, LEFTSHIFT_KEY_CODE, LEFTCTRL_KEY_CODE, LEFTALT_KEY_CODE,
+        LEFTMETA_KEY_CODE, SPACE_KEY_CODE,
+    };
+    for (size_t i = 0; i < sizeof(correction_keys) / sizeof(correction_keys[0]); i++) {
+        SET_KEY_BIT(keys, correction_keys[i]);
+    }
+    for (int i = 0; i < INJECT_MODIFIERS; i++) SET_KEY_BIT(keys, inject_modifier_keys[i]);
+    for (int g = 0; g < layout_set.count; g++) {
+        for (wchar_t c = 0; c < CHAR_RANGE; c++) {
+            if (layout_set.inject[g][c].keycode) SET_KEY_BIT(keys, layout_set.inject[g][c].keycode);
+        }
+        for (int to = 0; to < layout_set.count; to++) {
+            if (layout_set.group_keys[g][to].keycode) SET_KEY_BIT(keys, layout_set.group_keys[g][to].keycode);
+        }
+    }
+    scan_input_paths(device_paths, device_path_count, add_keyboard_keys, keys);
+}
+
+// Ожидание, пока udev обработает виртуальную клавиатуру. На devtmpfs узел
+// /dev/input/eventM ядро создаёт само ещё при UI_DEV_CREATE, и его наличие ничего
+// не говорит. X11 и libinput узнают об устройстве от udev, а тот рассылает событие,
+// записав базу /run/udev/data/c13:M — её появления и ждём (inotify с таймаутом)
+static bool wait_uinput_ready(int uinput_fd, char *node, size_t node_size) {
+    char sysname[64];
+    int len = ioctl(uinput_fd, UI_GET_SYSNAME(sizeof(sysname)), sysname);
+    if (len < 0) return false;
+    char sys_path[128];
+    snprintf(sys_path, sizeof(sys_path), "/sys/devices/virtual/input/%.64s", sysname);
+    DIR *dir = opendir(sys_path);
+    if (!dir) return false;
+    char event_name[32] = "";
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "event", 5) == 0) snprintf(event_name, sizeof(event_name), "%.31s", entry->d_name);
+    }
+    closedir(dir);
+    if (!event_name[0]) return false;
+    snprintf(node, node_size, INPUT_DIR "/%s", event_name);
+
+    // Номер устройства из sysfs ("13:67") даёт имя записи в базе udev
+    char dev_path[256], numbers[32] = "";
+    snprintf(dev_path, sizeof(dev_path), "%s/%s/dev", sys_path, event_name);
+    FILE *dev_file = fopen(dev_path, "r");
+    if (dev_file) {
+        if (!fgets(numbers, sizeof(numbers), dev_file)) numbers[0] = '\0';
+        fclose(dev_file);
+    }
+    unsigned major, minor;
+    if (sscanf(numbers, "%u:%u", &major, &minor) != 2) return false;
+    char udev_path[64];
+    snprintf(udev_path, sizeof(udev_path), UDEV_DATA_DIR "/c%u:%u", major, minor);
+
+    // Наблюдение ставится до проверки, иначе запись может появиться между ними.
+    // udev пишет её во временный файл и переименовывает
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, UDEV_DATA_DIR, IN_CREATE | IN_MOVED_TO) < 0) {
+        // Без udev ждать некого
+        close(inotify_fd);
+        return false;
+    }
+    double deadline = monotonic_ns() + UINPUT_READY_TIMEOUT_MS * 1e6;
+    bool ready = access(udev_path, F_OK) == 0;
+    while (!ready && inotify_fd >= 0) {
+        int left_ms = (int)((deadline - monotonic_ns()) / 1e6);
+        struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+        if (left_ms <= 0 || poll(&pfd, 1, left_ms) <= 0) break;
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (read(inotify_fd, buffer, sizeof(buffer)) > 0) {}
+        ready = access(udev_path, F_OK) == 0;
+    }
+    if (inotify_fd >= 0) close(inotify_fd);
+    return ready;
+}
+
+// Виртуальная клавиатура только с клавишами keys (uinput_key_bits)
+int setup_uinput_device(int *uinput_fd, const unsigned char *keys) {
+    double start = monotonic_ns();
+    *uinput_fd = open(UINPUT_DEVICE, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (*uinput_fd < 0) {
+        perror("Не удалось открыть /dev/uinput");
+        return -1;
+    }
+
+    ioctl(*uinput_fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(*uinput_fd, UI_SET_EVBIT, EV_SYN);
+    int key_count = 0;
+    for (int code = 1; code < KEY_CNT; code++) {
+        if (KEY_BIT(keys, code) && ioctl(*uinput_fd, UI_SET_KEYBIT, code) == 0) key_count++;
+    }
+
+    struct uinput_setup setup = {
+        .id = { .bustype = BUS_USB, .vendor = UINPUT_VENDOR, .product = UINPUT_PRODUCT, .version = 1 },
+    };
+    snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "virtual-keyboard");
+    if (ioctl(*uinput_fd, UI_DEV_SETUP, &setup) < 0) {
+        // Ядра до 4.5: прежняя запись uinput_user_dev
+        struct uinput_user_dev uidev = { .id = setup.id };
+        memcpy(uidev.name, setup.name, UINPUT_MAX_NAME_SIZE);
+        if (write(*uinput_fd, &uidev, sizeof(uidev)) != sizeof(uidev)) {
+            perror("Не удалось настроить uinput");
+            close(*uinput_fd);
+            return -1;
+        }
+    }
+    if (ioctl(*uinput_fd, UI_DEV_CREATE) < 0) {
+        perror("Не удалось создать виртуальную клавиатуру");
+        close(*uinput_fd);
+        return -1;
+    }
+
+    char node[64] = "";
+    if (wait_uinput_ready(*uinput_fd, node, sizeof(node))) {
+        wprintf(L"Виртуальная клавиатура %hs: %d клавиш, готова за %.1f мс\n", node, key_count,
+                (monotonic_ns() - start) / 1e6);
+    } else {
+        // Без UI_GET_SYSNAME (ядра до 3.15) или без udev готовность не отследить
+        wprintf(L"udev не обработал виртуальную клавиатуру за %d мс, продолжаю\n", UINPUT_READY_TIMEOUT_MS);
+    }
+    return 0;
+}
+
+/* ========== PIPELINE FUNCTIONS ========== */
+
+// Захватывать устройство можно, только когда на нём ничего не зажато: иначе
+// отпускание клавиши, нажатой до захвата (Enter в терминале), не дойдёт до приложения
+static bool keys_released(int fd) {
+    unsigned char keys[KEY_MAX / 8 + 1] = {0};
+    if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) < 0) return true;
+    for (size_t i = 0; i < sizeof(keys); i++) {
+        if (keys[i]) return false;
+    }
+    return true;
+}
+
+// При запуске ждём отпускания всех клавиш (до 2 с)
+static void wait_keys_released(int fd) {
+    for (int attempt = 0; attempt < 200 && !keys_released(fd); attempt++) usleep(10000);
+}
+
+static void log_device_grab(const InputDevice *device) {
+    LOG(LOG_INFO, L"Клавиатура подключена: %hs (%hs)%ls\n", device->name, device->path,
+        device->grab_pending ? L", захват после отпускания клавиш"
+        : device->grabbed ? L"" : L", EVIOCGRAB не удался — нажатия идут в приложение напрямую");
+}
+
+// Отметка для анализа: слово устройства начинается заново
+static void push_device_reset(Pipeline *pipeline, int slot) {
+    CapturedEvent reset = { .event = { .type = EV_SYN, .code = SYN_DROPPED }, .device = (uint8_t)slot };
+    while (!ring_push(&pipeline->captured, &reset)) {
+        eventfd_write(pipeline->captured_fd, 1);
+        usleep(500);
+    }
+    eventfd_write(pipeline->captured_fd, 1);
+}
+
+static bool device_path_allowed(const Pipeline *pipeline, const char *path) {
+    if (pipeline->device_path_count == 0) return strncmp(path, INPUT_DIR "/event", sizeof(INPUT_DIR "/event") - 1) == 0;
+    for (int i = 0; i < pipeline->device_path_count; i++) {
+        if (strcmp(pipeline->device_paths[i], path) == 0) return true;
+    }
+    return false;
+}
+
+// Подключение клавиатуры: захват и регистрация в epoll потока захвата. Устройства,
+// которые не клавиатуры или уже открыты, пропускаются. wait — при запуске дождаться
+// отпускания клавиш; на ходу поток захвата не ждёт: захват откладывается до событий
+// устройства, после которых всё отпущено
+static void open_input_device(Pipeline *pipeline, const char *path, bool wait) {
+    int slot = -1;
+    for (int i = 0; i < MAX_INPUT_DEVICES; i++) {
+        if (pipeline->devices[i].fd >= 0 && strcmp(pipeline->devices[i].path, path) == 0) return;
+        if (slot < 0 && pipeline->devices[i].fd < 0) slot = i;
+    }
+    if (slot < 0 || !device_path_allowed(pipeline, path)) return;
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        // udev выставляет права чуть позже создания узла: повтор придёт с IN_ATTRIB
+        if (pipeline->device_path_count > 0 && errno != ENOENT && errno != EACCES) perror(path);
+        return;
+    }
+    unsigned char keys[KEY_BITS_SIZE];
+    if (!is_keyboard(fd, keys)) {
+        close(fd);
+        return;
+    }
+    // Клавиши, которых нет у виртуальной клавиатуры, при захвате потерялись бы
+    int missing = 0;
+    for (int code = 1; code < KEY_CNT && pipeline->forward_keys; code++) {
+        missing += KEY_BIT(keys, code) && !KEY_BIT(pipeline->forward_keys, code);
+    }
+    InputDevice *device = &pipeline->devices[slot];
+    snprintf(device->path, sizeof(device->path), "%s", path);
+    if (ioctl(fd, EVIOCGNAME(sizeof(device->name)), device->name) < 0) snprintf(device->name, sizeof(device->name), "?");
+    // Метки времени событий — CLOCK_MONOTONIC от ядра; иначе их ставит поток захвата
+    int clock_id = CLOCK_MONOTONIC;
+    device->kernel_clock = ioctl(fd, EVIOCSCLOCKID, &clock_id) == 0;
+    if (wait) wait_keys_released(fd);
+    device->grab_pending = missing == 0 && !keys_released(fd);
+    device->grabbed = missing == 0 && !device->grab_pending && ioctl(fd, EVIOCGRAB, 1) == 0;
+    struct epoll_event registration = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(pipeline->capture_epoll_fd, EPOLL_CTL_ADD, fd, &registration) < 0) {
+        perror("Не удалось добавить устройство в epoll");
+        if (device->grabbed) ioctl(fd, EVIOCGRAB, 0);
+        close(fd);
+        return;
+    }
+    device->fd = fd;
+    pipeline->attached_devices++;
+    push_device_reset(pipeline, slot);
+    if (missing) {
+        LOG(LOG_INFO, L"Клавиатура подключена: %hs (%hs), без захвата: %d клавиш нет у виртуальной клавиатуры\n",
+            device->name, device->path, missing);
+    } else {
+        log_device_grab(device);
+    }
+}
+
+static void close_input_device(Pipeline *pipeline, int slot) {
+    InputDevice *device = &pipeline->devices[slot];
+    if (device->fd < 0) return;
+    epoll_ctl(pipeline->capture_epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+    if (device->grabbed) ioctl(device->fd, EVIOCGRAB, 0);
+    close(device->fd);
+    device->fd = -1;
+    pipeline->detached_devices++;
+    push_device_reset(pipeline, slot);
+    LOG(LOG_INFO, L"Клавиатура отключена: %hs (%hs)\n", device->name, device->path);
+}
+
+static void open_input_path(const char *path, void *pipeline) {
+    open_input_device(pipeline, path, true);
+}
+
+// Изменения в INPUT_DIR. Отключение обычно приходит раньше как EPOLLHUP/ENODEV
+// на самом устройстве, IN_DELETE его только подтверждает
+static void handle_input_hotplug(Pipeline *pipeline) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t bytes;
+    bool changed = false;
+    while ((bytes = read(pipeline->inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + bytes;) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(*event) + event->len;
+            if (event->len == 0 || strncmp(event->name, "event", 5) != 0) continue;
+            char path[sizeof(((InputDevice *)0)->path)];
+            snprintf(path, sizeof(path), INPUT_DIR "/%.32s", event->name);
+            changed = true;
+            if (event->mask & IN_DELETE) {
+                for (int i = 0; i < MAX_INPUT_DEVICES; i++) {
+                    if (pipeline->devices[i].fd >= 0 && strcmp(pipeline->devices[i].path, path) == 0) {
+                        close_input_device(pipeline, i);
+                    }
+                }
+            } else {
+                open_input_device(pipeline, path, false);
+            }
+        }
+    }
+    // Заданные --device пути могут быть ссылками (by-id): пробуем все после любого изменения
+    if (changed) {
+        for (int i = 0; i < pipeline->device_path_count; i++) {
+            open_input_device(pipeline, pipeline->device_paths[i], false);
+        }
+    }
+}
+
+// Поток захвата: только читает клавиатуры и складывает нажатия в очередь,
+// поэтому задержка захвата не зависит от анализа и инжекции
+static void *capture_thread_main(void *arg) {
+    Pipeline *pipeline = arg;
+    struct input_event events[64];
+    bool running = true;
+    while (running) {
+        struct epoll_event ready[MAX_INPUT_DEVICES + 2];
+        int n = epoll_wait(pipeline->capture_epoll_fd, ready, MAX_INPUT_DEVICES + 2, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            atomic_store(&pipeline->capture_failed, true);
+            eventfd_write(pipeline->captured_fd, 1);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = ready[i].data.fd;
+            if (fd == pipeline->stop_fd) {
+                running = false;
+                break;
+            }
+            if (fd == pipeline->inotify_fd) {
+                handle_input_hotplug(pipeline);
+                continue;
+            }
+            int slot = 0;
+            while (slot < MAX_INPUT_DEVICES && pipeline->devices[slot].fd != fd) slot++;
+            if (slot == MAX_INPUT_DEVICES) continue;  // закрыто раньше в этой же пачке
+            InputDevice *device = &pipeline->devices[slot];
+            ssize_t bytes;
+            while ((bytes = read(fd, events, sizeof(events))) > 0) {
+                size_t count = (size_t)bytes / sizeof(events[0]);
+                struct timespec now;
+                if (!device->kernel_clock) clock_gettime(CLOCK_MONOTONIC, &now);
+                for (size_t j = 0; j < count; j++) {
+                    bool dropped = events[j].type == EV_SYN && events[j].code == SYN_DROPPED;
+                    if (events[j].type != EV_KEY && !dropped) continue;
+                    if (!device->kernel_clock) {
+                        events[j].time.tv_sec = now.tv_sec;
+                        events[j].time.tv_usec = now.tv_nsec / 1000;
+                    }
+                    CapturedEvent captured = { .event = events[j], .device = (uint8_t)slot, .grabbed = device->grabbed };
+                    while (!ring_push(&pipeline->captured, &captured)) {
+                        // Анализ отстал: нажатия не теряем, ждём места
+                        eventfd_write(pipeline->captured_fd, 1);
+                        usleep(500);
+                    }
+                    pipeline->captured_events++;
+                }
+            }
+            eventfd_write(pipeline->captured_fd, 1);
+            // Отложенный захват: нажатия до него уже дошли до приложения напрямую
+            if (device->grab_pending && keys_released(fd)) {
+                device->grab_pending = false;
+                device->grabbed = ioctl(fd, EVIOCGRAB, 1) == 0;
+                push_device_reset(pipeline, slot);
+                log_device_grab(device);
+            }
+            // Отключённая клавиатура закрывается, сеанс продолжается с остальными
+            if ((bytes < 0 && errno != EAGAIN && errno != EINTR) || (ready[i].events & (EPOLLHUP | EPOLLERR))) {
+                close_input_device(pipeline, slot);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Поток инжекции: выполняет задания строго по порядку; нажатия, пришедшие
+// во время исправления, ждут в очереди и передаются после него
+static void *injector_thread_main(void *arg) {
+    Pipeline *pipeline = arg;
+    InjectJob job;
+    bool running = true;
+    uint64_t oldest_forward_ns = 0;     // захват самого раннего нажатия в текущем пакете
+    while (running) {
+        eventfd_t pending;
+        if (eventfd_read(pipeline->jobs_fd, &pending) < 0 && errno != EINTR) break;
+        while (ring_pop(&pipeline->jobs, &job)) {
+            if (job.type == JOB_STOP) {
+                running = false;
+                break;
+            }
+            if (job.type == JOB_FORWARD && !oldest_forward_ns) oldest_forward_ns = event_time_ns(&job.event);
+            execute_job(pipeline->injector, &job);
+            pipeline->executed_jobs++;
+            // Исправление отправляется внутри execute_job вместе с накопленными нажатиями
+            if (job.type == JOB_CORRECTION) {
+                uint64_t now = (uint64_t)monotonic_ns();
+                if (job.captured_ns) hist_record(&metrics.capture_to_correction, now - job.captured_ns);
+                if (oldest_forward_ns) hist_record(&metrics.capture_to_forward, now - oldest_forward_ns);
+                oldest_forward_ns = 0;
+            }
+        }
+        flush_injector(pipeline->injector);
+        if (oldest_forward_ns) hist_record(&metrics.capture_to_forward, (uint64_t)monotonic_ns() - oldest_forward_ns);
+        oldest_forward_ns = 0;
+    }
+    return NULL;
+}
+
+// device_paths — заданные --device клавиатуры (count == 0 — все найденные в INPUT_DIR),
+// forward_keys — клавиши, которые умеет пересылать виртуальная клавиатура.
+// Запуск без клавиатур не ошибка: они подключатся на ходу
+bool start_pipeline(Pipeline *pipeline, const char *const *device_paths, int device_path_count,
+                    const unsigned char *forward_keys, Injector *injector) {
+    memset(pipeline, 0, sizeof(*pipeline));
+    for (int i = 0; i < MAX_INPUT_DEVICES; i++) pipeline->devices[i].fd = -1;
+    for (int i = 0; i < device_path_count && i < MAX_INPUT_DEVICES; i++) pipeline->device_paths[i] = device_paths[i];
+    pipeline->device_path_count = device_path_count < MAX_INPUT_DEVICES ? device_path_count : MAX_INPUT_DEVICES;
+    pipeline->forward_keys = forward_keys;
+    pipeline->injector = injector;
+    atomic_init(&pipeline->capture_failed, false);
+    pipeline->captured_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pipeline->jobs_fd = eventfd(0, EFD_CLOEXEC);
+    pipeline->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pipeline->capture_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pipeline->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (pipeline->captured_fd < 0 || pipeline->jobs_fd < 0 || pipeline->stop_fd < 0 || pipeline->capture_epoll_fd < 0 ||
+        !ring_init(&pipeline->captured, CAPTURE_RING_SIZE, sizeof(CapturedEvent)) ||
+        !ring_init(&pipeline->jobs, JOB_RING_SIZE, sizeof(InjectJob))) {
+        perror("Не удалось создать очереди конвейера");
+        return false;
+    }
+    struct epoll_event registration = { .events = EPOLLIN, .data.fd = pipeline->stop_fd };
+    epoll_ctl(pipeline->capture_epoll_fd, EPOLL_CTL_ADD, pipeline->stop_fd, &registration);
+    if (pipeline->inotify_fd >= 0 &&
+        inotify_add_watch(pipeline->inotify_fd, INPUT_DIR, IN_CREATE | IN_ATTRIB | IN_DELETE) >= 0) {
+        registration.data.fd = pipeline->inotify_fd;
+        epoll_ctl(pipeline->capture_epoll_fd, EPOLL_CTL_ADD, pipeline->inotify_fd, &registration);
+    } else {
+        perror("inotify на " INPUT_DIR " недоступен, клавиатуры не подключаются на ходу");
+        if (pipeline->inotify_fd >= 0) close(pipeline->inotify_fd);
+        pipeline->inotify_fd = -1;
+    }
+
+    scan_input_paths(pipeline->device_paths, pipeline->device_path_count, open_input_path, pipeline);
+    if (pipeline->attached_devices == 0) {
+        if (pipeline->inotify_fd < 0) {
+            wprintf(L"Ошибка: Клавиатуры не найдены\n");
+            return false;
+        }
+        wprintf(L"Клавиатуры не найдены, жду подключения\n");
+    }
+
+    // Потоки наследуют маску: сигналы обрабатывает только основной поток через signalfd
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    bool ok = pthread_create(&pipeline->injector_thread, NULL, injector_thread_main, pipeline) == 0;
+    if (ok && pthread_create(&pipeline->capture_thread, NULL, capture_thread_main, pipeline) != 0) {
+        InjectJob stop = { .type = JOB_STOP };
+        ring_push(&pipeline->jobs, &stop);
+        eventfd_write(pipeline->jobs_fd, 1);
+        pthread_join(pipeline->injector_thread, NULL);
+        ok = false;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!ok) {
+        perror("Не удалось запустить потоки конвейера");
+        for (int i = 0; i < MAX_INPUT_DEVICES; i++) close_input_device(pipeline, i);
+        return false;
+    }
+    return true;
+}
+
+// Остановка: сначала захват, затем инжектор дорабатывает очередь до JOB_STOP
+void stop_pipeline(Pipeline *pipeline) {
+    eventfd_write(pipeline->stop_fd, 1);
+    pthread_join(pipeline->capture_thread, NULL);
+    InjectJob stop = { .type = JOB_STOP };
+    while (!ring_push(&pipeline->jobs, &stop)) {
+        eventfd_write(pipeline->jobs_fd, 1);
+        usleep(500);
+    }
+    eventfd_write(pipeline->jobs_fd, 1);
+    pthread_join(pipeline->injector_thread, NULL);
+    // Поток захвата остановлен, устройства снова принадлежат этому потоку
+    for (int i = 0; i < MAX_INPUT_DEVICES; i++) {
+        InputDevice *device = &pipeline->devices[i];
+        if (device->fd < 0) continue;
+        if (device->grabbed) ioctl(device->fd, EVIOCGRAB, 0);
+        close(device->fd);
+        device->fd = -1;
+    }
+}
+
+void free_pipeline(Pipeline *pipeline) {
+    if (pipeline->captured_fd >= 0) close(pipeline->captured_fd);
+    if (pipeline->jobs_fd >= 0) close(pipeline->jobs_fd);
+    if (pipeline->stop_fd >= 0) close(pipeline->stop_fd);
+    if (pipeline->capture_epoll_fd >= 0) close(pipeline->capture_epoll_fd);
+    if (pipeline->inotify_fd >= 0) close(pipeline->inotify_fd);
+    ring_free(&pipeline->captured);
+    ring_free(&pipeline->jobs);
+}
+
+/* ========== CONFIG FUNCTIONS ========== */
+
+static const char *const log_level_names[] = {"error", "warn", "info", "debug", "trace"};
+static const char *const hotkey_names[] = {"auto", "shift-alt", "super-space"};
+
+// Строковые настройки, которые читаются только при запуске
+static const struct { const char *name; size_t offset; size_t size; } config_strings[] = {
+    {"layouts", offsetof(Config, layouts), sizeof(((Config *)0)->layouts)},
+    {"xkb_rules", offsetof(Config, xkb_rules), sizeof(((Config *)0)->xkb_rules)},
+    {"xkb_model", offsetof(Config, xkb_model), sizeof(((Config *)0)->xkb_model)},
+    {"xkb_options", offsetof(Config, xkb_options), sizeof(((Config *)0)->xkb_options)},
+    {"dict_dir", offsetof(Config, dict_dir), sizeof(((Config *)0)->dict_dir)},
+    {"learn_file", offsetof(Config, learn_file), sizeof(((Config *)0)->learn_file)},
+    {"stats_socket", offsetof(Config, stats_socket), sizeof(((Config *)0)->stats_socket)},
+};
+
+void default_config(Config *config) {
+    memset(config, 0, sizeof(*config));
+    snprintf(config->xkb_rules, sizeof(config->xkb_rules), "evdev");
+    snprintf(config->xkb_model, sizeof(config->xkb_model), "pc105");
+    config->switch_hotkey = HOTKEY_AUTO;
+    default_learn_path(config->learn_file, sizeof(config->learn_file));
+    // Сокет меняет настройки: в общем /tmp ему не место, только в личном каталоге
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir) {
+        snprintf(config->stats_socket, sizeof(config->stats_socket), "%s/%s", runtime_dir, STATS_SOCKET_NAME);
+    }
+    config->remember_layout = true;
+    config->profiles.defaults.strategy = CORRECT_SELECT;
+    config->profiles.defaults.pacing = default_pacing;
+}
+
+// $XDG_CONFIG_HOME/layout_switcher/config или ~/.config/layout_switcher/config
+void default_config_path(char *path, size_t size) {
+    const char *config_home = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    if (config_home && *config_home) snprintf(path, size, "%s/layout_switcher/%s", config_home, CONFIG_FILE_NAME);
+    else if (home && *home) snprintf(path, size, "%s/.config/layout_switcher/%s", home, CONFIG_FILE_NAME);
+    else snprintf(path, size, "%s", CONFIG_FILE_NAME);
+}
+
+// Профиль приложения по классу (len байт); create — завести новый, поля которого
+// все берутся из общего профиля. NULL — нет и не создан
+static AppProfile *find_app_profile(AppProfiles *profiles, const char *wm_class, size_t len, bool create) {
+    for (size_t i = 0; i < profiles->count; i++) {
+        AppProfile *app = &profiles->apps[i];
+        if (strlen(app->wm_class) == len && strncasecmp(app->wm_class, wm_class, len) == 0) return app;
+    }
+    if (!create || len == 0 || len >= sizeof(profiles->apps[0].wm_class) || profiles->count == MAX_APP_RULES) {
+        return NULL;
+    }
+    AppProfile *app = &profiles->apps[profiles->count++];
+    memcpy(app->wm_class, wm_class, len);
+    app->wm_class[len] = '\0';
+    app->strategy = -1;
+    app->pacing = (InjectPacing){ -1, -1, -1 };
+    app->exclude = -1;
+    return app;
+}
+
+static bool parse_bool(const char *value, bool *out) {
+    if (strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0) *out = true;
+    else if (strcmp(value, "false") == 0 || strcmp(value, "no") == 0 || strcmp(value, "0") == 0) *out = false;
+    else return false;
+    return true;
+}
+
+static int *profile_delay(AppProfile *profile, const char *key) {
+    if (strcmp(key, "key_delay") == 0) return &profile->pacing.key_delay_us;
+    if (strcmp(key, "switch_delay") == 0) return &profile->pacing.switch_delay_us;
+    if (strcmp(key, "delete_delay") == 0) return &profile->pacing.delete_delay_us;
+    return NULL;
+}
+
+// Значение настройки key; "CLASS:ключ" — профиля приложения. running — программа уже
+// работает (сокет управления), тогда меняются только профили, remember_layout и уровень журнала.
+// NULL — принято, иначе описание ошибки
+const char *apply_setting(Config *config, const char *key, const char *value, bool running) {
+    const char *wm_class = key;
+    const char *colon = strchr(key, ':');
+    if (colon) key = colon + 1;
+    // Значение разбирается в пустой профиль до поиска настоящего: отклонённая
+    // настройка не должна заводить профиль приложения
+    AppProfile parsed = { .strategy = -1, .pacing = { -1, -1, -1 }, .exclude = -1 };
+    int *delay = profile_delay(&parsed, key);
+    bool profile_key = true;
+    if (strcmp(key, "correction") == 0) {
+        CorrectionStrategy strategy;
+        if (!parse_correction(value, &strategy)) return "способ исправления: select, backspace или ctrl-backspace";
+        parsed.strategy = strategy;
+    } else if (delay) {
+        char *end;
+        long us = strtol(value, &end, 10);
+        if (end == value || *end || us < 0 || us > 1000000) return "задержка — число микросекунд от 0 до 1000000";
+        *delay = (int)us;
+    } else if (strcmp(key, "exclude") == 0) {
+        bool exclude;
+        if (!parse_bool(value, &exclude)) return "exclude: true или false";
+        parsed.exclude = exclude;
+    } else {
+        profile_key = false;
+    }
+    if (profile_key) {
+        AppProfile *profile = colon ? find_app_profile(&config->profiles, wm_class, (size_t)(colon - wm_class), true)
+                                    : &config->profiles.defaults;
+        if (!profile) return "профилей приложений не больше 32, класс — не длиннее 63 байт";
+        overlay_profile(profile, &parsed);
+        return NULL;
+    }
+    if (colon) return "в профиле приложения задаются correction, key_delay, switch_delay, delete_delay и exclude";
+    if (strcmp(key, "remember_layout") == 0) {
+        if (!parse_bool(value, &config->remember_layout)) return "remember_layout: true или false";
+        return NULL;
+    }
+
+    if (strcmp(key, "log_level") == 0) {
+        for (int level = LOG_ERROR; level <= LOG_TRACE; level++) {
+            if (strcmp(value, log_level_names[level]) == 0) {
+                atomic_store_explicit(&log_level, level, memory_order_relaxed);
+                return NULL;
+            }
+        }
+        return "уровень журнала: error, warn, info, debug или trace";
+    }
+    bool known = strcmp(key, "switch_hotkey") == 0 || strcmp(key, "inject") == 0 || strcmp(key, "device") == 0;
+    for (size_t i = 0; i < sizeof(config_strings) / sizeof(config_strings[0]); i++) {
+        if (strcmp(key, config_strings[i].name) == 0) known = true;
+    }
+    if (!known) return "неизвестная настройка";
+    if (running) return "меняется только при запуске";
+
+    if (strcmp(key, "switch_hotkey") == 0) {
+        for (int hotkey = HOTKEY_AUTO; hotkey <= HOTKEY_SUPER_SPACE; hotkey++) {
+            if (strcmp(value, hotkey_names[hotkey]) == 0) {
+                config->switch_hotkey = (SwitchHotkey)hotkey;
+                return NULL;
+            }
+        }
+        return "сочетание переключения: auto, shift-alt или super-space";
+    }
+    if (strcmp(key, "inject") == 0) {
+        if (strcmp(value, "direct") != 0 && strcmp(value, "switch") != 0) return "способ инжекции: direct или switch";
+        snprintf(config->inject, sizeof(config->inject), "%s", value);
+        return NULL;
+    }
+    if (strcmp(key, "device") == 0) {
+        // Только эти клавиатуры (можно несколько раз); по умолчанию — все из INPUT_DIR
+        if (config->device_count == MAX_INPUT_DEVICES) return "устройств не больше 16";
+        if (strlen(value) >= PATH_MAX) return "слишком длинный путь";
+        snprintf(config->devices[config->device_count++], PATH_MAX, "%s", value);
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(config_strings) / sizeof(config_strings[0]); i++) {
+        if (strcmp(key, config_strings[i].name) != 0) continue;
+        if (strlen(value) >= config_strings[i].size) return "слишком длинное значение";
+        memcpy((char *)config + config_strings[i].offset, value, strlen(value) + 1);
+    }
+    return NULL;
+}
+
+// Текущее значение настройки для команды get; "-" — поле профиля берётся из общего
+bool format_setting(Config *config, const char *key, char *out, size_t size) {
+    AppProfile *profile = &config->profiles.defaults;
+    const char *colon = strchr(key, ':');
+    if (colon) {
+        profile = find_app_profile(&config->profiles, key, (size_t)(colon - key), false);
+        if (!profile) return false;
+        key = colon + 1;
+    }
+    int *delay = profile_delay(profile, key);
+    if (strcmp(key, "correction") == 0) {
+        snprintf(out, size, "%ls", profile->strategy >= 0 ? correction_name((CorrectionStrategy)profile->strategy) : L"-");
+    } else if (delay) {
+        if (*delay >= 0) snprintf(out, size, "%d", *delay);
+        else snprintf(out, size, "-");
+    } else if (strcmp(key, "exclude") == 0) {
+        snprintf(out, size, "%s", profile->exclude < 0 ? "-" : profile->exclude ? "true" : "false");
+    } else if (colon) {
+        return false;
+    } else if (strcmp(key, "remember_layout") == 0) {
+        snprintf(out, size, "%s", config->remember_layout ? "true" : "false");
+    } else if (strcmp(key, "log_level") == 0) {
+        snprintf(out, size, "%s", log_level_names[atomic_load_explicit(&log_level, memory_order_relaxed)]);
+    } else if (strcmp(key, "switch_hotkey") == 0) {
+        snprintf(out, size, "%s", hotkey_names[config->switch_hotkey]);
+    } else if (strcmp(key, "inject") == 0) {
+        snprintf(out, size, "%s", config->inject);
+    } else if (strcmp(key, "device") == 0) {
+        size_t len = 0;
+        out[0] = '\0';
+        for (int i = 0; i < config->device_count && len < size; i++) {
+            len += snprintf(out + len, size - len, "%s%s", i ? "," : "", config->devices[i]);
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(config_strings) / sizeof(config_strings[0]); i++) {
+            if (strcmp(key, config_strings[i].name) == 0) {
+                snprintf(out, size, "%s", (const char *)config + config_strings[i].offset);
+                return true;
+            }
+        }
+        return false;
+    }
+    return true;
+}
+
+static char *trim(char *s) {
+    while (*s == ' ' || *s == '\t') s++;
+    size_t len = strlen(s);
+    while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\n' || s[len - 1] == '\r')) len--;
+    s[len] = '\0';
+    return s;
+}
+
+// Файл конфигурации: строки "ключ = значение", '#' — комментарий. Секция
+// "[app CLASS]" задаёт профиль приложения (correction, key_delay, switch_delay,
+// delete_delay, exclude). Нет файла — false, только если он указан явно (--config)
+bool load_config(Config *config, const char *path, bool required) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        if (!required && errno == ENOENT) return true;
+        perror(path);
+        return false;
+    }
+    char line[PATH_MAX + 64];
+    char section[64] = "";
+    int number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        number++;
+        char *text = trim(line);
+        if (!*text || *text == '#') continue;
+        const char *error = NULL;
+        if (*text == '[') {
+            char *close = strchr(text, ']');
+            if (close) *close = '\0';
+            char *name = trim(text + 1);
+            if (!close || strncmp(name, "app", 3) != 0 || (name[3] != ' ' && name[3] != '\t')) {
+                error = "ожидается секция [app CLASS]";
+            } else {
+                snprintf(section, sizeof(section), "%s", trim(name + 4));
+                if (!section[0]) error = "не указан класс окна";
+            }
+        } else {
+            char *eq = strchr(text, '=');
+            if (!eq) {
+                error = "ожидается \"ключ = значение\"";
+            } else {
+                *eq = '\0';
+                char key[128];
+                snprintf(key, sizeof(key), "%s%s%s", section, section[0] ? ":" : "", trim(text));
+                error = apply_setting(config, key, trim(eq + 1), false);
+            }
+        }
+        if (error) {
+            fprintf(stderr, "%s:%d: %s\n", path, number, error);
+            ok = false;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Сочетание переключения без запуска gsettings: опции XKB сервера X11,
+// и только без X11 — настройки GNOME
+bool detect_super_space(Display *display) {
+    char options[256];
+    if (get_x11_xkb_options(display, options, sizeof(options))) return strstr(options, "win_space_toggle") != NULL;
+    bool super_space = false;
+    FILE *gsettings_pipe = popen("gsettings get org.gnome.desktop.input-sources xkb-options", "r");
+    if (gsettings_pipe) {
+        char buffer[256];
+        if (fgets(buffer, sizeof(buffer), gsettings_pipe)) super_space = strstr(buffer, "win_space_toggle") != NULL;
+        pclose(gsettings_pipe);
+    }
+    return super_space;
+}
+
+/* ========== EVENT LOOP ========== */
+
+void reset_word(WordState *ws) {
+    memset(ws->word, 0, sizeof(ws->word));
+    ws->word_len = 0;
+    ws->trie_path[0] = TRIE_ROOT;
+}
+
+// Обработка одного события клавиатуры; false — пользователь нажал ESC
+bool handle_key_event(Switcher *sw, WordState *ws, const struct input_event *ev) {
+    count_metric(&metrics.key_events, 1);
+    if (ev->type == EV_KEY && ev->code == PAUSE_KEY_CODE && sw->selection) {
+        // Pause — конвертировать выделенный текст и вставить его на место,
+        // Shift + Pause — конвертировать буфер обмена. Приложению клавиша не передаётся
+        if (ev->value == 1) {
+            Atom source = ws->shift_pressed ? sw->selection->clipboard : XA_PRIMARY;
+            request_selection(sw->selection, sw->display, source, !ws->shift_pressed);
+            reset_word(ws);
+            ws->recent.count = 0;
+        }
+        return true;
+    }
+    if (ev->type == EV_KEY && ev->value == 1) {
+        if (ev->code == LEFTSHIFT_KEY_CODE || ev->code == KEY_RIGHTSHIFT) ws->shift_pressed = true;
+        else if (ev->code == LEFTALT_KEY_CODE || ev->code == RIGHTALT_KEY_CODE) ws->alt_pressed = true;
+        else if (ev->code == LEFTMETA_KEY_CODE || ev->code == KEY_RIGHTMETA) ws->super_pressed = true;
+        // Сочетание смены раскладки определяется до учёта нажатия обучением: иначе
+        // пробел Super + Space принял бы исправление раньше, чем его отменил
+        bool completes_chord = sw->use_super_space
+            ? (ws->super_pressed && ev->code == SPACE_KEY_CODE)
+            : (ws->shift_pressed && ws->alt_pressed &&
+               (ev->code == LEFTSHIFT_KEY_CODE || ev->code == KEY_RIGHTSHIFT ||
+                ev->code == LEFTALT_KEY_CODE || ev->code == RIGHTALT_KEY_CODE));
+        learn_observe_key(sw->learn, ev->code, completes_chord);
+        if (is_modifier_key(ev->code)) {
+            // Состояние модификаторов уже обновлено
+        } else if (ev->code == ESC_KEY_CODE) {
+            LOG(LOG_INFO, L"ESC нажат. Выход.\n");
+            if (sw->grabbed) forward_event(sw, ev);
+            return false;
+        } else if (ev->code == SPACE_KEY_CODE) {
+            bool corrected = false;
+            if (ws->word_len > 0) {
+                // Запятая или точка после слова — буква другой раскладки. Если вместе
+                // с ней слова нет в словарях, решение принимается по слову без неё
+                int len = ws->word_len;
+                wchar_t tail[MAX_WORD_LEN];
+                if (!(trie_flags(sw->trie, ws->trie_path[len]) & TRIE_WORDS)) {
+                    while (len > 0 && !iswalpha(ws->word[len - 1])) len--;
+                }
+                wcscpy(tail, ws->word + len);
+                ws->word[len] = L'\0';
+                const AppProfile *profile = focused_profile(sw);
+                if (profile->exclude > 0) {
+                    // Окно паролей или исключённое приложение: слово не проверяется вовсе
+                    LOG(LOG_TRACE, L"Window excluded, word skipped\n");
+                    if (sw->windows) sw->windows->excluded_words++;
+                    ws->recent.count = 0;
+                } else {
+                    corrected = process_word(sw, profile, &ws->recent, ws->word, ws->shifted, ws->trie_path[len], tail);
+                }
+                reset_word(ws);
+            } else {
+                // Второй пробел подряд: слова до него уже не фраза
+                ws->recent.count = 0;
+            }
+            if (corrected && !sw->grabbed) {
+                // Без захвата исправление стёрло и пробел, который пользователь уже напечатал
+                struct input_event space = { .type = EV_KEY, .code = SPACE_KEY_CODE, .value = 1 };
+                forward_event(sw, &space);
+                space.value = 0;
+                forward_event(sw, &space);
+            }
+            LOG(LOG_TRACE, L"Space pressed, processed word\n");
+        } else if (ev->code == BACKSPACE_KEY_CODE) {
+            if (ws->word_len > 0) {
+                ws->word[--ws->word_len] = L'\0';
+                LOG(LOG_TRACE, L"Backspace pressed, removed last char, word_len: %d\n", ws->word_len);
+            } else {
+                // Стёрт пробел или предыдущее слово: история больше не совпадает с экраном
+                ws->recent.count = 0;
+            }
+        } else {
+            int layout = cached_layout(sw);
+            if (layout < 0 || layout >= layout_set.count) layout = 0;
+            LOG(LOG_TRACE, L"System layout before adding char: %d (%hs)\n", layout, layout_name(layout));
+
+            // В слово идут клавиши, которые дают букву хотя бы в одной раскладке:
+            // "j,tl" в us — это "обед" в ru
+            int key = keycode_to_key(ev->code);
+            wchar_t c = key >= 0 ? layout_set.layouts[layout].chars[0][ev->code] : L'\0';
+            if (c && ((layout_set.letter_keys >> key) & 1) && ws->word_len < MAX_WORD_LEN - 1) {
+                ws->shifted[ws->word_len] = ws->shift_pressed;
+                ws->word[ws->word_len++] = c;
+                ws->trie_path[ws->word_len] = trie_step(sw->trie, ws->trie_path[ws->word_len - 1], key);
+                LOG(LOG_TRACE, L"Added char: %lc (U+%04X), word_len: %d, system_layout: %d (%hs)\n",
+                    c, (unsigned int)c, ws->word_len, layout, layout_name(layout));
+            } else if (!is_modifier_key(ev->code)) {
+                // Enter, стрелки, Tab: курсор мог уйти от недавних слов
+                ws->recent.count = 0;
+            }
+        }
+
+        // Обработка ручного переключения раскладки. При подписке на события новая
+        // группа придёт сама; без них кеш переключается по нажатому сочетанию
+        if (completes_chord && !layout_events_available(sw)) {
+            sw->system_layout = (sw->system_layout + 1) % layout_set.count;
+            sw->layout_stats.manual_toggles++;
+            LOG(LOG_DEBUG, L"Detected manual %ls, layout: %d (%hs)\n", sw->use_super_space ? L"Super + Space" : L"Shift + Alt",
+                sw->system_layout, layout_name(sw->system_layout));
+            sync_xkb_state(sw->xkb_state, sw->system_layout);
+        }
+    } else if (ev->type == EV_KEY && ev->value == 0) {
+        if (ev->code == LEFTSHIFT_KEY_CODE || ev->code == KEY_RIGHTSHIFT) ws->shift_pressed = false;
+        else if (ev->code == LEFTALT_KEY_CODE || ev->code == RIGHTALT_KEY_CODE) ws->alt_pressed = false;
+        else if (ev->code == LEFTMETA_KEY_CODE || ev->code == KEY_RIGHTMETA) ws->super_pressed = false;
+    }
+    if (sw->grabbed && ev->type == EV_KEY) forward_event(sw, ev);
+    return true;
+}
+
+// Сокет управления: команды построчно, ответ на каждую. "stats" — снимок метрик,
+// "get КЛЮЧ", "set КЛЮЧ ЗНАЧЕНИЕ" — настройки (КЛЮЧ профиля — "CLASS:ключ").
+// Соединение без команд получает метрики, когда клиент закроет свою сторону
+// (socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/layout_switcher.sock </dev/null).
+// Сокет создаётся с правами 0600, клиенты другого пользователя отклоняются
+int open_stats_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        wprintf(L"Слишком длинный путь сокета статистики: %hs\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Не удалось создать сокет статистики");
+        return -1;
+    }
+    // Удаляется только свой сокет от прошлого запуска, не чужой файл на этом месте
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+            wprintf(L"%hs — не свой сокет, сокет управления не открыт\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    mode_t old_umask = umask(0077);
+    bool ok = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(old_umask);
+    if (!ok || chmod(path, 0600) < 0 || listen(fd, 4) < 0) {
+        perror("Не удалось открыть сокет статистики");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void send_stats(int client) {
+    char buffer[2048];
+    size_t len = format_metrics(buffer, sizeof(buffer));
+    if (write(client, buffer, len) < 0) perror("Не удалось отправить статистику");
+}
+
+// Новые соединения попадают в epoll; если все места заняты — сразу метрики, как раньше
+void serve_stats(int stats_fd, int epoll_fd, ControlClient *clients) {
+    int client;
+    while ((client = accept4(stats_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct ucred peer = { .uid = (uid_t)-1 };
+        socklen_t peer_len = sizeof(peer);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) < 0 ||
+            (peer.uid != geteuid() && peer.uid != 0)) {
+            LOG(LOG_WARN, L"Сокет управления: отклонён клиент uid %d\n", (int)peer.uid);
+            close(client);
+            continue;
+        }
+        ControlClient *slot = NULL;
+        for (int i = 0; i < CONTROL_CLIENTS && !slot; i++) {
+            if (clients[i].fd < 0) slot = &clients[i];
+        }
+        struct epoll_event registration = { .events = EPOLLIN, .data.fd = client };
+        if (!slot || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &registration) < 0) {
+            send_stats(client);
+            close(client);
+            continue;
+        }
+        *slot = (ControlClient){ .fd = client };
+    }
+}
+
+// Одна команда сокета управления; ответ — в reply
+static void control_command(Switcher *sw, char *line, char *reply, size_t size) {
+    char *save = NULL;
+    char *command = strtok_r(line, " \t", &save);
+    char *key = strtok_r(NULL, " \t", &save);
+    char *value = strtok_r(NULL, "", &save);
+    while (value && (*value == ' ' || *value == '\t')) value++;
+    if (!command) {
+        snprintf(reply, size, "error: пустая команда\n");
+        return;
+    }
+    if (strcmp(command, "stats") == 0 && !key) {
+        format_metrics(reply, size);
+    } else if (strcmp(command, "get") == 0 && key && !value) {
+        if (format_setting(sw->config, key, reply, size - 1)) strcat(reply, "\n");
+        else snprintf(reply, size, "error: нет настройки %s\n", key);
+    } else if (strcmp(command, "set") == 0 && key && value && *value) {
+        const char *error = apply_setting(sw->config, key, value, true);
+        if (error) {
+            snprintf(reply, size, "error: %s\n", error);
+            return;
+        }
+        LOG(LOG_INFO, L"Настройка %hs = %hs\n", key, value);
+        snprintf(reply, size, "ok\n");
+        if (sw->windows) refresh_window_profiles(sw->windows, &sw->config->profiles);
+        // Общий темп действует и на пересылаемые нажатия — до исправления в окне с профилем
+        if (sw->injector && !strchr(key, ':')) {
+            InjectJob job = { .type = JOB_PACING, .pacing = sw->config->profiles.defaults.pacing };
+            submit_job(sw, &job);
+            if (sw->pipeline) eventfd_write(sw->pipeline->jobs_fd, 1);
+        }
+    } else {
+        snprintf(reply, size, "error: команды stats, get КЛЮЧ, set КЛЮЧ ЗНАЧЕНИЕ\n");
+    }
+}
+
+// Чтение команд клиента; false — соединение закрыто
+bool serve_control_client(Switcher *sw, ControlClient *client) {
+    ssize_t bytes;
+    while ((bytes = read(client->fd, client->line + client->len, sizeof(client->line) - 1 - client->len)) > 0) {
+        client->len += (size_t)bytes;
+        client->line[client->len] = '\0';
+        char *newline;
+        while ((newline = strchr(client->line, '\n'))) {
+            *newline = '\0';
+            if (newline > client->line && newline[-1] == '\r') newline[-1] = '\0';
+            if (client->line[0]) {
+                char reply[2048];
+                control_command(sw, client->line, reply, sizeof(reply));
+                if (write(client->fd, reply, strlen(reply)) < 0) perror("Не удалось ответить на команду");
+                client->answered = true;
+            }
+            size_t consumed = (size_t)(newline + 1 - client->line);
+            memmove(client->line, newline + 1, client->len - consumed + 1);
+            client->len -= consumed;
+        }
+        // Слишком длинная строка без перевода — отбрасываем
+        if (client->len == sizeof(client->line) - 1) client->len = 0;
+    }
+    if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) return true;
+    if (!client->answered) send_stats(client->fd);
+    close(client->fd);
+    client->fd = -1;
+    return false;
+}
+
+// Подписка на XkbStateNotify: сервер сам сообщает о смене группы
+bool setup_xkb_events(Switcher *sw) {
+    sw->xkb_event_base = -1;
+    if (!sw->display) return false;
+    int opcode, event_base, error_base, major = XkbMajorVersion, minor = XkbMinorVersion;
+    if (!XkbQueryExtension(sw->display, &opcode, &event_base, &error_base, &major, &minor)) {
+        wprintf(L"XKB extension unavailable\n");
+        return false;
+    }
+    if (!XkbSelectEventDetails(sw->display, XkbUseCoreKbd, XkbStateNotify, XkbGroupStateMask, XkbGroupStateMask)) {
+        wprintf(L"Failed to select XkbStateNotify\n");
+        return false;
+    }
+    XFlush(sw->display);
+    sw->xkb_event_base = event_base;
+    return true;
+}
+
+// Разбор очереди X11; Xlib мог прочитать события вместе с ответами, поэтому XPending
+void handle_x11_events(Switcher *sw) {
+    while (XPending(sw->display)) {
+        XEvent event;
+        XNextEvent(sw->display, &event);
+        if (handle_selection_event(sw, &event)) continue;
+        if (sw->windows && event.type == PropertyNotify && event.xproperty.atom == sw->windows->net_active_window &&
+            event.xproperty.window == DefaultRootWindow(sw->display)) {
+            window_focus_changed(sw);
+            continue;
+        }
+        if (sw->windows && (event.type == FocusIn || event.type == FocusOut)) {
+            // Переходы фокуса при захвате клавиатуры (меню, хоткеи) окно не меняют
+            if (event.xfocus.mode == NotifyNormal) window_focus_changed(sw);
+            continue;
+        }
+        if (sw->xkb_event_base < 0 || event.type != sw->xkb_event_base) continue;
+        XkbEvent *xkb_event = (XkbEvent *)&event;
+        if (xkb_event->any.xkb_type == XkbStateNotify && xkb_event->state.group != sw->system_layout) {
+            sw->system_layout = xkb_event->state.group;
+            sw->layout_stats.event_updates++;
+            LOG(LOG_DEBUG, L"XkbStateNotify: layout group %d (%hs)\n", sw->system_layout, layout_name(sw->system_layout));
+            sync_xkb_state(sw->xkb_state, sw->system_layout);
+        }
+    }
+}
+
+// Запуск "gsettings monitor" с выводом в неблокирующий канал
+LayoutMonitor *start_layout_monitor(void) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) return NULL;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return NULL;
+    }
+    if (pid == 0) {
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        execlp("gsettings", "gsettings", "monitor", "org.gnome.desktop.input-sources", "current", (char *)NULL);
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+    LayoutMonitor *monitor = calloc(1, sizeof(LayoutMonitor));
+    if (!monitor) {
+        close(pipe_fds[0]);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+    monitor->pid = pid;
+    monitor->fd = pipe_fds[0];
+    return monitor;
+}
+
+void stop_layout_monitor(LayoutMonitor *monitor) {
+    if (!monitor) return;
+    close(monitor->fd);
+    kill(monitor->pid, SIGTERM);
+    waitpid(monitor->pid, NULL, 0);
+    free(monitor);
+}
+
+// Строки вида "current: uint32 1"; false — процесс завершился
+bool handle_layout_monitor(Switcher *sw) {
+    LayoutMonitor *monitor = sw->layout_monitor;
+    ssize_t bytes;
+    while ((bytes = read(monitor->fd, monitor->line + monitor->line_len,
+                         sizeof(monitor->line) - 1 - monitor->line_len)) > 0) {
+        monitor->line_len += (size_t)bytes;
+        monitor->line[monitor->line_len] = '\0';
+        char *newline;
+        while ((newline = strchr(monitor->line, '\n'))) {
+            *newline = '\0';
+            char *value = strrchr(monitor->line, ' ');
+            if (value && strncmp(monitor->line, "current:", 8) == 0) {
+                int group = atoi(value + 1);
+                if (group >= 0 && group != sw->system_layout) {
+                    sw->system_layout = group;
+                    sw->layout_stats.event_updates++;
+                    wprintf(L"gsettings monitor: layout group %d (%hs)\n", group, layout_name(group));
+                    sync_xkb_state(sw->xkb_state, group);
+                }
+            }
+            size_t consumed = (size_t)(newline + 1 - monitor->line);
+            memmove(monitor->line, newline + 1, monitor->line_len - consumed + 1);
+            monitor->line_len -= consumed;
+        }
+        // Слишком длинная строка без перевода — отбрасываем
+        if (monitor->line_len == sizeof(monitor->line) - 1) monitor->line_len = 0;
+    }
+    return !(bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR));
+}
+
+// Цикл анализа на epoll: очередь потока захвата, соединение X11, gsettings
+// monitor и signalfd. Без событий поток спит в epoll_wait без таймаута
+int run_event_loop(Switcher *sw, Pipeline *pipeline) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0) {
+        perror("sigprocmask failed");
+        return -1;
+    }
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || epoll_fd < 0) {
+        perror("epoll/signalfd setup failed");
+        if (signal_fd >= 0) close(signal_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+        return -1;
+    }
+
+    int x11_fd = sw->display ? ConnectionNumber(sw->display) : -1;
+    struct epoll_event registration = { .events = EPOLLIN };
+    registration.data.fd = pipeline->captured_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipeline->captured_fd, &registration);
+    registration.data.fd = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &registration);
+    if (x11_fd >= 0) {
+        registration.data.fd = x11_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, x11_fd, &registration);
+    }
+    int monitor_fd = sw->layout_monitor ? sw->layout_monitor->fd : -1;
+    if (monitor_fd >= 0) {
+        registration.data.fd = monitor_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, monitor_fd, &registration);
+    }
+    int restore_fd = sw->selection ? sw->selection->restore_fd : -1;
+    if (restore_fd >= 0) {
+        registration.data.fd = restore_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, restore_fd, &registration);
+    }
+    int stats_fd = sw->stats_socket ? open_stats_socket(sw->stats_socket) : -1;
+    if (stats_fd >= 0) {
+        registration.data.fd = stats_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stats_fd, &registration);
+        wprintf(L"Сокет управления: %hs\n", sw->stats_socket);
+    } else if (!sw->stats_socket) {
+        wprintf(L"Сокет управления отключён: нет XDG_RUNTIME_DIR, путь задаёт stats_socket\n");
+    }
+
+    // Слово набирается отдельно на каждой клавиатуре
+    static WordState words[MAX_INPUT_DEVICES];
+    ControlClient clients[CONTROL_CLIENTS];
+    for (int c = 0; c < CONTROL_CLIENTS; c++) clients[c].fd = -1;
+    for (int d = 0; d < MAX_INPUT_DEVICES; d++) reset_word(&words[d]);
+    bool running = true;
+    int ret = 0;
+
+    while (running) {
+        if (sw->display) handle_x11_events(sw);
+
+        struct epoll_event ready[8];
+        int n = epoll_wait(epoll_fd, ready, 8, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            ret = -1;
+            break;
+        }
+        for (int i = 0; i < n && running; i++) {
+            int fd = ready[i].data.fd;
+            if (fd == signal_fd) {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    wprintf(L"Получен сигнал %u. Выход.\n", info.ssi_signo);
+                    running = false;
+                }
+            } else if (fd == x11_fd) {
+                handle_x11_events(sw);
+            } else if (fd == restore_fd) {
+                restore_clipboard(sw);
+            } else if (fd == stats_fd) {
+                serve_stats(stats_fd, epoll_fd, clients);
+            } else if (fd == monitor_fd) {
+                if (!handle_layout_monitor(sw)) {
+                    wprintf(L"gsettings monitor завершился, раскладка отслеживается по сочетанию клавиш\n");
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, monitor_fd, NULL);
+                    stop_layout_monitor(sw->layout_monitor);
+                    sw->layout_monitor = NULL;
+                    monitor_fd = -1;
+                }
+            } else if (fd != pipeline->captured_fd) {
+                for (int c = 0; c < CONTROL_CLIENTS; c++) {
+                    if (clients[c].fd == fd) serve_control_client(sw, &clients[c]);
+                }
+            } else {
+                eventfd_t pending;
+                eventfd_read(pipeline->captured_fd, &pending);
+                size_t backlog = ring_size(&pipeline->captured);
+                if (backlog > pipeline->max_captured_backlog) pipeline->max_captured_backlog = backlog;
+
+                // Набор словарей держится на всю пачку событий
+                const DictSet *set = sw->dict_store ? dict_store_acquire(sw->dict_store) : NULL;
+                if (set) use_dict_set(sw, set);
+                CapturedEvent captured;
+                while (running && ring_pop(&pipeline->captured, &captured)) {
+                    WordState *ws = &words[captured.device];
+                    if (captured.event.type == EV_SYN) {
+                        memset(ws, 0, sizeof(*ws));
+                        reset_word(ws);
+                        if (set) ws->generation = set->generation;
+                        continue;
+                    }
+                    if (set && ws->generation != set->generation) rebase_word(set, ws, sw->system_layout);
+                    if (sw->windows && ws->focus_changes != sw->windows->focus_changes) {
+                        // Начало слова и недавние слова остались в прежнем окне
+                        reset_word(ws);
+                        ws->recent.count = 0;
+                        ws->focus_changes = sw->windows->focus_changes;
+                    }
+                    sw->grabbed = captured.grabbed;
+                    sw->event_ns = event_time_ns(&captured.event);
+                    running = handle_key_event(sw, ws, &captured.event);
+                    hist_record(&metrics.capture_to_decision, (uint64_t)monotonic_ns() - sw->event_ns);
+                }
+                if (sw->dict_store) dict_store_release(sw->dict_store);
+                // Одно пробуждение инжектора на всю пачку событий
+                eventfd_write(pipeline->jobs_fd, 1);
+                if (atomic_load(&pipeline->capture_failed)) {
+                    wprintf(L"Поток захвата остановился\n");
+                    running = false;
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    for (int c = 0; c < CONTROL_CLIENTS; c++) {
+        if (clients[c].fd >= 0) close(clients[c].fd);
+    }
+    if (stats_fd >= 0) {
+        close(stats_fd);
+        unlink(sw->stats_socket);
+    }
+    close(epoll_fd);
+    close(signal_fd);
+    sigprocmask(SIG_UNBLOCK, &signals, NULL);
+    return ret;
 }
 
-// Функция для определения раскладки слова
-int detect_word_layout(const wchar_t *text, int system_layout) {
-    if (text == NULL || *text == L'\0') {
-        wprintf(L"Empty text in detect_word_layout\n");
-        return 0;
-    }
+/* ========== REPLAY ========== */
 
-    int en_count = 0;
-    int ru_count = 0;
-    int total_chars = 0;
+// Разбор строки корпуса "набранное ожидаемое"; false — строка пустая или неполная
+static bool parse_corpus_line(char *line, wchar_t *typed, wchar_t *expected) {
+    char *save = NULL;
+    char *first = strtok_r(line, " \t\r\n", &save);
+    char *second = strtok_r(NULL, " \t\r\n", &save);
+    if (!first || !second || first[0] == '#') return false;
+    return utf8_decode_word(first, typed, MAX_WORD_LEN) > 0 && utf8_decode_word(second, expected, MAX_WORD_LEN) > 0;
+}
 
-    for (size_t i = 0; text[i]; i++) {
-        wprintf(L"Processing char: %lc (U+%04X)\n", text[i], (unsigned int)text[i]);
-        if ((text[i] >= L'A' && text[i] <= L'Z') || (text[i] >= L'a' && text[i] <= L'z')) {
-            total_chars++;
-            en_count++;
-        } else if (text[i] >= 0x0410 && text[i] <= 0x044F) {
-            total_chars++;
-            ru_count++;
-        }
+// Раскладка, в которой набирается каждый символ слова (первая подходящая); -1 — такой нет
+static int corpus_word_layout(const wchar_t *word) {
+    for (int l = 0; l < layout_set.count; l++) {
+        size_t i = 0;
+        while (word[i] && word[i] < CHAR_RANGE && layout_set.layouts[l].keys[word[i]].keycode) i++;
+        if (!word[i]) return l;
     }
+    return -1;
+}
 
-    if (total_chars == 0) {
-        wprintf(L"No valid characters in text\n");
-        return 0;
+// Нажатия для слова в раскладке layout и пробел после него
+static size_t corpus_word_events(const wchar_t *word, int layout, struct input_event *events, size_t capacity) {
+    size_t n = 0;
+    for (size_t i = 0; word[i] && n + 6 <= capacity; i++) {
+        CharKey key = word[i] > 0 && word[i] < CHAR_RANGE ? layout_set.layouts[layout].keys[word[i]] : (CharKey){0, 0};
+        if (key.keycode == 0) continue;
+        if (key.shift) events[n++] = (struct input_event){ .type = EV_KEY, .code = LEFTSHIFT_KEY_CODE, .value = 1 };
+        events[n++] = (struct input_event){ .type = EV_KEY, .code = key.keycode, .value = 1 };
+        events[n++] = (struct input_event){ .type = EV_KEY, .code = key.keycode, .value = 0 };
+        if (key.shift) events[n++] = (struct input_event){ .type = EV_KEY, .code = LEFTSHIFT_KEY_CODE, .value = 0 };
     }
+    events[n++] = (struct input_event){ .type = EV_KEY, .code = SPACE_KEY_CODE, .value = 1 };
+    events[n++] = (struct input_event){ .type = EV_KEY, .code = SPACE_KEY_CODE, .value = 0 };
+    return n;
+}
+
+typedef struct {
+    unsigned long events;
+    double elapsed_ns;          // суммарное время handle_key_event
+    double *latencies;          // время решения по каждому слову (нажатие пробела)
+    size_t words;
+    size_t capacity;
+    size_t labeled;
+    size_t right;
+    size_t missed;              // нужно было исправить, но слово оставлено
+    size_t false_corrections;   // слово верное, но исправлено
+    size_t wrong_target;        // исправлено, но не в то слово
+} ReplayStats;
 
-    float en_ratio = (float)en_count / total_chars;
-    float ru_ratio = (float)ru_count / total_chars;
+// Прогон событий через тот же автомат, что и в run_event_loop. Решение по слову
+// сравнивается с expected (NULL — без разметки); false — ESC в записи
+static bool replay_events(Switcher *sw, WordState *ws, const struct input_event *events, size_t count,
+                          const wchar_t *expected, ReplayStats *stats) {
+    for (size_t i = 0; i < count; i++) {
+        const struct input_event *ev = &events[i];
+        bool decides = ev->type == EV_KEY && ev->value == 1 && ev->code == SPACE_KEY_CODE && ws->word_len > 0;
+        wchar_t typed[MAX_WORD_LEN];
+        if (decides) {
+            wmemcpy(typed, ws->word, ws->word_len);
+            typed[ws->word_len] = L'\0';
+            sw->replay->corrected = false;
+        }
+        double start = monotonic_ns();
+        bool running = handle_key_event(sw, ws, ev);
+        double elapsed = monotonic_ns() - start;
+        stats->elapsed_ns += elapsed;
+        stats->events++;
+        if (decides) {
+            if (stats->words == stats->capacity) {
+                size_t capacity = stats->capacity ? stats->capacity * 2 : 1024;
+                double *latencies = realloc(stats->latencies, capacity * sizeof(double));
+                if (!latencies) return false;
+                stats->latencies = latencies;
+                stats->capacity = capacity;
+            }
+            stats->latencies[stats->words++] = elapsed;
+            if (expected) {
+                const wchar_t *result = sw->replay->corrected ? sw->replay->target : typed;
+                stats->labeled++;
+                if (wcscmp(result, expected) == 0) stats->right++;
+                else if (!sw->replay->corrected) stats->missed++;
+                else if (wcscmp(typed, expected) == 0) stats->false_corrections++;
+                else stats->wrong_target++;
+            }
+        }
+        if (!running) return false;
+    }
+    return true;
+}
 
-    wprintf(L"en_ratio: %.2f, ru_ratio: %.2f, system_layout: %d (%ls)\n",
-            en_ratio, ru_ratio, system_layout, system_layout == 0 ? L"us" : L"ru");
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-    if (system_layout == 1 && ru_ratio >= 0.5) {
-        return 2; // Русский
+static void print_replay_stats(ReplayStats *stats, const ReplayInjector *injector) {
+    fwprintf(stderr, L"Событий: %lu, %.0f событий/с (%.1f мс в обработке)\n", stats->events,
+             stats->elapsed_ns > 0 ? stats->events / (stats->elapsed_ns / 1e9) : 0.0, stats->elapsed_ns / 1e6);
+    if (stats->words > 0) {
+        qsort(stats->latencies, stats->words, sizeof(double), compare_doubles);
+        size_t w = stats->words;
+        fwprintf(stderr, L"Слов: %zu, решение p50 %.1f мкс, p90 %.1f мкс, p99 %.1f мкс, max %.1f мкс\n", w,
+                 stats->latencies[w / 2] / 1e3, stats->latencies[w * 9 / 10] / 1e3,
+                 stats->latencies[w * 99 / 100] / 1e3, stats->latencies[w - 1] / 1e3);
     }
-    if (system_layout == 0 && en_ratio >= 0.5) {
-        return 1; // Английский
+    fwprintf(stderr, L"Исправлений: %lu (слов задним числом: %lu), переслано нажатий: %lu\n", injector->corrections,
+             injector->retro_words, injector->forwarded);
+    if (stats->labeled > 0) {
+        fwprintf(stderr, L"Точность: %.2f%% (%zu из %zu), пропущено %zu, лишних исправлений %zu, не то слово %zu\n",
+                 100.0 * stats->right / stats->labeled, stats->right, stats->labeled,
+                 stats->missed, stats->false_corrections, stats->wrong_target);
     }
-    if (ru_ratio >= 0.5 && en_ratio < 0.5) {
-        return 2; // Русский
+}
+
+// Прогон без клавиатуры, uinput и X11 (режимы --replay и --replay-corpus). Задания
+// исправления записываются вместо инжекции, раскладку сообщает сам прогон: для записи —
+// начальная (layout) и далее переключения сочетанием, для корпуса — раскладка каждого слова.
+// Журнал обработки уходит в /dev/null, отчёт — в stderr
+int run_replay(const char *events_file, const char *labels_file, const char *corpus_file, int layout) {
+    Dictionary dicts[MAX_LAYOUTS] = {0};
+    KeyTrie trie = {0};
+    FuzzyIndex fuzzy = {0};
+    NgramModel ngram = {0};
+    if (!load_layout_dictionaries(dicts) || !build_key_trie(&trie, dicts) || !build_fuzzy_index(&fuzzy, dicts) ||
+        !load_ngram_model(&ngram, dicts)) {
+        free_layout_dictionaries(dicts);
+        free_key_trie(&trie);
+        free_fuzzy_index(&fuzzy);
+        free_ngram_model(&ngram);
+        return 1;
     }
-    if (en_ratio >= 0.5 && ru_ratio < 0.5) {
-        return 1; // Английский
+
+    FILE *input = fopen(events_file ? events_file : corpus_file, events_file ? "rb" : "r");
+    FILE *labels = labels_file ? fopen(labels_file, "r") : NULL;
+    if (!input || (labels_file && !labels)) {
+        perror("Не удалось открыть файл для прогона");
+        if (input) fclose(input);
+        free_layout_dictionaries(dicts);
+        free_key_trie(&trie);
+        free_fuzzy_index(&fuzzy);
+        free_ngram_model(&ngram);
+        return 1;
     }
 
-    wprintf(L"Ambiguous layout detected\n");
-    return 0;
-}
+    static Config config;
+    default_config(&config);
+    static ReplayInjector replay_injector;
+    Switcher sw = {
+        .dicts = dicts,
+        .trie = &trie,
+        .fuzzy = &fuzzy,
+        .ngram = &ngram,
+        .config = &config,
+        .system_layout = layout,
+        .xkb_event_base = -1,
+        .replay = &replay_injector,
+    };
+    WordState ws = {0};
+    reset_word(&ws);
+    ReplayStats stats = {0};
 
-// Переключение раскладки через X11 или fallback
-void switch_layout(Display *display, int uinput_fd, bool use_super_space, int *system_layout) {
-    if (display) {
-        int new_group = (*system_layout + 1) % 2;
-        wprintf(L"Switching layout via X11 to group: %d (%ls)\n", new_group, new_group == 0 ? L"us" : L"ru");
-        XkbLockGroup(display, XkbUseCoreKbd, new_group);
-        XFlush(display);
-        *system_layout = new_group;
-    } else {
-        wprintf(L"X11 unavailable, using fallback layout switch\n");
-        switch_layout_fallback(uinput_fd, use_super_space);
-        update_system_layout(display, system_layout);
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
     }
-}
 
-// Fallback для переключения раскладки через uinput (Wayland)
-void switch_layout_fallback(int uinput_fd, bool use_super_space) {
-    wprintf(L"Switching layout via uinput: Emulating %ls\n", use_super_space ? L"Super + Space" : L"Shift + Alt");
-    if (use_super_space) {
-        send_key(uinput_fd, LEFTMETA_KEY_CODE, 1);
-        send_key(uinput_fd, SPACE_KEY_CODE, 1);
-        usleep(KEY_PRESS_DELAY);
-        send_key(uinput_fd, SPACE_KEY_CODE, 0);
-        send_key(uinput_fd, LEFTMETA_KEY_CODE, 0);
-    } else {
-        send_key(uinput_fd, LEFTSHIFT_KEY_CODE, 1);
-        send_key(uinput_fd, LEFTALT_KEY_CODE, 1);
-        usleep(KEY_PRESS_DELAY);
-        send_key(uinput_fd, LEFTALT_KEY_CODE, 0);
-        send_key(uinput_fd, LEFTSHIFT_KEY_CODE, 0);
-    }
-    usleep(LAYOUT_SWITCH_DELAY);
-}
-
-// Отправка нажатия клавиши
-void send_key(int fd, int keycode, int value) {
-    struct input_event ev = {0};
-    gettimeofday(&ev.time, NULL);
-    ev.type = EV_KEY;
-    ev.code = keycode;
-    ev.value = value;
-    write(fd, &ev, sizeof(ev));
-    ev.type = EV_SYN;
-    ev.code = SYN_REPORT;
-    ev.value = 0;
-    write(fd, &ev, sizeof(ev));
-}
-
-// Эмуляция ввода символа через uinput
-void send_char(int uinput_fd, wchar_t target_char, bool is_russian) {
-    int key_code = 0;
-    if (is_russian) {
-        const wchar_t *pos = wcschr(rus_chars, target_char);
-        if (!pos) {
-            wprintf(L"Cannot map char: %lc\n", target_char);
-            return;
-        }
-        size_t index = pos - rus_chars;
-        if (index >= wcslen(eng_chars)) {
-            wprintf(L"Index out of range for char: %lc\n", target_char);
-            return;
-        }
-        wchar_t source_char = eng_chars[index];
-        for (size_t i = 0; i < sizeof(key_map) / sizeof(key_map[0]); i++) {
-            if (key_map[i].eng_char == source_char) {
-                key_code = key_map[i].key_code;
-                break;
+    static struct input_event events[INJECT_BATCH_MAX];
+    char line[MAX_WORD_LEN * 8];
+    wchar_t typed[MAX_WORD_LEN], expected[MAX_WORD_LEN];
+    if (events_file) {
+        // Запись evdev: подряд struct input_event (например, cat /dev/input/eventN > keys.bin).
+        // Разметка — ожидаемое слово на строку в порядке нажатий пробела
+        size_t count;
+        bool running = true;
+        while (running && (count = fread(events, sizeof(struct input_event), INJECT_BATCH_MAX, input)) > 0) {
+            for (size_t i = 0; i < count && running; i++) {
+                const wchar_t *label = NULL;
+                bool decides = events[i].type == EV_KEY && events[i].value == 1 &&
+                               events[i].code == SPACE_KEY_CODE && ws.word_len > 0;
+                if (decides && labels && fgets(line, sizeof(line), labels)) {
+                    char *word = strtok(line, " \t\r\n");
+                    if (word && utf8_decode_word(word, expected, MAX_WORD_LEN) > 0) label = expected;
+                }
+                running = replay_events(&sw, &ws, &events[i], 1, label, &stats);
             }
         }
     } else {
-        for (size_t i = 0; i < sizeof(key_map) / sizeof(key_map[0]); i++) {
-            if (key_map[i].eng_char == target_char) {
-                key_code = key_map[i].key_code;
-                break;
-            }
+        // Корпус: строки "набранное ожидаемое"; раскладка набора — первая, в которой
+        // есть все символы набранного слова
+        while (fgets(line, sizeof(line), input)) {
+            if (!parse_corpus_line(line, typed, expected)) continue;
+            sw.system_layout = corpus_word_layout(typed);
+            if (sw.system_layout < 0) continue;
+            size_t count = corpus_word_events(typed, sw.system_layout, events, INJECT_BATCH_MAX);
+            reset_word(&ws);
+            ws.recent.count = 0;  // строки корпуса — отдельные слова, не фраза
+            if (!replay_events(&sw, &ws, events, count, expected, &stats)) break;
         }
     }
-    if (key_code == 0) {
-        wprintf(L"No key code for char: %lc\n", target_char);
-        return;
+
+    fflush(stdout);
+    if (saved_stdout >= 0) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
     }
-    send_key(uinput_fd, key_code, 1);
-    send_key(uinput_fd, key_code, 0);
-    usleep(KEY_PRESS_DELAY);
+    print_replay_stats(&stats, &replay_injector);
+
+    free(stats.latencies);
+    fclose(input);
+    if (labels) fclose(labels);
+    free_layout_dictionaries(dicts);
+    free_key_trie(&trie);
+    free_fuzzy_index(&fuzzy);
+    free_ngram_model(&ngram);
+    return 0;
 }
 
-// Выделение и удаление слова
-void select_and_delete_word(int uinput_fd, int len) {
-    send_key(uinput_fd, LEFTSHIFT_KEY_CODE, 1);
-    for (int i = 0; i < len + 1; i++) {
-        send_key(uinput_fd, LEFTARROW_KEY_CODE, 1);
-        send_key(uinput_fd, LEFTARROW_KEY_CODE, 0);
-        usleep(KEY_PRESS_DELAY);
+// Размеченный корпус из словарей (режим --make-corpus): каждое 10-е слово набрано
+// в своей раскладке (ожидается без изменений) и в каждой чужой (ожидается исправление).
+// Разметка — откуда слово взято, а не правило классификатора: слово, верное в обеих
+// раскладках, прогон честно засчитывает как ошибку одной из двух строк
+int make_replay_corpus(const char *output) {
+    Dictionary dicts[MAX_LAYOUTS] = {0};
+    if (!load_layout_dictionaries(dicts)) return 1;
+    FILE *file = fopen(output, "w");
+    if (!file) {
+        perror("Не удалось создать файл корпуса");
+        free_layout_dictionaries(dicts);
+        return 1;
     }
-    send_key(uinput_fd, LEFTSHIFT_KEY_CODE, 0);
-    send_key(uinput_fd, BACKSPACE_KEY_CODE, 1);
-    send_key(uinput_fd, BACKSPACE_KEY_CODE, 0);
-    usleep(DELETE_WORD_DELAY);
+    wchar_t word[MAX_WORD_LEN], converted[MAX_WORD_LEN];
+    char typed_utf8[MAX_WORD_LEN * 4];
+    size_t lines = 0;
+    fprintf(file, "# набранное ожидаемое\n");
+    for (int lang = 0; lang < layout_set.count; lang++) {
+        const Dictionary *dict = &dicts[lang];
+        for (size_t i = 0; i < dict->count; i += 10) {
+            const char *utf8 = dict_word(dict, i);
+            utf8_decode_word(utf8, word, MAX_WORD_LEN);
+            fprintf(file, "%s %s\n", utf8, utf8);
+            lines++;
+            for (int typed = 0; typed < layout_set.count; typed++) {
+                if (typed == lang) continue;
+                convert_layout(word, converted, lang, typed);
+                // Слово, которое в чужой раскладке выглядит так же, исправлять нечего
+                if (wcscmp(converted, word) == 0) continue;
+                utf8_encode_word(converted, typed_utf8, sizeof(typed_utf8));
+                fprintf(file, "%s %s\n", typed_utf8, utf8);
+                lines++;
+            }
+        }
+    }
+    bool ok = fclose(file) == 0;
+    free_layout_dictionaries(dicts);
+    if (!ok) return 1;
+    wprintf(L"Корпус %hs: %zu строк\n", output, lines);
+    return 0;
 }
 
-/* ========== X11 FUNCTIONS ========== */
+/* ========== BENCHMARKS ========== */
 
-int get_x11_layout_group(Display *display) {
-    if (!display) {
-        wprintf(L"X11 display not available\n");
-        return -1;
-    }
-    XkbStateRec xkb_state;
-    if (XkbGetState(display, XkbUseCoreKbd, &xkb_state) != Success) {
-        wprintf(L"Failed to get X11 keyboard state\n");
-        return -1;
+// Детерминированный генератор слов для синтетических словарей
+static uint32_t bench_rand(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void bench_random_word(uint32_t *state, wchar_t *out) {
+    int len = 3 + bench_rand(state) % 10;
+    for (int i = 0; i < len; i++) out[i] = L'a' + bench_rand(state) % 26;
+    out[len] = L'\0';
+}
+
+// Синтетический словарь из count случайных слов
+static bool bench_fill_dictionary(Dictionary *dict, size_t count, uint32_t seed) {
+    wchar_t buffer[MAX_WORD_LEN];
+    char utf8[MAX_WORD_LEN * 4];
+    for (size_t i = 0; i < count; i++) {
+        bench_random_word(&seed, buffer);
+        size_t len = utf8_encode_word(buffer, utf8, sizeof(utf8));
+        if (!dict_add_word(dict, utf8, len)) return false;
     }
-    int group = xkb_state.group;
-    wprintf(L"X11 layout group: %d (%ls)\n", group, group == 0 ? L"us" : L"ru");
-    return group;
+    return true;
 }
 
-void sync_xkb_state(struct xkb_state *xkb_state, int group) {
-    if (group >= 0) {
-        wprintf(L"Syncing xkb_state to group: %d\n", group);
-        xkb_state_update_mask(xkb_state, 0, 0, 0, 0, 0, group);
+// Задержка одного поиска для словарей 10k / 100k / 1M слов (попадания и промахи),
+// для сравнения — линейный проход, которым был is_in_dict до индекса
+int run_dict_benchmark(void) {
+    static const size_t sizes[] = {10000, 100000, 1000000};
+    const size_t lookups = 1000000;
+    const size_t linear_lookups = 200;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        Dictionary dict = {0};
+        if (!bench_fill_dictionary(&dict, sizes[s], 12345)) {
+            free_dictionary(&dict);
+            return 1;
+        }
+
+        double start = monotonic_ns();
+        if (!build_dict_index(&dict)) {
+            free_dictionary(&dict);
+            return 1;
+        }
+        double build_ms = (monotonic_ns() - start) / 1e6;
+
+        // Запросы: половина — слова из словаря, половина — случайные строки
+        wchar_t (*queries)[MAX_WORD_LEN / 8] = malloc(1024 * sizeof(*queries));
+        if (!queries) {
+            free_dictionary(&dict);
+            return 1;
+        }
+        uint32_t qseed = 777;
+        for (size_t i = 0; i < 1024; i++) {
+            if (i % 2 == 0) {
+                mbstowcs(queries[i], dict_word(&dict, bench_rand(&qseed) % dict.count), MAX_WORD_LEN / 8);
+            } else {
+                bench_random_word(&qseed, queries[i]);
+            }
+        }
+
+        size_t hits = 0;
+        start = monotonic_ns();
+        for (size_t i = 0; i < lookups; i++) {
+            hits += is_in_dict(queries[i & 1023], &dict);
+        }
+        double hashed_ns = (monotonic_ns() - start) / lookups;
+
+        uint32_t *index = dict.index;
+        dict.index = NULL;
+        start = monotonic_ns();
+        for (size_t i = 0; i < linear_lookups; i++) {
+            hits += is_in_dict(queries[i & 1023], &dict);
+        }
+        double linear_ns = (monotonic_ns() - start) / linear_lookups;
+        dict.index = index;
+
+        wprintf(L"%7zu слов: индекс %.1f мс (%zu слотов), поиск %.1f нс, линейный поиск %.0f нс (hits %zu), память %zu КБ\n",
+                sizes[s], build_ms, dict.index_mask + 1, hashed_ns, linear_ns, hits, dictionary_memory(&dict) / 1024);
+        free(queries);
+        free_dictionary(&dict);
     }
+    return 0;
 }
 
-/* ========== DICTIONARY FUNCTIONS ========== */
+// Текст, который приложение получит из событий инжектора: нажатия прогоняются через
+// xkb_state, начиная с группы group. Возвращает группу после всех событий
+static int decode_injected(struct xkb_keymap *keymap, const struct input_event *events, size_t count, int group,
+                           wchar_t *out, size_t size) {
+    struct xkb_state *state = inject_state(keymap, group, 0);
+    if (!state) return -1;
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].type != EV_KEY) continue;
+        xkb_keycode_t code = (xkb_keycode_t)events[i].code + 8;
+        if (events[i].value == 1) {
+            uint32_t c = xkb_state_key_get_utf32(state, code);
+            if (c >= 0x20 && c != 0x7F && len + 1 < size) out[len++] = (wchar_t)c;
+        }
+        xkb_state_update_key(state, code, events[i].value ? XKB_KEY_DOWN : XKB_KEY_UP);
+    }
+    out[len] = L'\0';
+    int result = (int)xkb_state_serialize_layout(state, XKB_STATE_LAYOUT_EFFECTIVE);
+    xkb_state_unref(state);
+    return result;
+}
 
-bool load_dictionary(const char *filename, Dictionary *dict) {
-    FILE *file = fopen(filename, "r, ccs=UTF-8");
-    if (!file) {
-        wprintf(L"Ошибка: Не удалось открыть файл словаря %hs\n", filename);
-        return false;
+// Исправление из первой раскладки во вторую: прежний путь (сочетание и пауза, как без X11)
+// против прямой инжекции. Пакет прямой инжекции проверяется прогоном через xkb_state
+// той же keymap, в том числе для знаков, которых нет в раскладке слова
+static int run_direct_inject_benchmark(Injector *injector, int fd, const wchar_t *word) {
+    char names[MAX_LAYOUTS * 17] = "";
+    for (int l = 0; l < layout_set.count; l++) {
+        size_t len = strlen(names);
+        snprintf(names + len, sizeof(names) - len, "%s%s", l ? "," : "", layout_set.layouts[l].name);
     }
-    dict->words = malloc(MAX_DICT_SIZE * sizeof(wchar_t*));
-    if (!dict->words) {
-        fclose(file);
-        return false;
+    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    struct xkb_keymap *keymap = context ? offline_keymap(context, names) : NULL;
+    if (!keymap) {
+        wprintf(L"Ошибка: Не удалось собрать keymap %hs\n", names);
+        if (context) xkb_context_unref(context);
+        return 1;
     }
-    dict->count = 0;
-    wchar_t buffer[MAX_WORD_LEN];
-    while (fgetws(buffer, MAX_WORD_LEN, file) && dict->count < MAX_DICT_SIZE) {
-        size_t len = wcslen(buffer);
-        if (len > 0 && buffer[len-1] == L'\n') {
-            buffer[len-1] = L'\0';
-            len--;
+
+    InjectJob job = {
+        .type = JOB_CORRECTION,
+        .strategy = CORRECT_BACKSPACE,
+        .erase_count = (int)wcslen(word) + 1,
+        .old_group = 0,
+        .new_group = 1,
+        .pacing = default_pacing,
+    };
+    convert_layout(word, job.target, 0, 1);
+    wprintf(L"\nИсправление %ls -> %ls (%hs -> %hs), стирание backspace, без паузы между нажатиями:\n",
+            word, job.target, layout_name(0), layout_name(1));
+    for (int direct = 0; direct <= 1; direct++) {
+        const int rounds = direct ? 1000 : 3;
+        double start = monotonic_ns();
+        for (int r = 0; r < rounds; r++) {
+            init_injector(injector, fd, &default_pacing);
+            injector->direct = direct;
+            execute_job(injector, &job);
         }
-        if (len == 0) continue;
-        dict->words[dict->count] = malloc((len + 1) * sizeof(wchar_t));
-        if (!dict->words[dict->count]) {
-            for (size_t i = 0; i < dict->count; i++) free(dict->words[i]);
-            free(dict->words);
-            fclose(file);
-            return false;
+        wprintf(L"  %-28ls: %9.3f мс, %lu событий, %lu вызовов write\n",
+                direct ? L"прямая инжекция" : L"переключение и пауза", (monotonic_ns() - start) / 1e6 / rounds,
+                injector->events_sent, injector->writes);
+    }
+
+    // Знаки, которых нет в раскладке слова, прежний путь терял; прямой набирает их
+    // в группе, где они есть, и возвращается
+    wchar_t samples[4][MAX_WORD_LEN];
+    wcscpy(samples[0], job.target);
+    swprintf(samples[1], MAX_WORD_LEN, L"%ls, 42", job.target);
+    swprintf(samples[2], MAX_WORD_LEN, L"%ls[]", job.target);
+    swprintf(samples[3], MAX_WORD_LEN, L"%ls {%ls}", job.target, word);
+    int failures = 0;
+    for (size_t k = 0; k < sizeof(samples) / sizeof(samples[0]); k++) {
+        int8_t groups[MAX_WORD_LEN];
+        const int rounds = 100000;
+        int chords = 0;
+        double start = monotonic_ns();
+        for (int r = 0; r < rounds; r++) {
+            chords = plan_injection(samples[k], 0, 1, groups);
+            __asm__ volatile("" ::: "memory");
+        }
+        double plan_ns = (monotonic_ns() - start) / rounds;
+        int lost = 0;
+        for (size_t i = 0; samples[k][i]; i++) {
+            if (samples[k][i] >= CHAR_RANGE || !layout_set.inject[1][samples[k][i]].keycode) lost++;
         }
-        wcscpy(dict->words[dict->count], buffer);
-        dict->count++;
+        init_injector(injector, fd, &default_pacing);
+        wchar_t typed[MAX_WORD_LEN];
+        int group = send_text_direct(injector, samples[k], 0, 1)
+                        ? decode_injected(keymap, injector->events, injector->count, 0, typed, MAX_WORD_LEN)
+                        : -1;
+        bool ok = group == 1 && wcscmp(typed, samples[k]) == 0;
+        failures += !ok;
+        wprintf(L"  %-24ls: сочетаний %d (было %d, терялось символов %d), план %.0f нс, %ls\n",
+                samples[k], chords, layout_set.group_hops[0][1], lost, plan_ns,
+                ok ? L"xkb_state набирает то же" : L"РАСХОЖДЕНИЕ");
+        flush_injector(injector);
     }
-    fclose(file);
-    return true;
+    xkb_keymap_unref(keymap);
+    xkb_context_unref(context);
+    return failures ? 1 : 0;
 }
 
-void free_dictionary(Dictionary *dict) {
-    for (size_t i = 0; i < dict->count; i++) free(dict->words[i]);
-    free(dict->words);
-    dict->words = NULL;
-    dict->count = 0;
+// Исправление слова из 9 букв: стирание и повторный ввод, для каждого
+// способа стирания и темпа. Запись идёт в /dev/null, поэтому измеряется
+// только стоимость самой инжекции (без реакции приложения)
+// Нажатие так, как его отправлял прежний send_key: событие и SYN_REPORT отдельными write
+static void legacy_send_key(int fd, int keycode, int value, unsigned long *writes) {
+    struct input_event ev = { .type = EV_KEY, .code = keycode, .value = value };
+    *writes += write(fd, &ev, sizeof(ev)) == sizeof(ev);
+    ev = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT };
+    *writes += write(fd, &ev, sizeof(ev)) == sizeof(ev);
 }
 
-bool is_in_dict(const wchar_t *word, Dictionary *dict) {
-    for (size_t i = 0; i < dict->count; i++) {
-        if (wcscmp(word, dict->words[i]) == 0) return true;
+int run_inject_benchmark(void) {
+    const wchar_t *word = L"ghbdtnvbh";
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+        perror("Не удалось открыть /dev/null");
+        return 1;
     }
-    return false;
+    static const int delays[] = {KEY_PRESS_DELAY, 1000, 0};
+    static const CorrectionStrategy strategies[] = {CORRECT_SELECT, CORRECT_BACKSPACE, CORRECT_CTRL_BACKSPACE};
+    static Injector injector;
+    for (size_t d = 0; d < sizeof(delays) / sizeof(delays[0]); d++) {
+        for (size_t k = 0; k < sizeof(strategies) / sizeof(strategies[0]); k++) {
+            InjectPacing pacing = default_pacing;
+            pacing.key_delay_us = delays[d];
+            init_injector(&injector, fd, &pacing);
+            double start = monotonic_ns();
+            delete_typed_word(&injector, strategies[k], (int)wcslen(word) + 1);
+            double delete_ms = (monotonic_ns() - start) / 1e6;
+            for (size_t i = 0; word[i]; i++) send_char(&injector, word[i], 0);
+            flush_injector(&injector);
+            double elapsed_ms = (monotonic_ns() - start) / 1e6;
+            wprintf(L"пауза %5d мкс, %-14ls: стирание %8.3f мс, всего %8.3f мс, %lu событий, %lu вызовов write\n",
+                    delays[d], correction_name(strategies[k]), delete_ms, elapsed_ms,
+                    injector.events_sent, injector.writes);
+        }
+    }
+    // Прежняя инжекция (select) прогоняется по-настоящему: два write на событие
+    // и пауза после каждой клавиши
+    unsigned long legacy_writes = 0;
+    double start = monotonic_ns();
+    legacy_send_key(fd, LEFTSHIFT_KEY_CODE, 1, &legacy_writes);
+    for (size_t i = 0; i < wcslen(word) + 1; i++) {
+        legacy_send_key(fd, LEFTARROW_KEY_CODE, 1, &legacy_writes);
+        legacy_send_key(fd, LEFTARROW_KEY_CODE, 0, &legacy_writes);
+        usleep(KEY_PRESS_DELAY);
+    }
+    legacy_send_key(fd, LEFTSHIFT_KEY_CODE, 0, &legacy_writes);
+    legacy_send_key(fd, BACKSPACE_KEY_CODE, 1, &legacy_writes);
+    legacy_send_key(fd, BACKSPACE_KEY_CODE, 0, &legacy_writes);
+    usleep(DELETE_WORD_DELAY);
+    for (size_t i = 0; word[i]; i++) {
+        legacy_send_key(fd, KEY_A, 1, &legacy_writes);
+        legacy_send_key(fd, KEY_A, 0, &legacy_writes);
+        usleep(KEY_PRESS_DELAY);
+    }
+    wprintf(L"до пакетной инжекции (select): всего %8.3f мс, %lu вызовов write\n",
+            (monotonic_ns() - start) / 1e6, legacy_writes);
+    int ret = layout_set.count >= 2 ? run_direct_inject_benchmark(&injector, fd, word) : 0;
+    close(fd);
+    return ret;
 }
 
-/* ========== LAYOUT SWITCHING FUNCTIONS ========== */
+// Конвертация 1 МБ смешанного текста между первыми двумя раскладками: таблицы (по словам
+// и одним буфером) против прежнего поиска символа через wcschr по строке раскладки
+int run_convert_benchmark(void) {
+    if (layout_set.count < 2) {
+        wprintf(L"Нужны хотя бы две раскладки\n");
+        return 1;
+    }
+    // Строки символов обеих раскладок: символ i одной — на той же клавише и уровне, что и другой
+    static wchar_t chars[2][2 * TRIE_KEYS + 1];
+    size_t letters = 0;
+    for (int slot = 0; slot < TRIE_KEYS; slot++) {
+        int code = slot_keycodes[slot];
+        for (int shift = 0; shift < 2; shift++) {
+            wchar_t first = layout_set.layouts[0].chars[shift][code];
+            wchar_t second = layout_set.layouts[1].chars[shift][code];
+            CharKey first_key = first ? layout_set.layouts[0].keys[first] : (CharKey){0, 0};
+            CharKey second_key = second ? layout_set.layouts[1].keys[second] : (CharKey){0, 0};
+            if (first_key.keycode != code || first_key.shift != shift ||
+                second_key.keycode != code || second_key.shift != shift) {
+                continue;
+            }
+            chars[0][letters] = first;
+            chars[1][letters++] = second;
+        }
+    }
+    const wchar_t *eng_chars = chars[0], *rus_chars = chars[1];
+    const size_t count = 1 << 20;
+    wchar_t *text = malloc(count * sizeof(wchar_t));
+    wchar_t *bulk = malloc(count * sizeof(wchar_t));
+    wchar_t *reference = malloc(count * sizeof(wchar_t));
+    if (!text || !bulk || !reference) {
+        free(text);
+        free(bulk);
+        free(reference);
+        return 1;
+    }
+    uint32_t seed = 4242;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t r = bench_rand(&seed) % 16;
+        if (r < 7) text[i] = eng_chars[bench_rand(&seed) % letters];
+        else if (r < 14) text[i] = rus_chars[bench_rand(&seed) % letters];
+        else text[i] = r == 14 ? L' ' : L'7';
+    }
 
-void process_word(wchar_t *word, Dictionary *eng_dict, Dictionary *rus_dict, int uinput_fd, bool use_super_space, int *system_layout, Display *display, struct xkb_state *xkb_state) {
-    if (!word || wcslen(word) == 0) {
-        wprintf(L"Empty word, skipping\n");
-        return;
+    for (int to_russian = 1; to_russian >= 0; to_russian--) {
+        const wchar_t *from = to_russian ? eng_chars : rus_chars;
+        const wchar_t *to = to_russian ? rus_chars : eng_chars;
+        double start = monotonic_ns();
+        for (size_t i = 0; i < count; i++) {
+            const wchar_t *pos = text[i] ? wcschr(from, text[i]) : NULL;
+            reference[i] = pos ? to[pos - from] : text[i];
+        }
+        double wcschr_ms = (monotonic_ns() - start) / 1e6;
+
+        // Слова по 8 символов через convert_layout, как в process_word
+        wchar_t word[9], converted[9];
+        start = monotonic_ns();
+        for (size_t i = 0; i + 8 <= count; i += 8) {
+            wmemcpy(word, text + i, 8);
+            word[8] = L'\0';
+            convert_layout(word, converted, !to_russian, to_russian);
+            wmemcpy(bulk + i, converted, 8);
+        }
+        double words_ms = (monotonic_ns() - start) / 1e6;
+
+        start = monotonic_ns();
+        convert_layout_bulk(text, bulk, count, !to_russian, to_russian);
+        double bulk_ms = (monotonic_ns() - start) / 1e6;
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < count; i++) mismatches += bulk[i] != reference[i];
+        wprintf(L"%hs->%hs: wcschr %.2f мс, таблица по словам %.2f мс, буфер целиком %.2f мс (%ls), расхождений %zu\n",
+                layout_name(!to_russian), layout_name(to_russian), wcschr_ms, words_ms, bulk_ms,
+#ifdef __AVX2__
+                L"AVX2",
+#else
+                L"скаляр",
+#endif
+                mismatches);
     }
+    free(text);
+    free(bulk);
+    free(reference);
+    return 0;
+}
 
-    wprintf(L"Processing word: %ls\n", word);
+// Точность модели на отложенных словах: модель обучается без каждого 10-го слова
+// словарей, затем классифицирует эти слова как есть и с одной случайной опечаткой.
+// Перевес — оценка своей раскладки минус лучшая из остальных. Для нескольких порогов
+// перевеса — доля верных, неверных (ложное исправление) и нерешённых слов, а также
+// время оценки одного слова сразу для всех раскладок
+int run_ngram_benchmark(void) {
+    enum { HOLDOUT = 10, THRESHOLDS = 5 };
+    static const int32_t thresholds[THRESHOLDS] = {
+        NGRAM_SCALE / 2, NGRAM_SCALE, NGRAM_SCALE * 3 / 2, NGRAM_SCALE * 2, NGRAM_SCALE * 3
+    };
+    Dictionary dicts[MAX_LAYOUTS] = {0};
+    NgramModel model = { .layouts = layout_set.count, .symbols = layout_set.symbol_count + 1 };
+    size_t tables_size = model.layouts * ngram_table_size(model.symbols) * sizeof(int16_t);
+    int16_t *logprob = malloc(tables_size);
+    if (!logprob || !load_layout_dictionaries(dicts)) {
+        free(logprob);
+        return 1;
+    }
+    double start = monotonic_ns();
+    bool ok = train_ngram_model(logprob, dicts, HOLDOUT);
+    double train_ms = (monotonic_ns() - start) / 1e6;
+    if (!ok) {
+        free(logprob);
+        free_layout_dictionaries(dicts);
+        return 1;
+    }
+    model.logprob = logprob;
+    for (int l = 0; l < layout_set.count; l++) {
+        if (dicts[l].count > 0) model.trained |= 1u << l;
+    }
+    wprintf(L"Обучение: %.1f мс, таблицы %zu КБ (%d раскладок, %d символов)\n", train_ms, tables_size / 1024,
+            model.layouts, model.symbols);
 
-    // Обновляем раскладку перед обработкой слова
-    update_system_layout(display, system_layout);
-    wprintf(L"System layout before processing: %d (%ls)\n", *system_layout, *system_layout == 0 ? L"us" : L"ru");
+    uint32_t seed = 99;
+    wchar_t word[MAX_WORD_LEN];
+    uint8_t keys[MAX_WORD_LEN];
+    for (int typo = 0; typo < 2; typo++) {
+        size_t total = 0, right[THRESHOLDS] = {0}, wrong[THRESHOLDS] = {0};
+        double score_ns = 0;
+        for (int lang = 0; lang < layout_set.count; lang++) {
+            const Dictionary *dict = &dicts[lang];
+            if (!((model.trained >> lang) & 1)) continue;
+            for (size_t i = 0; i < dict->count; i += HOLDOUT) {
+                size_t len;
+                utf8_decode_word(dict_word(dict, i), word, MAX_WORD_LEN);
+                if (!ngram_word_keys(word, lang, keys, &len) || len < NGRAM_MIN_LEN) continue;
+                if (typo) keys[bench_rand(&seed) % len] = (uint8_t)(bench_rand(&seed) % layout_set.symbol_count);
+                int32_t margin = 0;
+                start = monotonic_ns();
+                for (int r = 0; r < 100; r++) {
+                    ngram_best(&model, keys, len, model.trained & ~(1u << lang), lang, &margin);
+                    __asm__ volatile("" ::: "memory");
+                }
+                score_ns += (monotonic_ns() - start) / 100;
+                total++;
+                // margin — перевес лучшей чужой раскладки над своей, верный знак — отрицательный
+                for (int t = 0; t < THRESHOLDS; t++) {
+                    if (-margin >= thresholds[t]) right[t]++;
+                    else if (margin >= thresholds[t]) wrong[t]++;
+                }
+            }
+        }
+        if (total == 0) break;
+        wprintf(L"%ls: %zu отложенных слов, оценка слова %.1f нс\n",
+                typo ? L"С опечаткой" : L"Без опечаток", total, score_ns / total);
+        for (int t = 0; t < THRESHOLDS; t++) {
+            wprintf(L"  порог %.1f бит/символ%ls: верно %5.1f%%, неверно %4.1f%%, не решено %4.1f%%\n",
+                    thresholds[t] / (double)NGRAM_SCALE, thresholds[t] == NGRAM_MARGIN ? L" (текущий)" : L"",
+                    100.0 * right[t] / total, 100.0 * wrong[t] / total,
+                    100.0 * (total - right[t] - wrong[t]) / total);
+        }
+    }
+    free(logprob);
+    free_layout_dictionaries(dicts);
+    return 0;
+}
 
-    int layout = detect_word_layout(word, *system_layout);
-    const wchar_t *layout_name;
-    switch (layout) {
-        case 1: layout_name = L"English"; break;
-        case 2: layout_name = L"Russian"; break;
+// Случайная опечатка в клавишах слова: замена, пропуск, лишняя клавиша или перестановка соседних
+static size_t bench_typo(uint32_t *seed, uint8_t *keys, size_t len, const uint8_t *letters, int letter_count) {
+    size_t pos = bench_rand(seed) % len;
+    uint8_t key = letters[bench_rand(seed) % letter_count];
+    switch (bench_rand(seed) % 4) {
         case 0:
-            wprintf(L"Ambiguous or unsupported word layout, skipping\n");
-            return;
+            keys[pos] = key;
+            return len;
+        case 1:
+            memmove(keys + pos, keys + pos + 1, len - pos - 1);
+            return len - 1;
+        case 2:
+            memmove(keys + pos + 1, keys + pos, len - pos);
+            keys[pos] = key;
+            return len + 1;
         default:
-            wprintf(L"Unexpected layout value, skipping\n");
-            return;
+            if (pos + 1 < len) {
+                uint8_t t = keys[pos];
+                keys[pos] = keys[pos + 1];
+                keys[pos + 1] = t;
+            }
+            return len;
     }
-    wprintf(L"Detected layout: %ls\n", layout_name);
-
-    wchar_t converted_word[MAX_WORD_LEN];
-    convert_layout(word, converted_word, layout == 1);
+}
 
-    bool word_found = false;
-    const wchar_t *target_word = NULL;
-    bool target_is_russian = false;
+// Нечёткий поиск: слова словарей с одной опечаткой, набранные в чужой и в своей раскладке, —
+// решения модели n-грамм без индекса и с ним; затем задержка поиска на словарях 10k / 100k слов
+int run_fuzzy_benchmark(void) {
+    uint8_t letters[TRIE_KEYS];
+    int letter_count = 0;
+    for (int slot = 0; slot < TRIE_KEYS; slot++) {
+        if ((layout_set.letter_keys >> slot) & 1) letters[letter_count++] = (uint8_t)slot;
+    }
+    DictSet set = {0};
+    if (letter_count == 0 || !load_dict_set(&set)) return 1;
+    const NgramModel *model = set.ngram.logprob ? &set.ngram : NULL;
 
-    if (layout == 1) {
-        if (is_in_dict(converted_word, rus_dict)) {
-            word_found = true;
-            target_word = converted_word;
-            target_is_russian = true;
+    uint32_t seed = 4242;
+    size_t total = 0, right[2] = {0}, wrong[2] = {0}, kept[2] = {0}, false_fixes[2] = {0};
+    uint8_t keys[FUZZY_MAX_KEYS + 2];
+    wchar_t word[MAX_WORD_LEN];
+    for (int lang = 0; lang < layout_set.count; lang++) {
+        const Dictionary *dict = &set.dicts[lang];
+        for (size_t i = 0; i < dict->count; i += 10) {
+            size_t len = utf8_decode_word(dict_word(dict, i), word, MAX_WORD_LEN);
+            if (len < FUZZY_MIN_LEN || len > FUZZY_MAX_KEYS) continue;
+            size_t j;
+            for (j = 0; j < len && char_to_key(word[j], lang) >= 0; j++) keys[j] = (uint8_t)char_to_key(word[j], lang);
+            if (j < len) continue;
+            len = bench_typo(&seed, keys, len, letters, letter_count);
+            uint32_t node = TRIE_ROOT;
+            for (j = 0; j < len; j++) node = trie_step(&set.trie, node, keys[j]);
+            if (trie_flags(&set.trie, node) & TRIE_WORDS) continue;  // опечатка дала другое слово словаря
+            total++;
+            for (int typed = 0; typed < layout_set.count; typed++) {
+                for (j = 0; j < len; j++) word[j] = layout_set.layouts[typed].chars[0][slot_keycodes[keys[j]]];
+                word[len] = L'\0';
+                uint32_t others = ((1u << layout_set.count) - 1) & ~(1u << typed);
+                for (int fuzzy = 0; fuzzy < 2; fuzzy++) {
+                    int target = fuzzy ? fuzzy_word_layout(&set.fuzzy, model, word, typed, others) : -1;
+                    if (target < 0) target = detect_word_layout(model, word, typed, others);
+                    if (typed == lang) {
+                        if (target < 0) kept[fuzzy]++;
+                        else false_fixes[fuzzy]++;
+                    } else if (target == lang) {
+                        right[fuzzy]++;
+                    } else if (target >= 0) {
+                        wrong[fuzzy]++;
+                    }
+                }
+            }
         }
-    } else if (layout == 2) {
-        if (is_in_dict(converted_word, eng_dict)) {
-            word_found = true;
-            target_word = converted_word;
-            target_is_russian = false;
+    }
+    if (total > 0) {
+        size_t foreign = total * (layout_set.count - 1);
+        wprintf(L"%zu слов с опечаткой, %zu наборов в чужой раскладке\n", total, foreign);
+        for (int fuzzy = 0; fuzzy < 2; fuzzy++) {
+            wprintf(L"  %-22ls чужая раскладка: исправлено %5.1f%%, не туда %4.1f%%; своя: оставлено %5.1f%%, "
+                    L"лишних исправлений %4.1f%%\n", fuzzy ? L"индекс + модель n-грамм" : L"модель n-грамм",
+                    100.0 * right[fuzzy] / foreign, 100.0 * wrong[fuzzy] / foreign, 100.0 * kept[fuzzy] / total,
+                    100.0 * false_fixes[fuzzy] / total);
         }
     }
+    free_dict_set(&set);
 
-    if (word_found) {
-        wprintf(L"Found in %ls dictionary: %ls, selecting and deleting %d chars\n",
-                layout == 1 ? L"Russian" : L"English", target_word, (int)wcslen(word) + 1);
-        select_and_delete_word(uinput_fd, wcslen(word));
-        switch_layout(display, uinput_fd, use_super_space, system_layout);
-        sync_xkb_state(xkb_state, *system_layout);
-        wprintf(L"Inputting word: %ls\n", target_word);
-        for (size_t i = 0; i < wcslen(target_word); i++) {
-            send_char(uinput_fd, target_word[i], target_is_russian);
+    // Задержка: синтетические словари первой раскладки, запросы — слова с одной-двумя
+    // опечатками (половина) и случайные строки
+    static const size_t sizes[] = {10000, 100000};
+    enum { QUERIES = 20000 };
+    static double latencies[QUERIES];
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        Dictionary dicts[MAX_LAYOUTS] = {0};
+        FuzzyIndex index;
+        if (!bench_fill_dictionary(&dicts[0], sizes[s], 12345)) {
+            free_dictionary(&dicts[0]);
+            return 1;
         }
-    } else {
-        wprintf(L"No match in %ls dictionary\n", layout == 1 ? L"Russian" : L"English");
+        double start = monotonic_ns();
+        bool ok = build_fuzzy_index(&index, dicts);
+        double build_ms = (monotonic_ns() - start) / 1e6;
+        if (!ok || index.count == 0) {
+            wprintf(L"Символы синтетического словаря не набираются в раскладке %hs\n", layout_name(0));
+            free_fuzzy_index(&index);
+            free_dictionary(&dicts[0]);
+            return 1;
+        }
+        uint32_t qseed = 777;
+        size_t hits = 0;
+        for (size_t q = 0; q < QUERIES; q++) {
+            size_t len;
+            if (q % 2 == 0) {
+                uint32_t w = bench_rand(&qseed) % index.count;
+                len = index.offsets[w + 1] - index.offsets[w];
+                memcpy(keys, index.keys + index.offsets[w], len);
+                for (int e = 0; e < 1 + (int)(q % 4 == 0) && len > 2; e++) {
+                    len = bench_typo(&qseed, keys, len, letters, letter_count);
+                }
+            } else {
+                len = 3 + bench_rand(&qseed) % 10;
+                for (size_t k = 0; k < len; k++) keys[k] = letters[bench_rand(&qseed) % letter_count];
+            }
+            uint8_t distance[MAX_LAYOUTS];
+            start = monotonic_ns();
+            hits += fuzzy_lookup(&index, keys, len, fuzzy_max_distance(len), distance) != 0;
+            latencies[q] = monotonic_ns() - start;
+        }
+        qsort(latencies, QUERIES, sizeof(double), compare_doubles);
+        wprintf(L"%7zu слов: индекс %.1f мс, %zu вариантов, %zu КБ; поиск p50 %.2f мкс, p99 %.2f мкс, "
+                L"p99.9 %.2f мкс, max %.2f мкс (найдено %zu из %d)\n", sizes[s], build_ms, index.entries,
+                fuzzy_index_memory(&index) / 1024, latencies[QUERIES / 2] / 1e3, latencies[QUERIES * 99 / 100] / 1e3,
+                latencies[QUERIES * 999 / 1000] / 1e3, latencies[QUERIES - 1] / 1e3, hits, QUERIES);
+        free_fuzzy_index(&index);
+        free_dictionary(&dicts[0]);
     }
+    return 0;
 }
 
-/* ========== INPUT DEVICE FUNCTIONS ========== */
+// Конвертация выделения: около мегабайта текста из слов словарей, половина набрана
+// в чужой раскладке. Время пути выделения целиком (UTF-8 -> wchar_t -> решения по
+// словам -> UTF-8), доля слов, ставших как в исходном тексте, и сколько событий
+// понадобилось бы, чтобы перенабрать тот же текст по символу вместо одной вставки
+int run_selection_benchmark(void) {
+    enum { WORDS = 1 << 17 };
+    DictSet set = {0};
+    if (layout_set.count < 2 || !load_dict_set(&set)) return 1;
+    Switcher sw = {0};
+    use_dict_set(&sw, &set);
 
-int setup_uinput_device(int *uinput_fd) {
-    *uinput_fd = open(UINPUT_DEVICE, O_WRONLY | O_NONBLOCK);
-    if (*uinput_fd < 0) {
-        perror("Не удалось открыть /dev/uinput");
-        return -1;
+    size_t capacity = (size_t)WORDS * MAX_WORD_LEN;
+    wchar_t *expected = malloc(capacity * sizeof(wchar_t));
+    wchar_t *text = malloc(capacity * sizeof(wchar_t));
+    char *utf8 = malloc(capacity * 4 + 1);
+    if (!expected || !text || !utf8) {
+        free(expected);
+        free(text);
+        free(utf8);
+        free_dict_set(&set);
+        return 1;
+    }
+    uint32_t seed = 4242;
+    size_t len = 0, swapped = 0;
+    wchar_t word[MAX_WORD_LEN];
+    for (size_t w = 0; w < WORDS;) {
+        int lang = (int)(bench_rand(&seed) % layout_set.count);
+        const Dictionary *dict = &set.dicts[lang];
+        if (dict->count == 0) continue;
+        size_t word_len = utf8_decode_word(dict_word(dict, bench_rand(&seed) % dict->count), word, MAX_WORD_LEN);
+        if (word_len == 0 || text_word_layout(word, word_len) != lang) continue;
+        wmemcpy(expected + len, word, word_len);
+        if (bench_rand(&seed) % 2) {
+            int typed = (lang + 1 + (int)(bench_rand(&seed) % (layout_set.count - 1))) % layout_set.count;
+            convert_layout_bulk(word, text + len, word_len, lang, typed);
+            swapped++;
+        } else {
+            wmemcpy(text + len, word, word_len);
+        }
+        len += word_len;
+        expected[len] = text[len] = L' ';
+        len++;
+        w++;
     }
+    text[len] = expected[len] = L'\0';
+    size_t utf8_len = utf8_encode_word(text, utf8, capacity * 4 + 1);
 
-    ioctl(*uinput_fd, UI_SET_EVBIT, EV_KEY);
-    ioctl(*uinput_fd, UI_SET_EVBIT, EV_SYN);
-    for (int i = 0; i < 256; ++i) ioctl(*uinput_fd, UI_SET_KEYBIT, i);
-
-    struct uinput_user_dev uidev = {0};
-    snprintf(uidev.name, UINPUT_MAX_NAME_SIZE, "virtual-keyboard");
-    uidev.id.bustype = BUS_USB;
-    uidev.id.vendor  = 0x1234;
-    uidev.id.product = 0xfedc;
-    uidev.id.version = 1;
-
-    write(*uinput_fd, &uidev, sizeof(uidev));
-    ioctl(*uinput_fd, UI_DEV_CREATE);
-    sleep(1);
+    // Как в finish_selection: декодирование, конвертация на месте, кодирование
+    double start = monotonic_ns();
+    size_t decoded = utf8_decode_word(utf8, text, capacity);
+    double decode_ms = (monotonic_ns() - start) / 1e6;
+    start = monotonic_ns();
+    size_t corrected = convert_text(&sw, text, text, decoded);
+    double convert_ms = (monotonic_ns() - start) / 1e6;
+    start = monotonic_ns();
+    size_t out_len = utf8_encode_word(text, utf8, capacity * 4 + 1);
+    double encode_ms = (monotonic_ns() - start) / 1e6;
+
+    size_t right = 0, words = 0;
+    for (size_t i = 0; i < decoded;) {
+        size_t end = i;
+        while (end < decoded && text[end] != L' ') end++;
+        words++;
+        right += wmemcmp(text + i, expected + i, end - i) == 0;
+        i = end + 1;
+    }
+    wprintf(L"%zu слов, %zu символов, %zu КБ UTF-8 (%zu КБ после), в чужой раскладке %zu\n", words, decoded,
+            utf8_len / 1024, out_len / 1024, swapped);
+    wprintf(L"Декодирование %.2f мс, решения по словам %.2f мс (%.0f нс на слово), кодирование %.2f мс; "
+            L"всего %.2f мс\n", decode_ms, convert_ms, convert_ms * 1e6 / words, encode_ms,
+            decode_ms + convert_ms + encode_ms);
+    wprintf(L"Исправлено %zu слов, как в исходном тексте %zu из %zu (%.2f%%)\n", corrected, right, words,
+            100.0 * right / words);
+    // Нажатие и отпускание на символ и столько же на стирание против Ctrl + V
+    wprintf(L"Событий клавиатуры: по символу не меньше %zu, вставка 4\n", decoded * 4);
+    free(expected);
+    free(text);
+    free(utf8);
+    free_dict_set(&set);
     return 0;
 }
 
 /* ========== MAIN FUNCTION ========== */
 
-int main() {
+int main(int argc, char *argv[]) {
     setlocale(LC_ALL, "");
 
-    bool use_super_space = false;
-    FILE *gsettings_pipe = popen("gsettings get org.gnome.desktop.input-sources xkb-options", "r");
-    if (gsettings_pipe) {
-        char buffer[256];
-        if (fgets(buffer, sizeof(buffer), gsettings_pipe)) {
-            if (strstr(buffer, "win_space_toggle")) {
-                use_super_space = true;
-                wprintf(L"Detected Super + Space for layout switching\n");
-            } else {
-                wprintf(L"Using Shift + Alt for layout switching\n");
+    // --layouts us,ru,ua действует и на режимы ниже, поэтому разбирается до них
+    const char *layouts_arg = NULL;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--layouts") == 0) {
+            layouts_arg = argv[i + 1];
+            memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(char *));
+            argc -= 2;
+            break;
+        }
+    }
+    // Прогонам, обучению и замерам X11 не нужен: раскладки собираются по именам
+    const char *mode = argc > 1 ? argv[1] : "";
+    bool offline = (strncmp(mode, "--bench-", 8) == 0 && strcmp(mode, "--bench-dict") != 0) ||
+                   strcmp(mode, "--train-ngram") == 0 || strncmp(mode, "--replay", 8) == 0 ||
+                   strcmp(mode, "--make-corpus") == 0;
+    if (offline && !init_layouts(layouts_arg ? layouts_arg : DEFAULT_LAYOUTS)) return 1;
+
+    if (argc > 1 && strcmp(argv[1], "--bench-dict") == 0) {
+        return run_dict_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-inject") == 0) {
+        return run_inject_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-convert") == 0) {
+        return run_convert_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-fuzzy") == 0) {
+        return run_fuzzy_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-selection") == 0) {
+        return run_selection_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-ngram") == 0) {
+        return run_ngram_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--train-ngram") == 0) {
+        return train_ngram_file();
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        const char *labels = argc > 3 && strncmp(argv[3], "--", 2) != 0 ? argv[3] : NULL;
+        const char *last = argv[argc - 1];
+        int layout = strncmp(last, "--layout=", 9) == 0 ? find_layout(last + 9) : 0;
+        if (layout < 0) {
+            fprintf(stderr, "Нет раскладки %s (раскладки задаются --layouts)\n", last + 9);
+            return 1;
+        }
+        return run_replay(argv[2], labels, NULL, layout);
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay-corpus") == 0) {
+        return run_replay(NULL, NULL, argv[2], 0);
+    }
+    if (argc > 2 && strcmp(argv[1], "--make-corpus") == 0) {
+        return make_replay_corpus(argv[2]);
+    }
+    if (argc > 2 && strcmp(argv[1], "--compile-dict") == 0) {
+        int ret = 0;
+        for (int i = 2; i < argc && ret == 0; i++) ret = compile_dictionary(argv[i], NULL);
+        return ret;
+    }
+
+    // Настройки: значения по умолчанию, файл конфигурации (--config или стандартный путь),
+    // затем аргументы. Прежние флаги — те же ключи, что в файле; --set КЛЮЧ=ЗНАЧЕНИЕ — любой
+    static Config config;
+    default_config(&config);
+    char config_path[PATH_MAX];
+    default_config_path(config_path, sizeof(config_path));
+    bool explicit_config = false;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--config") == 0) {
+            snprintf(config_path, sizeof(config_path), "%s", argv[i + 1]);
+            explicit_config = true;
+        }
+    }
+    if (!load_config(&config, config_path, explicit_config)) return 1;
+    if (layouts_arg) snprintf(config.layouts, sizeof(config.layouts), "%s", layouts_arg);
+    static const struct { const char *flag; const char *key; } flag_settings[] = {
+        {"--key-delay", "key_delay"}, {"--correction", "correction"}, {"--log-level", "log_level"},
+        {"--device", "device"}, {"--inject", "inject"}, {"--learn-file", "learn_file"},
+        {"--stats-socket", "stats_socket"},
+    };
+    for (int i = 1; i < argc; i++) {
+        const char *key = NULL;
+        char setting[128];
+        for (size_t f = 0; f < sizeof(flag_settings) / sizeof(flag_settings[0]); f++) {
+            if (strcmp(argv[i], flag_settings[f].flag) == 0) key = flag_settings[f].key;
+        }
+        if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        if (i + 1 < argc && (strcmp(argv[i], "--app-correction") == 0 || strcmp(argv[i], "--set") == 0)) {
+            // --app-correction CLASS=способ, например firefox=ctrl-backspace;
+            // --set КЛЮЧ=ЗНАЧЕНИЕ, например firefox:key_delay=2000
+            bool app = strcmp(argv[i], "--app-correction") == 0;
+            char *eq = strchr(argv[++i], '=');
+            if (!eq || (size_t)(eq - argv[i]) >= sizeof(setting) - 16) {
+                fprintf(stderr, "Неверный аргумент: %s (ожидается %s)\n", argv[i], app ? "CLASS=способ" : "КЛЮЧ=ЗНАЧЕНИЕ");
+                return 1;
+            }
+            snprintf(setting, sizeof(setting), "%.*s%s", (int)(eq - argv[i]), argv[i], app ? ":correction" : "");
+            key = setting;
+            const char *error = apply_setting(&config, key, eq + 1, false);
+            if (error) {
+                fprintf(stderr, "%s: %s\n", argv[i], error);
+                return 1;
+            }
+        } else if (key && i + 1 < argc) {
+            const char *error = apply_setting(&config, key, argv[++i], false);
+            if (error) {
+                fprintf(stderr, "%s %s: %s\n", argv[i - 1], argv[i], error);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Неизвестный аргумент: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    const char *device_paths[MAX_INPUT_DEVICES];
+    for (int d = 0; d < config.device_count; d++) device_paths[d] = config.devices[d];
+    int device_path_count = config.device_count;
+    // Словари, их индексы и модель n-грамм ищутся в текущем каталоге: переходим в dict_dir,
+    // а относительный путь журнала обучения отсчитываем от прежнего
+    if (config.dict_dir[0]) {
+        char path[PATH_MAX];
+        if (config.learn_file[0] != '/' && getcwd(path, sizeof(path))) {
+            size_t len = strlen(path);
+            if (len + strlen(config.learn_file) + 2 > sizeof(path)) {
+                fprintf(stderr, "Слишком длинный путь журнала обучения\n");
+                return 1;
             }
+            path[len] = '/';
+            strcpy(path + len + 1, config.learn_file);
+            strcpy(config.learn_file, path);
+        }
+        if (chdir(config.dict_dir) < 0) {
+            perror(config.dict_dir);
+            return 1;
         }
-        pclose(gsettings_pipe);
     }
 
     Display *display = XOpenDisplay(NULL);
     if (display) {
+        // Обработчик общий для всех соединений, включая соединение инжектора
+        XSetErrorHandler(ignore_window_errors);
         wprintf(L"X11 display initialized\n");
     } else {
         wprintf(L"Running in Wayland, X11 unavailable\n");
     }
 
+    bool use_super_space = config.switch_hotkey == HOTKEY_AUTO ? detect_super_space(display)
+                                                               : config.switch_hotkey == HOTKEY_SUPER_SPACE;
+    wprintf(use_super_space ? L"Detected Super + Space for layout switching\n"
+                            : L"Using Shift + Alt for layout switching\n");
+
     struct xkb_context *xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
     if (!xkb_context) {
         wprintf(L"Ошибка: Не удалось создать xkb_context\n");
@@ -485,19 +6526,36 @@ int main() {
         return 1;
     }
 
-    const char *rules = "evdev";
-    const char *model = "pc105";
-    const char *layout = "us,ru";
-    const char *variant = "";
-    const char *options = use_super_space ? "grp:win_space_toggle" : "grp:alt_shift_toggle";
-    struct xkb_rule_names names = { rules, model, layout, variant, options };
+    // Раскладки сервера X11 или GNOME в порядке групп; настройка layouts (--layouts) важнее
+    char layout_names[128], layout_variants[128] = "";
+    if (config.layouts[0]) {
+        snprintf(layout_names, sizeof(layout_names), "%s", config.layouts);
+    } else if (get_x11_layout_names(display, layout_names, sizeof(layout_names),
+                                    layout_variants, sizeof(layout_variants))) {
+        wprintf(L"Раскладки X11: %hs\n", layout_names);
+    } else if (get_gsettings_layout_names(layout_names, sizeof(layout_names),
+                                          layout_variants, sizeof(layout_variants))) {
+        wprintf(L"Раскладки GNOME: %hs\n", layout_names);
+    } else {
+        snprintf(layout_names, sizeof(layout_names), "%s", DEFAULT_LAYOUTS);
+        layout_variants[0] = '\0';
+        wprintf(L"Раскладки не определены, используются %hs\n", layout_names);
+    }
+
+    const char *options = config.xkb_options[0] ? config.xkb_options
+                        : use_super_space ? "grp:win_space_toggle" : "grp:alt_shift_toggle";
+    struct xkb_rule_names names = { config.xkb_rules, config.xkb_model, layout_names, layout_variants, options };
     struct xkb_keymap *xkb_keymap = xkb_keymap_new_from_names(xkb_context, &names, XKB_KEYMAP_COMPILE_NO_FLAGS);
-    if (!xkb_keymap) {
-        wprintf(L"Ошибка: Не удалось создать xkb_keymap\n");
+    if (!xkb_keymap || !build_layout_set(&layout_set, xkb_keymap, layout_names)) {
+        wprintf(L"Ошибка: Не удалось создать xkb_keymap для раскладок %hs\n", layout_names);
+        if (xkb_keymap) xkb_keymap_unref(xkb_keymap);
         xkb_context_unref(xkb_context);
         if (display) XCloseDisplay(display);
         return 1;
     }
+    for (int l = 0; l < layout_set.count; l++) {
+        wprintf(L"Группа %d: %hs, словарь %hs\n", l, layout_set.layouts[l].name, layout_set.layouts[l].dict_file);
+    }
 
     struct xkb_state *xkb_state = xkb_state_new(xkb_keymap);
     if (!xkb_state) {
@@ -515,152 +6573,142 @@ int main() {
     if (system_layout >= 0) {
         sync_xkb_state(xkb_state, system_layout);
     } else {
-        wprintf(L"Could not determine initial layout, defaulting to us\n");
+        wprintf(L"Could not determine initial layout, defaulting to %hs\n", layout_name(0));
         system_layout = 0;
     }
 
-    Dictionary eng_dict = {0}, rus_dict = {0};
     wprintf(L"Загрузка словарей...\n");
-    if (!load_dictionary(DICT_FILE_ENG, &eng_dict) || !load_dictionary(DICT_FILE_RUS, &rus_dict)) {
-        xkb_state_unref(xkb_state);
-        xkb_keymap_unref(xkb_keymap);
-        xkb_context_unref(xkb_context);
-        if (display) XCloseDisplay(display);
-        free_dictionary(&eng_dict);
-        free_dictionary(&rus_dict);
-        return 1;
-    }
-
-    int input_fd = open(INPUT_DEVICE, O_RDONLY | O_NONBLOCK);
-    if (input_fd < 0) {
-        perror("Не удалось открыть устройство ввода");
+    DictSet *dict_set = calloc(1, sizeof(DictSet));
+    if (!dict_set || !load_dict_set(dict_set)) {
+        free(dict_set);
         xkb_state_unref(xkb_state);
         xkb_keymap_unref(xkb_keymap);
         xkb_context_unref(xkb_context);
         if (display) XCloseDisplay(display);
-        free_dictionary(&eng_dict);
-        free_dictionary(&rus_dict);
         return 1;
     }
+    static DictStore dict_store = { .inotify_fd = -1, .stop_fd = -1 };
+    atomic_init(&dict_store.current, dict_set);
+    atomic_init(&dict_store.hazard, NULL);
+    atomic_store(&metrics.dict_memory, dict_set_memory(dict_set));
 
+    static unsigned char uinput_keys[KEY_BITS_SIZE];
+    uinput_key_bits(uinput_keys, device_paths, device_path_count);
     int uinput_fd;
-    if (setup_uinput_device(&uinput_fd) < 0) {
-        close(input_fd);
+    if (setup_uinput_device(&uinput_fd, uinput_keys) < 0) {
         xkb_state_unref(xkb_state);
         xkb_keymap_unref(xkb_keymap);
         xkb_context_unref(xkb_context);
         if (display) XCloseDisplay(display);
-        free_dictionary(&eng_dict);
-        free_dictionary(&rus_dict);
+        free_dict_set(dict_set);
+        free(dict_set);
         return 1;
     }
+    static Injector injector;
+    init_injector(&injector, uinput_fd, &config.profiles.defaults.pacing);
+    // XkbLockGroup вызывается из потока инжекции, у него своё соединение с X11
+    injector.display = display ? XOpenDisplay(NULL) : NULL;
+    injector.use_super_space = use_super_space;
+    // Под X11 XkbLockGroup не зависит от того, угадано ли сочетание в keymap сервера,
+    // поэтому прямая инжекция там только по --inject direct
+    injector.direct = config.inject[0] ? strcmp(config.inject, "direct") == 0 : !injector.display;
+    if (injector.direct && !layout_set.direct_switch) {
+        wprintf(L"В keymap нет сочетаний между всеми группами, раскладка переключается как раньше\n");
+        injector.direct = false;
+    }
+    wprintf(L"Инжекция: %ls\n", injector.direct ? L"прямая, группа переключается сочетаниями keymap в пакете"
+                                                 : injector.display ? L"XkbLockGroup" : L"сочетание с паузой");
 
-    wprintf(L"Слушаю ввод... Нажмите ESC для выхода.\n");
-
-    struct input_event ev;
-    wchar_t word[MAX_WORD_LEN] = {0};
-    int word_len = 0;
-    bool shift_pressed = false;
-    bool alt_pressed = false;
-    bool super_pressed = false;
-    fd_set read_fds;
-    struct timeval tv;
-
-    while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(input_fd, &read_fds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 10000;
-
-        int ret = select(input_fd + 1, &read_fds, NULL, NULL, &tv);
-        if (ret < 0) {
-            perror("select failed");
-            break;
-        }
-        if (ret == 0 || !FD_ISSET(input_fd, &read_fds)) continue;
-
-        if (read(input_fd, &ev, sizeof(ev)) != sizeof(ev)) continue;
-
-        if (ev.type == EV_KEY && ev.value == 1) {
-            if (ev.code == LEFTSHIFT_KEY_CODE) {
-                shift_pressed = true;
-            } else if (ev.code == LEFTALT_KEY_CODE) {
-                alt_pressed = true;
-            } else if (ev.code == LEFTMETA_KEY_CODE) {
-                super_pressed = true;
-            } else if (ev.code == ESC_KEY_CODE) {
-                wprintf(L"ESC нажат. Выход.\n");
-                break;
-            } else if (ev.code == SPACE_KEY_CODE) {
-                if (word_len > 0) {
-                    word[word_len] = L'\0';
-                    process_word(word, &eng_dict, &rus_dict, uinput_fd, use_super_space, &system_layout, display, xkb_state);
-                    word_len = 0;
-                    memset(word, 0, sizeof(word));
-                }
-                send_key(uinput_fd, SPACE_KEY_CODE, 1);
-                send_key(uinput_fd, SPACE_KEY_CODE, 0);
-                wprintf(L"Space pressed, processed word\n");
-            } else if (ev.code == BACKSPACE_KEY_CODE) {
-                if (word_len > 0) {
-                    word[--word_len] = L'\0';
-                    wprintf(L"Backspace pressed, removed last char, word_len: %d\n", word_len);
-                }
-            } else {
-                // Обновляем раскладку перед добавлением символа
-                update_system_layout(display, &system_layout);
-                wprintf(L"System layout before adding char: %d (%ls)\n", system_layout, system_layout == 0 ? L"us" : L"ru");
-
-                wchar_t c = L'\0';
-                bool found = false;
-                for (size_t i = 0; i < sizeof(key_map) / sizeof(key_map[0]); i++) {
-                    if (key_map[i].key_code == ev.code) {
-                        c = key_map[i].eng_char;
-                        found = true;
-                        break;
-                    }
-                }
-                if (found && word_len < MAX_WORD_LEN - 1) {
-                    if (system_layout == 1) {
-                        const wchar_t *pos = wcschr(eng_chars, c);
-                        if (pos) {
-                            c = rus_chars[pos - eng_chars];
-                        }
-                    }
-                    if (iswalpha(c)) {
-                        word[word_len++] = c;
-                        wprintf(L"Added char: %lc (U+%04X), word_len: %d, system_layout: %d (%ls)\n",
-                                c, (unsigned int)c, word_len, system_layout, system_layout == 0 ? L"us" : L"ru");
-                    }
-                }
-            }
+    Switcher sw = {
+        .dict_store = &dict_store,
+        .injector = &injector,
+        .config = &config,
+        .use_super_space = use_super_space,
+        .system_layout = system_layout,
+        .display = display,
+        .xkb_state = xkb_state,
+        .stats_socket = config.stats_socket[0] ? config.stats_socket : NULL,
+    };
+    use_dict_set(&sw, dict_set);
+    static LearnStore learn_store;
+    open_learn_store(&learn_store, config.learn_file);
+    sw.learn = &learn_store;
+    if (start_dict_watcher(&dict_store)) {
+        wprintf(L"Словари перезагружаются при изменении файлов\n");
+    }
+    if (setup_xkb_events(&sw)) {
+        wprintf(L"Subscribed to XkbStateNotify\n");
+    } else if ((sw.layout_monitor = start_layout_monitor())) {
+        wprintf(L"Раскладка отслеживается через gsettings monitor\n");
+    } else {
+        wprintf(L"Нет источника событий раскладки, отслеживается сочетание клавиш\n");
+    }
+    static WindowCache window_cache;
+    if (init_window_cache(&window_cache, display)) {
+        sw.windows = &window_cache;
+        window_focus_changed(&sw);
+        wprintf(window_cache.net_active_window != None ? L"Активное окно отслеживается по _NET_ACTIVE_WINDOW\n"
+                                                       : L"Активное окно отслеживается по FocusIn/FocusOut\n");
+    }
+    static SelectionService selection;
+    if (init_selection_service(&selection, display)) {
+        sw.selection = &selection;
+        wprintf(L"Pause конвертирует выделенный текст, Shift + Pause — буфер обмена\n");
+    }
 
-            // Обработка ручного переключения раскладки
-            if ((shift_pressed && alt_pressed) || (super_pressed && ev.code == SPACE_KEY_CODE && ev.value == 1)) {
-                wprintf(L"Detected manual %ls, updating layout\n", use_super_space ? L"Super + Space" : L"Shift + Alt");
-                update_system_layout(display, &system_layout);
-                sync_xkb_state(xkb_state, system_layout);
-            }
-        } else if (ev.type == EV_KEY && ev.value == 0) {
-            if (ev.code == LEFTSHIFT_KEY_CODE) {
-                shift_pressed = false;
-            } else if (ev.code == LEFTALT_KEY_CODE) {
-                alt_pressed = false;
-            } else if (ev.code == LEFTMETA_KEY_CODE) {
-                super_pressed = false;
-            }
-        }
+    // Ненулевой код выхода — сбой конвейера: менеджер сеанса перезапустит демон
+    int status = 1;
+    static Pipeline pipeline;
+    if (start_pipeline(&pipeline, device_paths, device_path_count, uinput_keys, &injector)) {
+        sw.pipeline = &pipeline;
+        wprintf(L"Слушаю ввод... Нажмите ESC для выхода.\n");
+        status = run_event_loop(&sw, &pipeline) < 0 ? 1 : 0;
+        stop_pipeline(&pipeline);
+        wprintf(L"Конвейер: %lu нажатий захвачено, %lu заданий выполнено, очередь нажатий до %zu, заданий до %zu\n",
+                pipeline.captured_events, pipeline.executed_jobs,
+                pipeline.max_captured_backlog, pipeline.max_jobs_backlog);
+        wprintf(L"Клавиатуры: %lu подключений, %lu отключений\n", pipeline.attached_devices, pipeline.detached_devices);
+    }
+    free_pipeline(&pipeline);
+    stop_layout_monitor(sw.layout_monitor);
+    if (sw.windows) {
+        wprintf(L"Окна: %lu смен фокуса, профиль из кеша %lu раз, запрошен %lu раз; "
+                L"восстановлено раскладок %lu, пропущено слов в исключённых окнах %lu\n",
+                window_cache.focus_changes, window_cache.hits, window_cache.misses, window_cache.restores,
+                window_cache.excluded_words);
+    }
+    if (sw.selection) {
+        wprintf(L"Выделение: %lu конвертаций\n", selection.conversions);
+        free_selection_service(&selection, display);
+    }
+    stop_dict_watcher(&dict_store);
+    close_learn_store(&learn_store);
+    wprintf(L"Обучение: %zu слов, %lu дописываний журнала\n", learn_store.count, learn_store.batches);
+    if (dict_store.reloads || dict_store.failed_reloads) {
+        wprintf(L"Словари: %lu перезагрузок, %lu неудачных\n", dict_store.reloads, dict_store.failed_reloads);
     }
 
+    wprintf(L"Раскладка: %lu чтений кеша, %lu обновлений по событиям, %lu по сочетанию; "
+            L"не понадобилось %lu запросов XkbGetState и %lu запусков gsettings\n",
+            sw.layout_stats.reads, sw.layout_stats.event_updates, sw.layout_stats.manual_toggles,
+            sw.layout_stats.x11_queries_avoided, sw.layout_stats.forks_avoided);
+
+    char metrics_text[2048];
+    format_metrics(metrics_text, sizeof(metrics_text));
+    wprintf(L"Метрики:\n%hs", metrics_text);
+    wprintf(L"Инжекция: %lu пакетов, %lu событий, %lu вызовов write\n",
+            injector.flushes, injector.events_sent, injector.writes);
+    if (injector.display) XCloseDisplay(injector.display);
     ioctl(uinput_fd, UI_DEV_DESTROY);
     close(uinput_fd);
-    close(input_fd);
     xkb_state_unref(xkb_state);
     xkb_keymap_unref(xkb_keymap);
     xkb_context_unref(xkb_context);
     if (display) XCloseDisplay(display);
-    free_dictionary(&eng_dict);
-    free_dictionary(&rus_dict);
-    wprintf(L"Программа завершена.\n");
-    return 0;
+    // Поток перезагрузки остановлен, набор больше никто не подменит
+    DictSet *last_set = atomic_load(&dict_store.current);
+    free_dict_set(last_set);
+    free(last_set);
+    wprintf(status ? L"Программа завершена с ошибкой.\n" : L"Программа завершена.\n");
+    return status;
 }
\ No newline at end of file